@@ -1,109 +1,460 @@
 #pragma once
 
-#include <map>
 #include <unordered_map>
+#include <vector>
 #include <string>
 #include <string_view>
 #include <fstream>
 #include <optional>
 #include <type_traits>
 #include <cstdint>
+#include <limits>
 #include <array>
 #include <exception>
 #include <memory>
+#include <memory_resource>
+#include <shared_mutex>
+#include <mutex>
+#include <atomic>
+#include <chrono>
 #include <functional>
+#include <cstdio>
 
 namespace KV
 {
 	void setDebugCallback( std::function< void( const std::string_view &output ) > callback );
 
+	// Compiled form of a conditional expression. It refers to conditions by name and doesn't depend on any
+	// engine, so nodes parsed with ParseOptions::keepConditionals can hold on to it and be evaluated later.
+	struct CompiledExpression;
+
 	class ExpressionEngine
 	{
 		friend class KeyValues;
+		friend class Parser;
+		friend class ChunkParser;
 	public:
 		struct ExpressionResult
 		{
+			ExpressionResult( bool result, size_t end ) : result( result ), end( end ) {}
+
+			static ExpressionResult makeError( std::string error, size_t offset )
+			{
+				ExpressionResult errorResult( false, offset );
+				errorResult.error = std::move( error );
+
+				return errorResult;
+			}
+
 			bool result;
-			size_t end;
+			size_t end; // Offset of the closing ']', or of the error
+			std::string error; // Empty if the expression is valid
 		};
 
 		ExpressionEngine( bool useAutomaticDefaults = true );
+		ExpressionEngine( const ExpressionEngine &other );
+		ExpressionEngine &operator=( const ExpressionEngine &other );
 
 		void setCondition( const std::string &condition, bool value );
 		bool getCondition( const std::string &condition ) const;
 
 	protected:
-		ExpressionResult evaluateExpression( const std::string_view &expression, const size_t offset = 0 ) const;
+		// Expressions are compiled the first time their text is seen and cached, later occurrences of the same
+		// text only run the compiled form against the bitset of active conditions
+		ExpressionResult evaluateExpression( const std::string_view &expression, const size_t offset = 0, const size_t maxDepth = std::numeric_limits< size_t >::max() ) const;
 
 	private:
-		std::unordered_map< std::string, bool > conditions;
+		// A compiled expression along with the indices its condition names have in this engine
+		struct CachedExpression
+		{
+			std::shared_ptr< const CompiledExpression > compiled;
+			std::vector< uint32_t > conditions;
+		};
+
+		// Like evaluateExpression, but only compiles the expression
+		ExpressionResult compileCondition( const std::string_view &expression, const size_t offset, const size_t maxDepth, std::shared_ptr< const CompiledExpression > &compiled ) const;
+		bool evaluateCondition( const CompiledExpression &compiled ) const;
+
+		// Finds the expression starting with the '[' at 'offset' in the cache, or compiles it into 'entry'. 'found' points
+		// to whichever one holds it.
+		ExpressionResult findExpression( const std::string_view &expression, const size_t offset, const size_t maxDepth, const CachedExpression *&found, CachedExpression &entry ) const;
+		ExpressionResult compileExpression( const std::string_view &expression, const size_t offset, const size_t maxDepth, CompiledExpression &compiled ) const;
+		std::vector< uint32_t > resolveConditions( const CompiledExpression &compiled ) const;
+		bool runExpression( const CompiledExpression &compiled, const uint32_t *conditions ) const;
+		bool testCondition( uint32_t index ) const;
+
+		constexpr static const size_t cMaxCachedExpressions = 4096;
+
+		// Identifies the set of active conditions, so documents parsed with them can be told apart
+		uint64_t hashActiveConditions() const;
+
+		// Condition names are interned to dense indices into 'activeConditions'
+		std::unordered_map< std::string, uint32_t > conditionIndices;
+		std::vector< uint64_t > activeConditions;
+
+		// Keyed by expression text, the keys view the text held by the compiled expressions
+		mutable std::unordered_map< std::string_view, CachedExpression > compiledExpressions;
+		mutable std::shared_mutex compiledMutex;
+	};
+
+	class KeyValues;
+
+	// Receives the contents of a document as it's parsed by KeyValues::parseEvents, without a tree being built.
+	// Strings passed to the handler view the parsed buffer.
+	class ParseHandler
+	{
+	public:
+		enum class Action
+		{
+			Continue,
+			SkipSection, // Only from onSectionBegin, the section's contents are skipped and onSectionEnd isn't raised for it
+			Stop
+		};
+
+		virtual ~ParseHandler() = default;
+
+		virtual Action onSectionBegin( const std::string_view &key ) { ( void )key; return Action::Continue; }
+		virtual Action onKeyValue( const std::string_view &key, const std::string_view &value ) { ( void )key; ( void )value; return Action::Continue; }
+		virtual Action onSectionEnd() { return Action::Continue; }
+	};
+
+	enum class ParseErrorCode
+	{
+		UnexpectedSectionStart, // '{' without a key
+		UnexpectedSectionEnd, // '}' or the end of the input right after a key
+		UnexpectedExpressionStart, // '[' without a key
+		UnexpectedExpressionEnd, // ']' outside of an expression
+		InvalidExpression,
+		UnterminatedQuote,
+		UnterminatedSection, // The input ended inside a section
+		InputTooLarge,
+		NestedTooDeep,
+		TooManyNodes,
+		FileError, // The file couldn't be opened or read
+		InvalidBinary // Binary input that's cut short or malformed, see KeyValues::parseFromBinary
+	};
+
+	struct ParseDiagnostic
+	{
+		ParseErrorCode code;
+		size_t offset; // In bytes from the start of the input
+		size_t line; // 1 based, 0 for FileError
+		size_t column; // 0 based, in UTF-8 characters
+		std::string message;
+	};
+
+	struct ParseOptions
+	{
+		// Allocate every node, key, value and child list of the document from a monotonic arena
+		// owned by the root. Destroying the document then only releases the arena's blocks.
+		bool useArena = false;
+		size_t arenaBlockSize = 64 * 1024;
+
+		// Keys and values view the source buffer instead of being copied out of it. The buffer has to
+		// outlive the document, use parseFromOwnedBuffer to hand it over to the document instead.
+		bool zeroCopy = false;
+
+		// Limits for untrusted input, exceeding one is reported as a parse error
+		size_t maxInputSize = std::numeric_limits< size_t >::max(); // In bytes
+		size_t maxDepth = std::numeric_limits< size_t >::max(); // Nesting of sections and of parentheses in expressions
+		size_t maxNodes = std::numeric_limits< size_t >::max();
+
+		// Top level sections are parsed on this many threads when building a tree, 0 uses one per hardware thread.
+		// Documents that can't be split, or that have errors, are parsed on the calling thread.
+		size_t parseThreads = 1;
+
+		// Carry on after a syntax error instead of stopping at the first one, skipping to the next line or to the
+		// '}' closing the current section. Exceeding a limit still stops the parse. Ignored by StreamParser.
+		bool recoverFromErrors = false;
+
+		// Conditionals aren't evaluated, nodes carrying one are all kept with the compiled expression attached. Use
+		// KeyValues::isActive or KeyValues::materialize to apply the conditions of any ExpressionEngine afterwards.
+		// Only applies when building a tree.
+		bool keepConditionals = false;
+
+		// Typed reads of a value keep the number they parsed in the node, so reading it again costs a load until the
+		// value is set again. Reads then write to the node, don't enable this for documents read from several threads.
+		bool cacheNumericValues = false;
+
+		// parseFromFile and tryParseFromFile keep a Snapshot of every file they parse without errors in this directory,
+		// and load it instead of parsing the file again as long as the file's contents and the expression engine's
+		// conditions are the same. Empty disables the cache, as does keepConditionals since snapshots don't hold them.
+		std::string snapshotCacheDirectory;
+
+		// Sections are only matched up to their closing brace, their contents are parsed the first time they're iterated or
+		// looked into, one level at a time. The document keeps a copy of the input, or with zeroCopy the input itself, so a
+		// file parsed that way must not change while the document is alive. Errors inside a section are only found when it's
+		// parsed, they're piped to the debug callback and the section keeps what was parsed before them. Limits still apply,
+		// counted across the whole document. Reading a lazy document writes to it, call KeyValues::expandAll before reading
+		// it from several threads. Ignored along with keepConditionals, and by the tryParse functions, which have to find
+		// every error up front to return it. Lazy documents aren't stored in the snapshot cache.
+		bool lazySections = false;
+
+		// Hashes every node once the document is parsed, instead of on the first call to KeyValues::getContentHash. That
+		// writes to the nodes, so enable this for documents that are hashed or compared from several threads. Parses lazy
+		// sections right away.
+		bool hashContents = false;
 	};
 
+	struct SaveOptions
+	{
+		// Leave out indentation and line breaks, only writing a space between strings that need one, and only quote
+		// strings that would be read differently without quotes. Every top level node still ends with a line break.
+		bool compact = false;
+
+		// saveToBuffer and saveToFile serialize on this many threads, 0 uses one per hardware thread. Top level nodes are
+		// shared out between them, or the children of sections when there are too few. The output doesn't change, files
+		// are written with positional writes as each part is ready. saveToSink always saves on the calling thread.
+		size_t saveThreads = 1;
+	};
+
+	// Receives the text of a document as it's saved by KeyValues::saveToSink. The serializer does its own
+	// buffering, writes come in chunks of up to 16 KiB, or larger when a single string is.
+	class OutputSink
+	{
+	public:
+		virtual ~OutputSink() = default;
+
+		// Returns false if the output failed, which ends the save
+		virtual bool write( const char *data, size_t size ) = 0;
+	};
+
+	// Writes to a stdio stream, which is left open
+	class FileSink : public OutputSink
+	{
+	public:
+		explicit FileSink( FILE *file ) : file( file ) {}
+
+		bool write( const char *data, size_t size ) override;
+
+	private:
+		FILE *file;
+	};
+
+	// Writes to a file descriptor, which is left open. Partial writes are carried on.
+	class DescriptorSink : public OutputSink
+	{
+	public:
+		explicit DescriptorSink( int fd ) : fd( fd ) {}
+
+		bool write( const char *data, size_t size ) override;
+
+	private:
+		int fd;
+	};
+
+	// Text of a node. Short strings are stored inline, longer ones are either allocated
+	// from the node's memory resource, so the owner has to hand the same resource back
+	// when releasing it, or borrowed from a source buffer the document keeps alive.
+	class NodeString
+	{
+	public:
+		NodeString() : data( nullptr ) {}
+		NodeString( NodeString &&other ) noexcept;
+
+		NodeString( const NodeString& ) = delete;
+		NodeString &operator=( const NodeString& ) = delete;
+
+		void assign( const std::string_view &str, std::pmr::memory_resource *resource );
+		void borrow( const std::string_view &str, std::pmr::memory_resource *resource );
+		void release( std::pmr::memory_resource *resource );
+
+		std::string_view view() const noexcept { return std::string_view( ( storage == Storage::Inline ) ? local : data, size ); }
+		bool isBorrowed() const noexcept { return ( storage == Storage::Borrowed ); }
+
+	private:
+		constexpr static const size_t cLocalCapacity = 16;
+
+		enum class Storage : uint8_t
+		{
+			Inline,
+			Allocated,
+			Borrowed
+		};
+
+		union
+		{
+			const char *data;
+			char local[ cLocalCapacity ];
+		};
+
+		uint32_t size = 0;
+		Storage storage = Storage::Inline;
+	};
+
+	// Child storage for KeyValues. Children are kept in insertion order in a single
+	// vector, duplicate keys are allowed. Once a section grows past a handful of
+	// children a hash index over the keys is built so lookups by name and access to
+	// the n-th duplicate of a name are O(1) on average.
+	//
+	// Children are allocated from the container's memory resource. If the resource is
+	// an arena owned by the document, children are never destroyed individually.
+	class ChildContainer
+	{
+		friend class KeyValues;
+
+	public:
+		using container_type = std::pmr::vector< KeyValues* >;
+
+		ChildContainer() : ChildContainer( std::pmr::get_default_resource(), false ) {}
+		ChildContainer( std::pmr::memory_resource *resource, bool arenaBacked );
+		ChildContainer( ChildContainer &&other ) noexcept;
+		~ChildContainer();
+
+		ChildContainer &operator=( ChildContainer && ) = delete;
+
+		KeyValues &push_back( KeyValues *kv );
+
+		KeyValues *find( const std::string_view &name ) const;
+		KeyValues *find( const std::string_view &name, size_t index ) const; // Returns the index-th child named 'name', nullptr if it doesn't exist
+		size_t count( const std::string_view &name ) const;
+
+		bool erase( const std::string_view &name, size_t index = 0 );
+		void clear();
+
+		size_t size() const noexcept { return children.size(); }
+		bool empty() const noexcept { return children.empty(); }
+
+		std::pmr::memory_resource *getResource() const noexcept { return resource; }
+		bool isArenaBacked() const noexcept { return arenaBacked; }
+
+		container_type::iterator begin() noexcept { return children.begin(); }
+		container_type::iterator end() noexcept { return children.end(); }
+		container_type::const_iterator begin() const noexcept { return children.cbegin(); }
+		container_type::const_iterator end() const noexcept { return children.cend(); }
+
+	private:
+		// Sections smaller than this are searched linearly, it's cheaper than hashing
+		constexpr static const size_t cIndexThreshold = 16;
+		constexpr static const uint32_t cEmptySlot = 0;
+
+		// All children sharing one key. The first position is stored inline since most keys are unique.
+		struct KeyGroup
+		{
+			std::string_view name;
+			size_t hash;
+			uint32_t first;
+			std::pmr::vector< uint32_t > duplicates;
+
+			size_t size() const { return 1 + duplicates.size(); }
+			uint32_t at( size_t index ) const { return ( index == 0 ) ? first : duplicates[ index - 1 ]; }
+		};
+
+		bool isIndexed() const noexcept { return !slots.empty(); }
+
+		void destroy( KeyValues *kv );
+		void release() noexcept; // Forgets every child without destroying it, once another container took them over
+
+		void buildIndex();
+		void rebuildSlots();
+		void indexChild( uint32_t position );
+		size_t findGroup( const std::string_view &name, size_t hash ) const; // Returns group index or std::string::npos
+		size_t findPosition( const std::string_view &name, size_t index ) const;
+
+		std::pmr::memory_resource *resource;
+		bool arenaBacked;
+
+		container_type children;
+
+		// Open addressing table of ( group index + 1 ), power of two sized
+		std::pmr::vector< uint32_t > slots;
+		std::pmr::vector< KeyGroup > groups;
+	};
+
+	struct ParseResult;
+	class SnapshotView;
+	class KeyPath;
+
 	class KeyValues
 	{
-		constexpr static const std::array< char, 4 > cWhiteSpace = { ' ', '\t', '\n', '\r' };
+		friend class ChildContainer;
+		friend class TreeBuilder;
+		friend class BinaryParser;
+		friend class Snapshot;
+		friend class SnapshotView;
+		friend class SnapshotWriter;
+		friend class SnapshotCache;
+		friend class PersistentView;
+		friend class PersistentDocument;
+		template< typename Output > friend class Serializer;
+		template< typename Output > friend class BinarySerializer;
 
 	public:
 
 		KeyValues() = default;
 
 		KeyValues( KeyValues &&other ) noexcept :
+			arena( std::move( other.arena ) ),
+			source( std::move( other.source ) ),
 			key( std::move( other.key ) ),
 			value( std::move( other.value ) ),
+			hasValue( other.hasValue ),
+			cacheNumbers( other.cacheNumbers ),
+			valueIsNumber( other.valueIsNumber ),
+			lazy( other.lazy ),
+			lazyDocument( other.lazyDocument ),
+			numericValue( other.numericValue ),
+			contentHash( other.contentHash ),
+			hashValid( other.hashValid ),
 			parentKV( std::move( other.parentKV ) ),
 			depth( std::move( other.depth ) ),
+			condition( other.condition ),
 			keyvalues( std::move( other.keyvalues ) )
-		{}
-
-		struct kvCompare
 		{
-			// This should ensure that multimap elements are in order of insertion
-			bool operator() ( const std::string&, const std::string& ) const { return false; }
-		};
+			other.hasValue = false;
+			other.lazy = false;
+
+			for ( auto &kv : keyvalues )
+				kv->parentKV = this;
+		}
+
+		~KeyValues();
 
 		struct iterator
 		{
-			using multimap_iterator = std::multimap< std::string, std::unique_ptr< KeyValues >, KeyValues::kvCompare >::iterator;
+			using child_iterator = ChildContainer::container_type::iterator;
 
-			iterator( multimap_iterator it ) : it( it ) {}
+			iterator( child_iterator it ) : it( it ) {}
 			iterator operator++() { ++it; return *this; }
 			bool operator!=( const iterator &other ) const { return ( it != other.it ); }
 
-			KeyValues &operator*() { return *it->second; }
-			const KeyValues &operator*() const { return *it->second; }
+			KeyValues &operator*() { return **it; }
+			const KeyValues &operator*() const { return **it; }
 
 		private:
-			multimap_iterator it;
+			child_iterator it;
 		};
 
 		struct const_iterator
 		{
-			using const_multimap_iterator = std::multimap< std::string, std::unique_ptr< KeyValues >, KeyValues::kvCompare >::const_iterator;
+			using const_child_iterator = ChildContainer::container_type::const_iterator;
 
-			const_iterator( const_multimap_iterator it ) : it( it ) {}
+			const_iterator( const_child_iterator it ) : it( it ) {}
 			const_iterator operator++() { ++it; return *this; }
 			bool operator!=( const const_iterator &other ) const { return ( it != other.it ); }
 
-			const KeyValues &operator*() const { return *it->second; }
+			const KeyValues &operator*() const { return **it; }
 
 		private:
-			const_multimap_iterator it;
+			const_child_iterator it;
 		};
 
-		iterator begin() noexcept { return iterator( keyvalues.begin() ); }
-		iterator end() noexcept { return iterator( keyvalues.end() ); }
+		// These parse the section first if it's lazy, see ParseOptions::lazySections
+		iterator begin() { expand(); return iterator( keyvalues.begin() ); }
+		iterator end() { expand(); return iterator( keyvalues.end() ); }
 
-		const_iterator begin() const noexcept { return const_iterator( keyvalues.cbegin() ); }
-		const_iterator end() const noexcept { return const_iterator( keyvalues.cend() ); }
+		const_iterator begin() const { expand(); return const_iterator( keyvalues.begin() ); }
+		const_iterator end() const { expand(); return const_iterator( keyvalues.end() ); }
 
-		const_iterator cbegin() const noexcept { return const_iterator( keyvalues.cbegin() ); }
-		const_iterator cend() const noexcept { return const_iterator( keyvalues.cend() ); }
+		const_iterator cbegin() const { return begin(); }
+		const_iterator cend() const { return end(); }
 
 		KeyValues &getRoot();
+		const KeyValues &getRoot() const;
 		KeyValues &getParent() { return *parentKV; }
 
 		bool isRoot() const noexcept { return ( parentKV == nullptr ); }
-		bool isEmpty() const noexcept { return keyvalues.empty(); }
+		bool isEmpty() const { expand(); return keyvalues.empty(); }
 
 		bool hasParent() const noexcept { return !isRoot(); }
 
@@ -119,63 +470,794 @@ namespace KV
 
 		KeyValues &operator=( const char *kvValue ) { setKeyValue( kvValue ); return *this; }
 		KeyValues &operator=( const std::string &kvValue ) { setKeyValue( kvValue ); return *this; }
-		KeyValues &operator=( bool kvValue ) { setKeyValue( toString( kvValue ) ); return *this; }
-		KeyValues &operator=( uint8_t kvValue ) { setKeyValue( toString( kvValue ) ); return *this; }
-		KeyValues &operator=( uint16_t kvValue ) { setKeyValue( toString( kvValue ) ); return *this; }
-		KeyValues &operator=( uint32_t kvValue ) { setKeyValue( toString( kvValue ) ); return *this; }
-		KeyValues &operator=( uint64_t kvValue ) { setKeyValue( toString( kvValue ) ); return *this; }
-		KeyValues &operator=( int8_t kvValue ) { setKeyValue( toString( kvValue ) ); return *this; }
-		KeyValues &operator=( int16_t kvValue ) { setKeyValue( toString( kvValue ) ); return *this; }
-		KeyValues &operator=( int32_t kvValue ) { setKeyValue( toString( kvValue ) ); return *this; }
-		KeyValues &operator=( int64_t kvValue ) { setKeyValue( toString( kvValue ) ); return *this; }
-		KeyValues &operator=( float kvValue ) { setKeyValue( toString( kvValue ) ); return *this; }
-		KeyValues &operator=( double kvValue ) { setKeyValue( toString( kvValue ) ); return *this; }
+
+		// Numbers are stored as they are and only turned into text when it's asked for, or when the document is saved.
+		// Floating point numbers are written in the shortest form that reads back to the same number.
+		KeyValues &operator=( bool kvValue ) { setNumber( kvValue ); return *this; }
+		KeyValues &operator=( uint8_t kvValue ) { setNumber( kvValue ); return *this; }
+		KeyValues &operator=( uint16_t kvValue ) { setNumber( kvValue ); return *this; }
+		KeyValues &operator=( uint32_t kvValue ) { setNumber( kvValue ); return *this; }
+		KeyValues &operator=( uint64_t kvValue ) { setNumber( kvValue ); return *this; }
+		KeyValues &operator=( int8_t kvValue ) { setNumber( kvValue ); return *this; }
+		KeyValues &operator=( int16_t kvValue ) { setNumber( kvValue ); return *this; }
+		KeyValues &operator=( int32_t kvValue ) { setNumber( kvValue ); return *this; }
+		KeyValues &operator=( int64_t kvValue ) { setNumber( kvValue ); return *this; }
+		KeyValues &operator=( float kvValue ) { setNumber( kvValue ); return *this; }
+		KeyValues &operator=( double kvValue ) { setNumber( kvValue ); return *this; }
 
 		// Returns number of keys of the specified name we have
 		size_t getCount( const std::string &name ) const;
 
-		bool isSection() const { return !value.has_value(); }
+		// Like get, but nothing is built to look the key up. Returns nullptr if there's no index-th child named 'name'.
+		KeyValues *find( const std::string_view &name, size_t index = 0 ) { expand(); return keyvalues.find( name, index ); }
+		const KeyValues *find( const std::string_view &name, size_t index = 0 ) const { expand(); return keyvalues.find( name, index ); }
+
+		// Returns the first node below this one matching 'path', nullptr if there's none
+		KeyValues *find( const KeyPath &path );
+		const KeyValues *find( const KeyPath &path ) const;
+
+		bool isSection() const { return !hasValue; }
 		
-		std::string getKey() const { return ( key ) ? *key : std::string(); }
-		std::string getValue( const std::string &defaultVal = std::string() ) const { return ( value.value_or( defaultVal ) ); }
+		std::string getKey() const { return std::string( key.view() ); }
+		std::string_view getKeyView() const noexcept { return key.view(); }
+		std::string getValue( const std::string &defaultVal = std::string() ) const;
 
 		bool getValueAsBool( bool defaultVal = false ) const;
 		int getValueAsInt( int defaultVal = 0 ) const;
 		float getValueAsFloat( float defaultVal = 0.0f ) const;
 		double getValueAsDouble( double defaultVal = 0.0 ) const;
 
+		// Converts the value with std::from_chars, never throws. Returns 'defaultVal' if there's no value, it doesn't start
+		// with a number or the number doesn't fit in T. Leading whitespace and a '+' sign are skipped and whatever follows
+		// the number is ignored, like std::stoi does. Bools are read as integers, anything but 0 is true.
+		template< typename T >
+		T getValueAs( T defaultVal = T() ) const
+		{
+			T number;
+			return ( narrowNumber( number, [ this ]( auto &wide ) { return readNumber( wide ); } ) ) ? number : defaultVal;
+		}
+
+		// Values holding several numbers, like "1 0.5 0.25" or "[0 0 1]". The numbers are separated by whitespace, brackets
+		// and braces around them are skipped, and each one is read like getValueAs reads a value. Nothing is allocated.
+
+		// Reads up to 'count' numbers into 'out', stopping at the first one that isn't a number of type T. Returns how many were read.
+		template< typename T >
+		size_t getValueAsArray( T *out, size_t count ) const
+		{
+			if ( !hasValue )
+				return 0;
+
+			NumberBuffer buffer;
+			std::string_view text = getValueText( buffer );
+			std::string_view component;
+			size_t read = 0;
+
+			while ( read < count && nextComponent( text, component ) && narrowNumber( out[ read ], [ &component ]( auto &wide ) { return parseNumber( component, wide ); } ) )
+				++read;
+
+			return read;
+		}
+
+		// Returns 'defaultVal' unless the value starts with N numbers of type T
+		template< size_t N, typename T >
+		std::array< T, N > getValueAsVector( const std::array< T, N > &defaultVal = {} ) const
+		{
+			std::array< T, N > numbers;
+			return ( getValueAsArray( numbers.data(), N ) == N ) ? numbers : defaultVal;
+		}
+
+		// Appends the value of every child's first 'keyName' key to 'out', read like getValueAsVector does. Children without
+		// such a key get 'defaultVal', so 'out' lines up with the children.
+		template< size_t N, typename T >
+		void getChildValuesAsVector( const std::string_view &keyName, std::vector< std::array< T, N > > &out, const std::array< T, N > &defaultVal = {} ) const
+		{
+			expand();
+			out.reserve( out.size() + keyvalues.size() );
+
+			for ( const KeyValues *child : keyvalues )
+			{
+				const KeyValues *kv = child->find( keyName );
+				out.push_back( ( kv ) ? kv->getValueAsVector< N, T >( defaultVal ) : defaultVal );
+			}
+		}
+
 		std::string getKeyValue( const std::string &keyName, size_t index, const std::string &defaultVal = std::string() ) const;
 		std::string getKeyValue( const std::string &keyName, const std::string &defaultVal = std::string() ) const;
 
 		size_t getDepth() const { return depth; }
 
-		static KeyValues parseFromFile( const std::string &kvPath, ExpressionEngine expressionEngine = ExpressionEngine( true ) );
-		static KeyValues parseFromBuffer( const std::string_view &buffer, ExpressionEngine expressionEngine = ExpressionEngine( true ) );
+		// Parses every lazy section below this node, so the document can be read from several threads
+		void expandAll() const;
+
+		// Hash of the node's value, or of its children's keys and contents in order, leaving out its own key. Hashes are
+		// computed bottom up the first time they're asked for and kept in the nodes, changing a node only drops the ones
+		// above it so asking again only hashes those. Numbers are hashed as their text, conditions aren't hashed. Stable
+		// across runs and platforms, and the same as a PersistentView's with the same contents, so it can be stored as a
+		// cache key. Computing hashes writes to the nodes, see ParseOptions::hashContents.
+		uint64_t getContentHash() const;
+
+		// Nodes are equal if their keys are, along with their values or their children in order. Wherever both sides' hashes
+		// are known nodes whose hashes differ are told apart without looking further, everything else is compared up to the
+		// first difference. Hashes aren't computed by comparing.
+		bool operator==( const KeyValues &other ) const;
+		bool operator!=( const KeyValues &other ) const { return !( *this == other ); }
+
+		// Conditionals kept by ParseOptions::keepConditionals
+		bool hasCondition() const noexcept { return ( condition != nullptr ); }
+		std::string_view getCondition() const; // The expression's text, brackets included, empty without one
+		bool isActive( const ExpressionEngine &expressionEngine ) const; // True without a condition
+
+		// Copies this node's children into a new document, leaving out every node whose condition is false for
+		// 'expressionEngine' along with everything below it. Each distinct expression is only evaluated once.
+		// The copy is arena backed if this document is.
+		KeyValues materialize( const ExpressionEngine &expressionEngine ) const;
+
+		// The file is memory mapped rather than read into a copy. With ParseOptions::zeroCopy the document keeps
+		// referencing the mapping, so the file must not be truncated while it's alive. Returns an empty document
+		// and reports to the debug callback if the file can't be opened.
+		static KeyValues parseFromFile( const std::string &kvPath, const ExpressionEngine &expressionEngine = ExpressionEngine( true ), const ParseOptions &options = ParseOptions() );
+		static KeyValues parseFromBuffer( const std::string_view &buffer, const ExpressionEngine &expressionEngine = ExpressionEngine( true ), const ParseOptions &options = ParseOptions() );
+
+		// Parses without building a tree, raising events on 'handler' instead. Memory use only depends on the nesting depth.
+		// Returns false if there was a parse error, errors are piped to the debug callback like with parseFromBuffer.
+		static bool parseEvents( const std::string_view &buffer, ParseHandler &handler, const ExpressionEngine &expressionEngine = ExpressionEngine( true ), const ParseOptions &options = ParseOptions() );
+
+		// Never throw or touch the debug callback, errors are returned with the document instead
+		static ParseResult tryParseFromFile( const std::string &kvPath, const ExpressionEngine &expressionEngine = ExpressionEngine( true ), const ParseOptions &options = ParseOptions() );
+		static ParseResult tryParseFromBuffer( const std::string_view &buffer, const ExpressionEngine &expressionEngine = ExpressionEngine( true ), const ParseOptions &options = ParseOptions() );
+
+		// Parses in zero copy mode, the document takes ownership of the buffer its keys and values view
+		static KeyValues parseFromOwnedBuffer( std::string buffer, const ExpressionEngine &expressionEngine = ExpressionEngine( true ), ParseOptions options = ParseOptions() );
+
+		// These all save the whole document this node belongs to. Nothing is allocated per node, and nothing is
+		// written for an empty document.
+		bool saveToFile( const std::string &kvPath, const SaveOptions &options = SaveOptions() ) const; // Returns false if the file couldn't be written
+		void saveToBuffer( std::string &out, const SaveOptions &options = SaveOptions() ) const; // Replaces 'out', sized up front
+		bool saveToSink( OutputSink &sink, const SaveOptions &options = SaveOptions() ) const; // Returns false if the sink failed
+		size_t getSaveSize( const SaveOptions &options = SaveOptions() ) const; // Bytes saveToBuffer would write
 
-		void saveToFile( const std::string &kvPath );
-		void saveToBuffer( std::string &out );
+		// Valve's binary format, which stores numbers and colors typed rather than as text. They're read back as numbers, so
+		// the typed reads don't parse anything. Numbers that don't fit one of the binary types, like doubles a float can't
+		// hold exactly, are written as strings. Keys and strings are cut short at the first null character they hold.
+		// Malformed input is reported like parse errors are, with a line and column of 0.
+		static KeyValues parseFromBinary( const std::string_view &buffer, const ParseOptions &options = ParseOptions() );
+		static KeyValues parseFromBinaryFile( const std::string &path, const ParseOptions &options = ParseOptions() );
+		static ParseResult tryParseFromBinary( const std::string_view &buffer, const ParseOptions &options = ParseOptions() );
+
+		void saveToBinary( std::string &out ) const;
+		bool saveToBinary( OutputSink &sink ) const; // Returns false if the sink failed
+		bool saveToBinaryFile( const std::string &path ) const; // Returns false if the file couldn't be written
+
+		// Flattens the whole document into a Snapshot. Returns false if it has too many nodes for the format, over 4 billion.
+		bool saveToSnapshot( std::string &out ) const;
+		bool saveToSnapshotFile( const std::string &path ) const; // Also returns false if the file couldn't be written
 
 		void setKeyValue( const std::string &kvValue );
 
 	private:
+		using Arena = std::pmr::monotonic_buffer_resource;
+
+		// The number a value was assigned, or the last number a typed read parsed out of its text when caching
+		// them, see ParseOptions::cacheNumericValues
+		struct NumericValue
+		{
+			enum class Type : uint8_t
+			{
+				Empty,
+				Integer,
+				Unsigned,
+				Float,
+				Double,
+				Pointer, // Only read from binary documents, held in unsignedInteger
+				Color // Only read from binary documents, written as "r g b a"
+			};
+
+			Type type = Type::Empty;
+			bool valid = false; // Whether the value held a number of that type
+
+			union
+			{
+				int64_t integer;
+				uint64_t unsignedInteger;
+				float floatNumber;
+				double doubleNumber;
+				uint8_t color[ 4 ];
+			};
+		};
+
+		KeyValues( std::pmr::memory_resource *resource, bool arenaBacked ) : keyvalues( resource, arenaBacked ) {}
+		explicit KeyValues( std::unique_ptr< Arena > documentArena ) : arena( std::move( documentArena ) ), keyvalues( arena.get(), true ) {}
+
+		// Parses 'buffer', keeping 'owner' alive for as long as the document exists
+		// With reportErrors set, errors are also piped to the debug callback
+		static ParseResult parseFile( const std::string &kvPath, const ExpressionEngine &expressionEngine, const ParseOptions &options, bool reportErrors );
+		static ParseResult parseDocument( const std::string_view &buffer, std::shared_ptr< const void > owner, const ExpressionEngine &expressionEngine, const ParseOptions &options, bool reportErrors );
+
+		static ParseResult parseBinaryDocument( const std::string_view &buffer, std::shared_ptr< const void > owner, const ParseOptions &options, bool reportErrors );
+
+		// Returns false if the buffer couldn't be split into top level sections or a section failed to parse
+		static bool parseInParallel( KeyValues &root, const std::string_view &buffer, const ExpressionEngine &expressionEngine, const ParseOptions &options );
+
+		// Allocates a child from our resource, the caller sets its key and adds it to keyvalues
+		KeyValues *allocateChild();
+		void adoptChildren( KeyValues &other ); // Moves other's children to the end of ours
+
+		// Like createKey/createKeyValue, but the node views the strings instead of copying them
+		KeyValues &createBorrowedKey( const std::string_view &name );
+		KeyValues &createBorrowedKeyValue( const std::string_view &name, const std::string_view &kvValue );
+
+		// Large enough for any number in its shortest form
+		using NumberBuffer = std::array< char, 32 >;
+
+		// Either the value's text or the number it holds written to 'buffer'
+		std::string_view getValueText( NumberBuffer &buffer ) const;
 
 		template< typename T >
-		std::string toString( T val )
+		void setNumber( T number )
 		{
-			return std::to_string( val );
+			NumericValue numeric;
+			numeric.valid = true;
+
+			if constexpr ( std::is_same_v< T, bool > )
+			{
+				numeric.type = NumericValue::Type::Integer;
+				numeric.integer = ( number ) ? 1 : 0;
+			}
+			else if constexpr ( std::is_same_v< T, float > )
+			{
+				numeric.type = NumericValue::Type::Float;
+				numeric.floatNumber = number;
+			}
+			else if constexpr ( std::is_floating_point_v< T > )
+			{
+				numeric.type = NumericValue::Type::Double;
+				numeric.doubleNumber = static_cast< double >( number );
+			}
+			else if constexpr ( std::is_signed_v< T > )
+			{
+				numeric.type = NumericValue::Type::Integer;
+				numeric.integer = number;
+			}
+			else
+			{
+				numeric.type = NumericValue::Type::Unsigned;
+				numeric.unsignedInteger = number;
+			}
+
+			setNumericValue( numeric );
+		}
+
+		// Parses a lazy section's contents into its children. Nested sections stay lazy.
+		void expand() const { if ( lazy ) expandSection(); }
+		void expandSection() const;
+
+		void setNumericValue( const NumericValue &numeric );
+		void makeValue(); // Turns a section into a value
+
+		// Drops the hashes of this node and the ones above it. A node whose hash is known has the hashes of everything
+		// below it too, so this stops at the first one that has none.
+		void invalidateHash() { for ( KeyValues *kv = this; kv && kv->hashValid; kv = kv->parentKV ) kv->hashValid = false; }
+
+		// Returns false if the value doesn't start with a number of type T, see getValueAs. Defined for int64_t,
+		// uint64_t, float and double, the types the numeric cache holds.
+		template< typename T >
+		bool readNumber( T &number ) const;
+
+		// Like readNumber, for a number that isn't the whole value
+		static bool parseNumber( const std::string_view &text, int64_t &number );
+		static bool parseNumber( const std::string_view &text, uint64_t &number );
+		static bool parseNumber( const std::string_view &text, float &number );
+		static bool parseNumber( const std::string_view &text, double &number );
+
+		// Takes the next whitespace, bracket or brace separated component off the front of 'text'. Returns false if there are none left.
+		static bool nextComponent( std::string_view &text, std::string_view &component );
+
+		// Reads a number with 'read', a callable taking an int64_t, uint64_t, float or double depending on T, and converts it
+		// to T. Returns false if there was no number or it doesn't fit. Bools are read as ints, anything but 0 is true.
+		template< typename T, typename Read >
+		static bool narrowNumber( T &number, Read &&read )
+		{
+			static_assert( std::is_arithmetic_v< T >, "Values can only be read as arithmetic types" );
+
+			if constexpr ( std::is_same_v< T, bool > )
+			{
+				int integer;
+				if ( !narrowNumber( integer, read ) )
+					return false;
+
+				number = ( integer != 0 );
+			}
+			else if constexpr ( std::is_same_v< T, float > )
+				return read( number );
+			else if constexpr ( std::is_floating_point_v< T > )
+			{
+				double wide;
+				if ( !read( wide ) )
+					return false;
+
+				number = static_cast< T >( wide );
+			}
+			else if constexpr ( std::is_signed_v< T > )
+			{
+				int64_t wide;
+				if ( !read( wide ) || wide < std::numeric_limits< T >::min() || wide > std::numeric_limits< T >::max() )
+					return false;
+
+				number = static_cast< T >( wide );
+			}
+			else
+			{
+				uint64_t wide;
+				if ( !read( wide ) || wide > std::numeric_limits< T >::max() )
+					return false;
+
+				number = static_cast< T >( wide );
+			}
+
+			return true;
 		}
 
 		// Used for creation only because we don't have to reconnect child parents to our parent
-		void setKeyValueFast( const std::string_view &kvValue ) { value = kvValue; }
+		void setKeyValueFast( const std::string_view &kvValue ) { value.assign( kvValue, keyvalues.getResource() ); hasValue = true; }
+
+		// Only set on the root of an arena backed document, must outlive everything below
+		std::unique_ptr< Arena > arena;
+
+		// Only set on the root of a zero copy document, keeps the buffer borrowed strings point into alive
+		std::shared_ptr< const void > source;
+
+		NodeString key;
+		NodeString value;
+		bool hasValue = false;
+
+		bool cacheNumbers = false; // Inherited by children
+		bool valueIsNumber = false; // The value is only held by 'numericValue', it was assigned a number
+
+		bool lazy = false; // A section that hasn't been parsed yet, 'value' views its contents
+		bool lazyDocument = false; // The root of a document with lazy sections, 'source' holds what's needed to parse them
+		mutable NumericValue numericValue;
 
-		// Pointer to string in parent's multimap
-		const std::string *key = nullptr;
-		std::optional< std::string > value = std::nullopt;
+		mutable uint64_t contentHash = 0; // Only meaningful while hashValid is set, see getContentHash
+		mutable bool hashValid = false;
 
 		KeyValues *parentKV = nullptr;
 		size_t depth = 0;		
 
-		std::multimap< std::string, std::unique_ptr< KeyValues >, kvCompare > keyvalues;
+		// Owned by the document's source, see ParseOptions::keepConditionals
+		const CompiledExpression *condition = nullptr;
+
+		ChildContainer keyvalues;
+	};
+
+	// The document is whatever could be parsed, everything up to the first error unless recovering from errors
+	struct ParseResult
+	{
+		KeyValues document;
+		std::vector< ParseDiagnostic > diagnostics;
+
+		bool succeeded() const { return diagnostics.empty(); }
+	};
+
+	class ChunkParser;
+
+	// Parses a document handed over in chunks of any size, as it comes off a socket or a pipe. Events are raised
+	// on the handler as soon as the input completing them has been fed, the strings they pass are only valid
+	// during the call. Memory use depends on the longest token and the nesting depth, not on the document size.
+	class StreamParser
+	{
+	public:
+		StreamParser( ParseHandler &handler, const ExpressionEngine &expressionEngine = ExpressionEngine( true ), const ParseOptions &options = ParseOptions() );
+		~StreamParser();
+
+		StreamParser( const StreamParser& ) = delete;
+		StreamParser &operator=( const StreamParser& ) = delete;
+
+		// Return false once there was a parse error, the handler stopped the parse or a stray '}' ended the
+		// document, the rest of the input is ignored then. Errors are piped to the debug callback.
+		bool feed( const std::string_view &chunk );
+		bool finish(); // Call at the end of the input, false if there was a parse error or the handler stopped the parse
+
+		const std::vector< ParseDiagnostic > &getDiagnostics() const;
+
+	private:
+		void reportErrors();
+
+		std::unique_ptr< ChunkParser > parser;
+		size_t reported = 0;
+	};
+
+	struct SnapshotNode;
+
+	// Read only view of a node in a Snapshot, navigated like KeyValues. Views are valid as long as their snapshot is.
+	// Looking up a key that doesn't exist gives an invalid view, which has no key, value or children.
+	class SnapshotView
+	{
+	public:
+		struct const_iterator
+		{
+			const_iterator( const char *base, const SnapshotNode *node ) : base( base ), node( node ) {}
+			const_iterator operator++();
+			bool operator!=( const const_iterator &other ) const { return ( node != other.node ); }
+
+			SnapshotView operator*() const { return SnapshotView( base, node ); }
+
+		private:
+			const char *base;
+			const SnapshotNode *node;
+		};
+
+		SnapshotView() = default;
+
+		bool isValid() const noexcept { return ( node != nullptr ); }
+		explicit operator bool() const noexcept { return isValid(); }
+
+		bool isSection() const;
+		bool isEmpty() const { return ( getChildCount() == 0 ); }
+		size_t getChildCount() const;
+
+		std::string_view getKey() const;
+		std::string_view getValue( const std::string_view &defaultVal = std::string_view() ) const;
+
+		// Reads the value like KeyValues::getValueAs does
+		template< typename T >
+		T getValueAs( T defaultVal = T() ) const
+		{
+			if ( !isValid() || isSection() )
+				return defaultVal;
+
+			const std::string_view text = getValue();
+			T number;
+
+			return ( KeyValues::narrowNumber( number, [ &text ]( auto &wide ) { return KeyValues::parseNumber( text, wide ); } ) ) ? number : defaultVal;
+		}
+
+		// Large sections are searched through the snapshot's child index, smaller ones linearly
+		SnapshotView get( const std::string_view &name, size_t index = 0 ) const; // Returns the index-th child named 'name'
+		SnapshotView operator[]( const std::string_view &name ) const { return get( name ); }
+		size_t getCount( const std::string_view &name ) const;
+
+		std::string_view getKeyValue( const std::string_view &keyName, const std::string_view &defaultVal = std::string_view() ) const;
+
+		const_iterator begin() const;
+		const_iterator end() const;
+
+	private:
+		friend class Snapshot;
+
+		SnapshotView( const char *base, const SnapshotNode *node ) : base( base ), node( node ) {}
+
+		std::string_view getString( uint64_t offset, uint32_t length ) const;
+
+		const char *base = nullptr; // Start of the snapshot
+		const SnapshotNode *node = nullptr;
+	};
+
+	// Flat, position independent copy of a document: a table of nodes, an index of the children of large sections and
+	// a pool of strings, all addressed by offsets. A mapped snapshot file is queried in place, nothing is deserialized.
+	// Snapshots are written by KeyValues::saveToSnapshot, and can only be read on machines with the same byte order.
+	class Snapshot
+	{
+	public:
+		// Both throw std::runtime_error if the data isn't a valid snapshot. The file is memory mapped and stays mapped
+		// for as long as the snapshot, or a document built from it with ParseOptions::zeroCopy, is alive. fromFile
+		// throws std::system_error if it can't be mapped.
+		static Snapshot fromFile( const std::string &path );
+		static Snapshot fromBuffer( const std::string_view &buffer ); // Copies the buffer
+
+		SnapshotView getRoot() const;
+		size_t getNodeCount() const;
+
+		// Builds a document out of the snapshot, honouring ParseOptions::useArena and ParseOptions::zeroCopy. Zero copy
+		// documents view the snapshot's strings and keep it alive.
+		KeyValues toKeyValues( const ParseOptions &options = ParseOptions() ) const;
+
+	private:
+		friend class SnapshotCache;
+
+		Snapshot( std::shared_ptr< const void > owner, const std::string_view &data );
+
+		std::shared_ptr< const void > owner;
+		std::string_view data;
+	};
+
+	struct PersistentNode;
+
+	// Read only view of a node in a PersistentDocument, navigated like KeyValues. Views are valid as long as a version of
+	// the document holding their node is alive. Looking up a key that doesn't exist gives an invalid view.
+	class PersistentView
+	{
+	public:
+		using NodePtr = std::shared_ptr< const PersistentNode >;
+
+		struct const_iterator
+		{
+			const_iterator( const NodePtr *it ) : it( it ) {}
+			const_iterator operator++() { ++it; return *this; }
+			bool operator!=( const const_iterator &other ) const { return ( it != other.it ); }
+
+			PersistentView operator*() const { return PersistentView( it->get() ); }
+
+		private:
+			const NodePtr *it;
+		};
+
+		PersistentView() = default;
+
+		bool isValid() const noexcept { return ( node != nullptr ); }
+		explicit operator bool() const noexcept { return isValid(); }
+
+		bool isSection() const;
+		bool isEmpty() const { return ( getChildCount() == 0 ); }
+		size_t getChildCount() const;
+
+		std::string_view getKey() const;
+		std::string_view getValue( const std::string_view &defaultVal = std::string_view() ) const;
+
+		// Reads the value like KeyValues::getValueAs does
+		template< typename T >
+		T getValueAs( T defaultVal = T() ) const
+		{
+			if ( !isValid() || isSection() )
+				return defaultVal;
+
+			const std::string_view text = getValue();
+			T number;
+
+			return ( KeyValues::narrowNumber( number, [ &text ]( auto &wide ) { return KeyValues::parseNumber( text, wide ); } ) ) ? number : defaultVal;
+		}
+
+		// Same as KeyValues::getContentHash, known for every node since they never change. 0 for an invalid view.
+		uint64_t getContentHash() const;
+
+		// Like KeyValues::operator==, nodes shared by both sides are equal without looking into them
+		bool operator==( const PersistentView &other ) const;
+		bool operator!=( const PersistentView &other ) const { return !( *this == other ); }
+
+		// Large sections are searched through an index of their children, smaller ones linearly
+		PersistentView get( const std::string_view &name, size_t index = 0 ) const; // Returns the index-th child named 'name'
+		PersistentView operator[]( const std::string_view &name ) const { return get( name ); }
+		size_t getCount( const std::string_view &name ) const;
+
+		std::string_view getKeyValue( const std::string_view &keyName, const std::string_view &defaultVal = std::string_view() ) const;
+
+		const_iterator begin() const;
+		const_iterator end() const;
+
+	private:
+		friend class PersistentDocument;
+
+		explicit PersistentView( const PersistentNode *node ) : node( node ) {}
+
+		const PersistentNode *node = nullptr;
+	};
+
+	// Document made of immutable, reference counted nodes that versions of it share. Copying a document is O(1) and gives
+	// another version of it. An edit makes a new version in place of the old one, copying only the sections on the path to
+	// what it changed, each of which still shares its children: an edit costs the sizes of those sections, not the size of
+	// the document. Every other node is shared with the versions before it, which stay as they were.
+	//
+	// A new version replaces the old one atomically, so one thread can edit a document while any number of others copy it to
+	// read the latest version, without locking. Readers read their copy, views of a document another thread is editing can
+	// be freed by the edit. Edits to one document object have to be made by one thread at a time.
+	class PersistentDocument
+	{
+	public:
+		PersistentDocument(); // Empty
+		explicit PersistentDocument( const KeyValues &kv ); // Copies the children of 'kv', numbers as their text
+
+		// Both take the current version of 'other', while another thread may be editing it
+		PersistentDocument( const PersistentDocument &other ) : root( std::atomic_load( &other.root ) ) {}
+		PersistentDocument &operator=( const PersistentDocument &other ) { std::atomic_store( &root, std::atomic_load( &other.root ) ); return *this; }
+
+		PersistentView getRoot() const { return PersistentView( root.get() ); }
+
+		// A version compared to one it was made from only looks into the sections the edits in between copied
+		bool operator==( const PersistentDocument &other ) const { return ( getRoot() == other.getRoot() ); }
+		bool operator!=( const PersistentDocument &other ) const { return !( *this == other ); }
+
+		// Honours ParseOptions::useArena and ParseOptions::zeroCopy. Zero copy documents view the nodes' strings and keep
+		// this version alive.
+		KeyValues toKeyValues( const ParseOptions &options = ParseOptions() ) const;
+
+		// Edits take paths without wildcards and return false, leaving the document as it was, if they can't be made.
+		// Missing nodes on the way to a set are created as sections, "name#n" creates one only if there are n of them.
+
+		// The node at 'path' becomes a value, dropping whatever it held if it was a section
+		bool set( const KeyPath &path, const std::string_view &value );
+
+		// The node at 'path' becomes a section holding the top level nodes of 'section', which are shared, not copied
+		bool set( const KeyPath &path, const PersistentDocument &section );
+
+		bool remove( const KeyPath &path );
+
+	private:
+		using NodePtr = PersistentView::NodePtr;
+
+		// Replaces the node at 'path' with what 'makeNode' returns when passed its key, or removes it if that's nullptr. Every
+		// node on the way to it is copied. With 'create' set a missing node and missing sections above it are made instead.
+		template< typename MakeNode >
+		bool edit( const KeyPath &path, bool create, MakeNode &&makeNode );
+
+		NodePtr root;
+	};
+
+	// Path to nodes below a KeyValues, a SnapshotView or a PersistentView, compiled once and run any number of times
+	// against any document without allocating. Segments are separated by '/' and each one steps down a level:
+	//   name    the first child named 'name'
+	//   name#2  the third child named 'name'
+	//   name#*  every child named 'name'
+	//   *       every child
+	// So "Proxies/*/resultVar" matches the resultVar of every proxy. A '\' makes the character after it part of the name,
+	// which is needed for keys holding '/' or '\', a whole key of "*", or a key ending in '#' and a number. A '#' that
+	// isn't followed by a number or '*' up to the end of the segment is part of the name, like in "#base".
+	class KeyPath
+	{
+	public:
+		struct Segment
+		{
+			static constexpr size_t cEveryIndex = std::numeric_limits< size_t >::max();
+
+			uint32_t nameOffset; // Into the path's unescaped names
+			uint32_t nameLength;
+			size_t index; // Of the duplicate to match, cEveryIndex for all of them
+			bool anyName;
+		};
+
+		// Throws std::invalid_argument if the path is empty, a segment has no name, or an index doesn't fit
+		explicit KeyPath( const std::string_view &path );
+
+		// The first match in document order, nullptr or an invalid view if there's none
+		const KeyValues *find( const KeyValues &root ) const;
+		KeyValues *find( KeyValues &root ) const { return const_cast< KeyValues* >( find( static_cast< const KeyValues& >( root ) ) ); }
+		SnapshotView find( const SnapshotView &root ) const;
+		PersistentView find( const PersistentView &root ) const;
+
+		// Appends every match to 'out' in document order, returns how many there were
+		size_t findAll( const KeyValues &root, std::vector< const KeyValues* > &out ) const;
+		size_t findAll( const SnapshotView &root, std::vector< SnapshotView > &out ) const;
+		size_t findAll( const PersistentView &root, std::vector< PersistentView > &out ) const;
+
+		const std::string &getPath() const noexcept { return path; }
+		const std::vector< Segment > &getSegments() const noexcept { return segments; }
+		std::string_view getName( const Segment &segment ) const { return std::string_view( names ).substr( segment.nameOffset, segment.nameLength ); }
+
+	private:
+		// Calls 'visit' with every match below 'node' for the segments from 'segment' on, until it returns false
+		template< typename Nodes, typename Visit >
+		bool match( size_t segment, typename Nodes::Node node, Visit &visit ) const;
+
+		std::string path;
+		std::string names;
+		std::vector< Segment > segments;
+	};
+
+	// Resolves many paths in a single walk of a document. Paths are merged into a tree on their segments, so a prefix
+	// they share is only looked up once, and the walk stops as soon as every path has a match.
+	class KeyPathSet
+	{
+	public:
+		KeyPathSet();
+
+		// Returns the position the path's match will have in the results
+		size_t add( const KeyPath &path );
+		size_t add( const std::string_view &path ) { return add( KeyPath( path ) ); }
+
+		size_t size() const noexcept { return pathCount; }
+
+		// Replaces 'results' with the first match of every path in document order, in the order the paths were added.
+		// Paths without a match get nullptr or an invalid view. Reusing 'results' avoids allocating.
+		void resolve( const KeyValues &root, std::vector< const KeyValues* > &results ) const;
+		void resolve( const SnapshotView &root, std::vector< SnapshotView > &results ) const;
+		void resolve( const PersistentView &root, std::vector< PersistentView > &results ) const;
+
+	private:
+		struct Step
+		{
+			KeyPath::Segment segment;
+			std::vector< uint32_t > steps; // Steps below this one
+			std::vector< uint32_t > paths; // Paths ending with this step
+		};
+
+		template< typename Nodes >
+		bool resolveStep( const Step &step, typename Nodes::Node node, typename Nodes::Node *results, size_t &remaining ) const;
+
+		std::string names;
+		std::vector< Step > steps; // The first one is the root, it has no segment
+		size_t pathCount = 0;
+	};
+
+	// Publishes versions of a document to readers on any number of threads, read-copy-update style. Taking a ReadGuard pins
+	// the current version until it's released. It's wait-free once the thread has read any handle before, the first read
+	// registers the thread. Publishing never waits for readers. A replaced version is freed once every reader that could
+	// have seen it is done, which publish and reclaim check without blocking.
+	class DocumentHandle
+	{
+	public:
+		// Has to be released on the thread that took it. Keep it short lived, versions replaced while any guard on any
+		// handle is held stay alive until that guard is released.
+		class ReadGuard
+		{
+		public:
+			ReadGuard( ReadGuard &&other ) noexcept : document( other.document ) { other.document = nullptr; }
+			~ReadGuard();
+
+			ReadGuard( const ReadGuard& ) = delete;
+			ReadGuard &operator=( const ReadGuard& ) = delete;
+			ReadGuard &operator=( ReadGuard&& ) = delete;
+
+			const KeyValues &operator*() const { return *document; }
+			const KeyValues *operator->() const { return document; }
+
+		private:
+			friend class DocumentHandle;
+
+			explicit ReadGuard( const KeyValues *document ) : document( document ) {}
+
+			const KeyValues *document;
+		};
+
+		DocumentHandle(); // Holds an empty document
+		explicit DocumentHandle( KeyValues document );
+		~DocumentHandle(); // Every guard on it has to be released first
+
+		DocumentHandle( const DocumentHandle& ) = delete;
+		DocumentHandle &operator=( const DocumentHandle& ) = delete;
+
+		ReadGuard read() const;
+
+		// Makes 'document' the current version. Publishers are serialized, readers are never blocked.
+		void publish( KeyValues document );
+
+		// Frees the replaced versions no reader can hold anymore, returns how many are left
+		size_t reclaim();
+
+		uint64_t getVersion() const { return version.load(); } // Counts publishes
+
+	private:
+		struct Version;
+
+		size_t reclaimLocked();
+
+		std::atomic< Version* > current;
+		std::atomic< uint64_t > version{ 0 };
+
+		std::mutex publishMutex;
+		std::vector< Version* > retired;
+	};
+
+	class ReloadWatcher;
+
+	// Watches files and parses them again on a background thread when they change, publishing every new document through
+	// the file's DocumentHandle. Changes are picked up through inotify on Linux, and by comparing the files' modification
+	// times and sizes every poll interval, which is all there is elsewhere or if inotify isn't available. A file that fails
+	// to parse, like one caught half written, keeps its last version until it changes again. Files are always read into
+	// documents of their own and parsed whole, and reading a published document never writes to it: ParseOptions::zeroCopy,
+	// ParseOptions::lazySections and ParseOptions::cacheNumericValues are ignored, ParseOptions::hashContents is always on.
+	class ReloadManager
+	{
+	public:
+		// Called after every parse of a watched file, the first one in watch included, on the thread that parsed it. The
+		// document was published if there are no diagnostics.
+		using ReloadCallback = std::function< void( const std::string &path, const std::vector< ParseDiagnostic > &diagnostics ) >;
+
+		ReloadManager( const ExpressionEngine &expressionEngine = ExpressionEngine( true ), const ParseOptions &options = ParseOptions(), std::chrono::milliseconds pollInterval = std::chrono::milliseconds( 1000 ) );
+		~ReloadManager(); // Stops the background thread
+
+		ReloadManager( const ReloadManager& ) = delete;
+		ReloadManager &operator=( const ReloadManager& ) = delete;
+
+		// Parses the file on the calling thread and starts watching it, the handle lives as long as the manager. A file that
+		// doesn't exist or doesn't parse starts out empty. Watching a path again returns the same handle.
+		const DocumentHandle &watch( const std::string &path );
+
+		void setReloadCallback( ReloadCallback callback );
+
+		// Reloads the files that changed on the calling thread, without waiting for the background thread.
+		// Returns how many new versions were published.
+		size_t checkNow();
+
+	private:
+		std::unique_ptr< ReloadWatcher > watcher;
 	};
 
 	class ParseException : public std::exception
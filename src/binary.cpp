@@ -0,0 +1,376 @@
+#include "binary.hpp"
+#include "serializer.hpp"
+
+#include <cstring>
+#include <limits>
+#include <algorithm>
+
+namespace KV
+{
+	bool BinaryReader::readByte( uint8_t &byte )
+	{
+		if ( offset == buffer.size() )
+			return false;
+
+		byte = static_cast< uint8_t >( buffer[ offset++ ] );
+		return true;
+	}
+
+	bool BinaryReader::readBytes( uint8_t *bytes, size_t count )
+	{
+		if ( count > buffer.size() - offset )
+			return false;
+
+		std::memcpy( bytes, buffer.data() + offset, count );
+		offset += count;
+
+		return true;
+	}
+
+	bool BinaryReader::readString( std::string_view &str )
+	{
+		const void *terminator = std::memchr( buffer.data() + offset, '\0', buffer.size() - offset );
+		if ( !terminator )
+			return false;
+
+		const size_t length = static_cast< const char* >( terminator ) - ( buffer.data() + offset );
+		str = buffer.substr( offset, length );
+		offset += length + 1;
+
+		return true;
+	}
+
+	bool BinaryReader::readUInt32( uint32_t &number )
+	{
+		uint8_t bytes[ 4 ];
+		if ( !readBytes( bytes, sizeof( bytes ) ) )
+			return false;
+
+		number = 0;
+		for ( size_t i = 0; i < sizeof( bytes ); ++i )
+			number |= static_cast< uint32_t >( bytes[ i ] ) << ( i * 8 );
+
+		return true;
+	}
+
+	bool BinaryReader::readUInt64( uint64_t &number )
+	{
+		uint8_t bytes[ 8 ];
+		if ( !readBytes( bytes, sizeof( bytes ) ) )
+			return false;
+
+		number = 0;
+		for ( size_t i = 0; i < sizeof( bytes ); ++i )
+			number |= static_cast< uint64_t >( bytes[ i ] ) << ( i * 8 );
+
+		return true;
+	}
+
+	BinaryParser::BinaryParser( const std::string_view &buffer, const ParseOptions &options ) :
+		buffer( buffer ),
+		options( options ),
+		reader( buffer )
+	{
+	}
+
+	bool BinaryParser::parse( KeyValues &root, std::vector< ParseDiagnostic > &errors )
+	{
+		diagnostics = &errors;
+		const size_t errorCount = errors.size();
+
+		if ( buffer.size() > options.maxInputSize )
+			return fail( ParseErrorCode::InputTooLarge, "Input exceeds the maximum size of " + std::to_string( options.maxInputSize ) + " bytes", 0 );
+
+		sections.push_back( &root );
+
+		while ( !sections.empty() )
+		{
+			const size_t offset = reader.getOffset();
+			uint8_t type;
+
+			// Documents written without their final End are accepted
+			if ( !reader.readByte( type ) )
+			{
+				if ( sections.size() == 1 )
+					break;
+
+				return fail( ParseErrorCode::UnterminatedSection, "Expected the end of a section but got EOF instead", offset );
+			}
+
+			if ( type == static_cast< uint8_t >( BinaryType::End ) || type == static_cast< uint8_t >( BinaryType::AlternateEnd ) )
+			{
+				sections.pop_back();
+				continue;
+			}
+
+			if ( !readNode( static_cast< BinaryType >( type ), *sections.back() ) )
+				return false;
+		}
+
+		if ( !reader.atEnd() )
+			return fail( ParseErrorCode::InvalidBinary, "Unexpected data after the end of the document", reader.getOffset() );
+
+		return ( errors.size() == errorCount );
+	}
+
+	bool BinaryParser::readNode( BinaryType type, KeyValues &parent )
+	{
+		const size_t offset = reader.getOffset() - 1;
+
+		if ( ++nodeCount > options.maxNodes )
+			return fail( ParseErrorCode::TooManyNodes, "Document has more than " + std::to_string( options.maxNodes ) + " nodes", offset );
+
+		std::string_view key;
+		if ( !reader.readString( key ) )
+			return fail( ParseErrorCode::InvalidBinary, "Key isn't null terminated", reader.getOffset() );
+
+		auto createKey = [ & ]() -> KeyValues&
+		{
+			return ( options.zeroCopy ) ? parent.createBorrowedKey( key ) : parent.createKey( key );
+		};
+
+		KeyValues::NumericValue numeric;
+		numeric.valid = true;
+
+		switch ( type )
+		{
+			case BinaryType::None:
+			{
+				if ( sections.size() - 1 >= options.maxDepth )
+					return fail( ParseErrorCode::NestedTooDeep, "Sections nested deeper than " + std::to_string( options.maxDepth ) + " levels", offset );
+
+				sections.push_back( &createKey() );
+				return true;
+			}
+			case BinaryType::String:
+			{
+				std::string_view value;
+				if ( !reader.readString( value ) )
+					return fail( ParseErrorCode::InvalidBinary, "String value isn't null terminated", reader.getOffset() );
+
+				if ( options.zeroCopy )
+					parent.createBorrowedKeyValue( key, value );
+				else
+					parent.createKeyValue( key, value );
+
+				return true;
+			}
+			case BinaryType::Int:
+			{
+				uint32_t number;
+				if ( !reader.readUInt32( number ) )
+					break;
+
+				numeric.type = KeyValues::NumericValue::Type::Integer;
+				numeric.integer = static_cast< int32_t >( number );
+			}
+			break;
+			case BinaryType::Float:
+			{
+				uint32_t number;
+				if ( !reader.readUInt32( number ) )
+					break;
+
+				numeric.type = KeyValues::NumericValue::Type::Float;
+				std::memcpy( &numeric.floatNumber, &number, sizeof( number ) );
+			}
+			break;
+			case BinaryType::Pointer:
+			{
+				uint32_t number;
+				if ( !reader.readUInt32( number ) )
+					break;
+
+				numeric.type = KeyValues::NumericValue::Type::Pointer;
+				numeric.unsignedInteger = number;
+			}
+			break;
+			case BinaryType::Color:
+			{
+				if ( !reader.readBytes( numeric.color, sizeof( numeric.color ) ) )
+					break;
+
+				numeric.type = KeyValues::NumericValue::Type::Color;
+			}
+			break;
+			case BinaryType::UInt64:
+			{
+				if ( !reader.readUInt64( numeric.unsignedInteger ) )
+					break;
+
+				numeric.type = KeyValues::NumericValue::Type::Unsigned;
+			}
+			break;
+			case BinaryType::WideString:
+				return fail( ParseErrorCode::InvalidBinary, "Wide string values aren't supported", offset );
+			default:
+				return fail( ParseErrorCode::InvalidBinary, "Unknown node type " + std::to_string( static_cast< int >( type ) ), offset );
+		}
+
+		if ( numeric.type == KeyValues::NumericValue::Type::Empty )
+			return fail( ParseErrorCode::InvalidBinary, "Expected a value but got EOF instead", reader.getOffset() );
+
+		createKey().setNumericValue( numeric );
+		return true;
+	}
+
+	bool BinaryParser::fail( ParseErrorCode code, std::string message, size_t offset )
+	{
+		diagnostics->push_back( ParseDiagnostic{ code, offset, 0, 0, std::move( message ) } );
+		return false;
+	}
+
+	template< typename Output >
+	void BinarySerializer< Output >::write( const KeyValues &root )
+	{
+		sections.emplace_back( root.begin(), root.end() );
+
+		while ( !sections.empty() )
+		{
+			Position &position = sections.back();
+
+			if ( !( position.first != position.second ) )
+			{
+				output.put( static_cast< char >( BinaryType::End ) );
+				sections.pop_back();
+
+				if ( !sections.empty() )
+					++sections.back().first;
+
+				continue;
+			}
+
+			const KeyValues &kv = *position.first;
+			if ( kv.isSection() )
+			{
+				writeHeader( BinaryType::None, kv );
+				sections.emplace_back( kv.begin(), kv.end() );
+
+				continue;
+			}
+
+			writeValue( kv );
+			++position.first;
+		}
+	}
+
+	template< typename Output >
+	void BinarySerializer< Output >::writeHeader( BinaryType type, const KeyValues &kv )
+	{
+		output.put( static_cast< char >( type ) );
+		writeString( kv.key.view() );
+	}
+
+	template< typename Output >
+	void BinarySerializer< Output >::writeValue( const KeyValues &kv )
+	{
+		using Type = KeyValues::NumericValue::Type;
+		const KeyValues::NumericValue &numeric = kv.numericValue;
+
+		if ( kv.valueIsNumber )
+		{
+			switch ( numeric.type )
+			{
+				case Type::Integer:
+				{
+					if ( numeric.integer >= std::numeric_limits< int32_t >::min() && numeric.integer <= std::numeric_limits< int32_t >::max() )
+					{
+						writeHeader( BinaryType::Int, kv );
+						writeUInt32( static_cast< uint32_t >( static_cast< int32_t >( numeric.integer ) ) );
+
+						return;
+					}
+
+					if ( numeric.integer >= 0 )
+					{
+						writeHeader( BinaryType::UInt64, kv );
+						writeUInt64( static_cast< uint64_t >( numeric.integer ) );
+
+						return;
+					}
+				}
+				break;
+				case Type::Unsigned:
+				{
+					writeHeader( BinaryType::UInt64, kv );
+					writeUInt64( numeric.unsignedInteger );
+				}
+				return;
+				case Type::Float:
+				case Type::Double:
+				{
+					// Doubles are only stored as floats when that doesn't lose anything
+					float number = numeric.floatNumber;
+					if ( numeric.type == Type::Double )
+					{
+						if ( !( numeric.doubleNumber >= -std::numeric_limits< float >::max() && numeric.doubleNumber <= std::numeric_limits< float >::max() ) )
+							break;
+
+						number = static_cast< float >( numeric.doubleNumber );
+						if ( static_cast< double >( number ) != numeric.doubleNumber )
+							break;
+					}
+
+					uint32_t bits;
+					std::memcpy( &bits, &number, sizeof( bits ) );
+
+					writeHeader( BinaryType::Float, kv );
+					writeUInt32( bits );
+				}
+				return;
+				case Type::Pointer:
+				{
+					writeHeader( BinaryType::Pointer, kv );
+					writeUInt32( static_cast< uint32_t >( numeric.unsignedInteger ) );
+				}
+				return;
+				case Type::Color:
+				{
+					writeHeader( BinaryType::Color, kv );
+					output.write( reinterpret_cast< const char* >( numeric.color ), sizeof( numeric.color ) );
+				}
+				return;
+				case Type::Empty:
+					break;
+			}
+		}
+
+		// Anything else is written as its text
+		KeyValues::NumberBuffer buffer;
+
+		writeHeader( BinaryType::String, kv );
+		writeString( kv.getValueText( buffer ) );
+	}
+
+	template< typename Output >
+	void BinarySerializer< Output >::writeString( const std::string_view &str )
+	{
+		// Strings holding a null character are cut short at it, they couldn't be read back otherwise
+		output.write( str.data(), std::min( str.find( '\0' ), str.size() ) );
+		output.put( '\0' );
+	}
+
+	template< typename Output >
+	void BinarySerializer< Output >::writeUInt32( uint32_t number )
+	{
+		char bytes[ 4 ];
+		for ( size_t i = 0; i < sizeof( bytes ); ++i )
+			bytes[ i ] = static_cast< char >( number >> ( i * 8 ) );
+
+		output.write( bytes, sizeof( bytes ) );
+	}
+
+	template< typename Output >
+	void BinarySerializer< Output >::writeUInt64( uint64_t number )
+	{
+		char bytes[ 8 ];
+		for ( size_t i = 0; i < sizeof( bytes ); ++i )
+			bytes[ i ] = static_cast< char >( number >> ( i * 8 ) );
+
+		output.write( bytes, sizeof( bytes ) );
+	}
+
+	template class BinarySerializer< CountingOutput >;
+	template class BinarySerializer< BufferOutput >;
+	template class BinarySerializer< SinkOutput >;
+}
@@ -0,0 +1,93 @@
+#pragma once
+
+#include "keyvalues.hpp"
+
+#include <string_view>
+#include <string>
+#include <vector>
+#include <utility>
+#include <cstdint>
+
+namespace KV
+{
+	// Node types of Valve's binary KeyValues format. A node is its type, its key as a null terminated string
+	// and then its value. Sections hold nodes up to an End, and so does the document itself.
+	enum class BinaryType : uint8_t
+	{
+		None = 0, // Section
+		String = 1, // Null terminated
+		Int = 2, // 32 bits, like every number little endian
+		Float = 3, // 32 bits
+		Pointer = 4, // 32 bits
+		WideString = 5, // Never written by the engine, not supported
+		Color = 6, // Red, green, blue and alpha bytes
+		UInt64 = 7,
+		End = 8,
+		AlternateEnd = 11 // Written instead of End by later engine branches
+	};
+
+	// Cursor over binary input, every read checks there's enough of it left and returns false otherwise
+	class BinaryReader
+	{
+	public:
+		explicit BinaryReader( const std::string_view &buffer ) : buffer( buffer ) {}
+
+		bool readByte( uint8_t &byte );
+		bool readBytes( uint8_t *bytes, size_t count );
+		bool readString( std::string_view &str ); // Views the string up to its terminator, which is skipped
+		bool readUInt32( uint32_t &number );
+		bool readUInt64( uint64_t &number );
+
+		size_t getOffset() const { return offset; }
+		bool atEnd() const { return ( offset == buffer.size() ); }
+
+	private:
+		std::string_view buffer;
+		size_t offset = 0;
+	};
+
+	// Builds a tree out of binary input. Sections are tracked on an explicit stack, like the text parser does.
+	class BinaryParser
+	{
+	public:
+		BinaryParser( const std::string_view &buffer, const ParseOptions &options );
+
+		// Errors are appended to 'diagnostics', whatever was read before them is kept. Returns false if there were any.
+		bool parse( KeyValues &root, std::vector< ParseDiagnostic > &diagnostics );
+
+	private:
+		bool readNode( BinaryType type, KeyValues &parent );
+		bool fail( ParseErrorCode code, std::string message, size_t offset );
+
+		std::string_view buffer;
+		const ParseOptions &options;
+		BinaryReader reader;
+
+		std::vector< KeyValues* > sections;
+		size_t nodeCount = 0;
+		std::vector< ParseDiagnostic > *diagnostics = nullptr;
+	};
+
+	// Writes a document in the binary format to one of the Serializer's outputs
+	template< typename Output >
+	class BinarySerializer
+	{
+	public:
+		explicit BinarySerializer( Output &output ) : output( output ) {}
+
+		// Writes every child of 'root' followed by the End of the document
+		void write( const KeyValues &root );
+
+	private:
+		using Position = std::pair< KeyValues::const_iterator, KeyValues::const_iterator >;
+
+		void writeHeader( BinaryType type, const KeyValues &kv );
+		void writeValue( const KeyValues &kv );
+		void writeString( const std::string_view &str );
+		void writeUInt32( uint32_t number );
+		void writeUInt64( uint64_t number );
+
+		Output &output;
+		std::vector< Position > sections;
+	};
+}
@@ -0,0 +1,349 @@
+#include "keyvalues.hpp"
+
+#include <charconv>
+#include <stdexcept>
+
+namespace KV
+{
+	namespace
+	{
+		// How KeyPath and KeyPathSet step through documents, a node is a KeyValues pointer or a SnapshotView
+		struct TreeNodes
+		{
+			using Node = const KeyValues*;
+
+			static bool isValid( Node node ) { return ( node != nullptr ); }
+			static Node find( Node parent, const std::string_view &name, size_t index ) { return parent->find( name, index ); }
+
+			template< typename Visit >
+			static bool forEachChild( Node parent, Visit &&visit )
+			{
+				for ( const KeyValues &child : *parent )
+				{
+					if ( !visit( &child ) )
+						return false;
+				}
+
+				return true;
+			}
+		};
+
+		struct SnapshotNodes
+		{
+			using Node = SnapshotView;
+
+			static bool isValid( const Node &node ) { return node.isValid(); }
+			static Node find( const Node &parent, const std::string_view &name, size_t index ) { return parent.get( name, index ); }
+
+			template< typename Visit >
+			static bool forEachChild( const Node &parent, Visit &&visit )
+			{
+				for ( SnapshotView child : parent )
+				{
+					if ( !visit( child ) )
+						return false;
+				}
+
+				return true;
+			}
+		};
+
+		struct PersistentNodes
+		{
+			using Node = PersistentView;
+
+			static bool isValid( const Node &node ) { return node.isValid(); }
+			static Node find( const Node &parent, const std::string_view &name, size_t index ) { return parent.get( name, index ); }
+
+			template< typename Visit >
+			static bool forEachChild( const Node &parent, Visit &&visit )
+			{
+				for ( PersistentView child : parent )
+				{
+					if ( !visit( child ) )
+						return false;
+				}
+
+				return true;
+			}
+		};
+
+		// Calls 'visit' with every child of 'parent' matching 'segment' until it returns false. Returns false if it did.
+		template< typename Nodes, typename Visit >
+		bool VisitSegment( const KeyPath::Segment &segment, const std::string_view &name, const typename Nodes::Node &parent, Visit &&visit )
+		{
+			if ( segment.anyName )
+				return Nodes::forEachChild( parent, visit );
+
+			if ( segment.index != KeyPath::Segment::cEveryIndex )
+			{
+				const typename Nodes::Node child = Nodes::find( parent, name, segment.index );
+				return ( !Nodes::isValid( child ) || visit( child ) );
+			}
+
+			for ( size_t index = 0; ; ++index )
+			{
+				const typename Nodes::Node child = Nodes::find( parent, name, index );
+				if ( !Nodes::isValid( child ) )
+					return true;
+
+				if ( !visit( child ) )
+					return false;
+			}
+		}
+
+		// Returns true if 'text' is a number or "*", which makes it the index of a "name#index" segment
+		bool ParseIndex( const std::string_view &text, size_t &index )
+		{
+			if ( text == "*" )
+			{
+				index = KeyPath::Segment::cEveryIndex;
+				return true;
+			}
+
+			if ( text.empty() || text.find_first_not_of( "0123456789" ) != std::string_view::npos )
+				return false;
+
+			const std::from_chars_result result = std::from_chars( text.data(), text.data() + text.size(), index );
+			if ( result.ec != std::errc() || index == KeyPath::Segment::cEveryIndex )
+				throw std::invalid_argument( "Key path index " + std::string( text ) + " is too large" );
+
+			return true;
+		}
+	}
+
+	KeyPath::KeyPath( const std::string_view &keyPath ) :
+		path( keyPath )
+	{
+		if ( path.empty() || path.size() > std::numeric_limits< uint32_t >::max() )
+			throw std::invalid_argument( "Key paths can't be empty or longer than 4 GiB" );
+
+		size_t position = 0;
+
+		while ( true )
+		{
+			Segment segment{ static_cast< uint32_t >( names.size() ), 0, 0, false };
+			bool escaped = false;
+			bool indexed = false;
+
+			for ( ; position < path.size() && path[ position ] != '/'; ++position )
+			{
+				if ( path[ position ] == '\\' )
+				{
+					if ( ++position == path.size() )
+						throw std::invalid_argument( "Key path \"" + path + "\" ends with an escape" );
+
+					names.push_back( path[ position ] );
+					escaped = true;
+
+					continue;
+				}
+
+				// An index can only be the rest of the segment, since neither numbers nor '*' are escaped
+				if ( path[ position ] == '#' )
+				{
+					const size_t end = std::min( path.find( '/', position ), path.size() );
+					if ( ParseIndex( std::string_view( path ).substr( position + 1, end - position - 1 ), segment.index ) )
+					{
+						position = end;
+						indexed = true;
+
+						break;
+					}
+				}
+
+				names.push_back( path[ position ] );
+			}
+
+			segment.nameLength = static_cast< uint32_t >( names.size() - segment.nameOffset );
+			segment.anyName = ( !escaped && getName( segment ) == "*" );
+
+			if ( segment.nameLength == 0 )
+				throw std::invalid_argument( "Key path \"" + path + "\" has a segment without a name" );
+
+			if ( segment.anyName && indexed )
+				throw std::invalid_argument( "Key path \"" + path + "\" indexes a '*' segment" );
+
+			segments.push_back( segment );
+
+			if ( position == path.size() )
+				break;
+
+			// Skip the '/', a trailing one leaves an empty segment
+			++position;
+		}
+	}
+
+	template< typename Nodes, typename Visit >
+	bool KeyPath::match( size_t segment, typename Nodes::Node node, Visit &visit ) const
+	{
+		if ( segment == segments.size() )
+			return visit( node );
+
+		return VisitSegment< Nodes >( segments[ segment ], getName( segments[ segment ] ), node, [ this, segment, &visit ]( const typename Nodes::Node &child )
+		{
+			return match< Nodes >( segment + 1, child, visit );
+		} );
+	}
+
+	const KeyValues *KeyPath::find( const KeyValues &root ) const
+	{
+		const KeyValues *found = nullptr;
+		auto visit = [ &found ]( const KeyValues *kv ) { found = kv; return false; };
+
+		match< TreeNodes >( 0, &root, visit );
+		return found;
+	}
+
+	SnapshotView KeyPath::find( const SnapshotView &root ) const
+	{
+		SnapshotView found;
+		auto visit = [ &found ]( const SnapshotView &view ) { found = view; return false; };
+
+		if ( root.isValid() )
+			match< SnapshotNodes >( 0, root, visit );
+
+		return found;
+	}
+
+	PersistentView KeyPath::find( const PersistentView &root ) const
+	{
+		PersistentView found;
+		auto visit = [ &found ]( const PersistentView &view ) { found = view; return false; };
+
+		if ( root.isValid() )
+			match< PersistentNodes >( 0, root, visit );
+
+		return found;
+	}
+
+	size_t KeyPath::findAll( const KeyValues &root, std::vector< const KeyValues* > &out ) const
+	{
+		const size_t count = out.size();
+		auto visit = [ &out ]( const KeyValues *kv ) { out.push_back( kv ); return true; };
+
+		match< TreeNodes >( 0, &root, visit );
+		return out.size() - count;
+	}
+
+	size_t KeyPath::findAll( const SnapshotView &root, std::vector< SnapshotView > &out ) const
+	{
+		const size_t count = out.size();
+		auto visit = [ &out ]( const SnapshotView &view ) { out.push_back( view ); return true; };
+
+		if ( root.isValid() )
+			match< SnapshotNodes >( 0, root, visit );
+
+		return out.size() - count;
+	}
+
+	size_t KeyPath::findAll( const PersistentView &root, std::vector< PersistentView > &out ) const
+	{
+		const size_t count = out.size();
+		auto visit = [ &out ]( const PersistentView &view ) { out.push_back( view ); return true; };
+
+		if ( root.isValid() )
+			match< PersistentNodes >( 0, root, visit );
+
+		return out.size() - count;
+	}
+
+	KeyPathSet::KeyPathSet() :
+		steps( 1 )
+	{
+	}
+
+	size_t KeyPathSet::add( const KeyPath &path )
+	{
+		size_t current = 0;
+
+		for ( const KeyPath::Segment &segment : path.getSegments() )
+		{
+			const std::string_view name = path.getName( segment );
+			size_t next = 0;
+
+			for ( uint32_t index : steps[ current ].steps )
+			{
+				const KeyPath::Segment &other = steps[ index ].segment;
+				if ( other.anyName == segment.anyName && other.index == segment.index && std::string_view( names ).substr( other.nameOffset, other.nameLength ) == name )
+				{
+					next = index;
+					break;
+				}
+			}
+
+			if ( next == 0 )
+			{
+				next = steps.size();
+
+				Step &step = steps.emplace_back();
+				step.segment = segment;
+				step.segment.nameOffset = static_cast< uint32_t >( names.size() );
+				names += name;
+
+				steps[ current ].steps.push_back( static_cast< uint32_t >( next ) );
+			}
+
+			current = next;
+		}
+
+		steps[ current ].paths.push_back( static_cast< uint32_t >( pathCount ) );
+		return pathCount++;
+	}
+
+	template< typename Nodes >
+	bool KeyPathSet::resolveStep( const Step &step, typename Nodes::Node node, typename Nodes::Node *results, size_t &remaining ) const
+	{
+		for ( uint32_t index : step.steps )
+		{
+			const Step &next = steps[ index ];
+			const std::string_view name = std::string_view( names ).substr( next.segment.nameOffset, next.segment.nameLength );
+
+			const bool carryOn = VisitSegment< Nodes >( next.segment, name, node, [ this, &next, results, &remaining ]( const typename Nodes::Node &child )
+			{
+				for ( uint32_t path : next.paths )
+				{
+					if ( !Nodes::isValid( results[ path ] ) )
+					{
+						results[ path ] = child;
+						--remaining;
+					}
+				}
+
+				return ( remaining != 0 && resolveStep< Nodes >( next, child, results, remaining ) );
+			} );
+
+			if ( !carryOn )
+				return false;
+		}
+
+		return true;
+	}
+
+	void KeyPathSet::resolve( const KeyValues &root, std::vector< const KeyValues* > &results ) const
+	{
+		results.assign( pathCount, nullptr );
+
+		size_t remaining = pathCount;
+		if ( remaining != 0 )
+			resolveStep< TreeNodes >( steps[ 0 ], &root, results.data(), remaining );
+	}
+
+	void KeyPathSet::resolve( const SnapshotView &root, std::vector< SnapshotView > &results ) const
+	{
+		results.assign( pathCount, SnapshotView() );
+
+		size_t remaining = pathCount;
+		if ( remaining != 0 && root.isValid() )
+			resolveStep< SnapshotNodes >( steps[ 0 ], root, results.data(), remaining );
+	}
+
+	void KeyPathSet::resolve( const PersistentView &root, std::vector< PersistentView > &results ) const
+	{
+		results.assign( pathCount, PersistentView() );
+
+		size_t remaining = pathCount;
+		if ( remaining != 0 && root.isValid() )
+			resolveStep< PersistentNodes >( steps[ 0 ], root, results.data(), remaining );
+	}
+}
@@ -1,8 +1,21 @@
 #include "keyvalues.hpp"
+#include "parser.hpp"
+#include "mappedfile.hpp"
+#include "serializer.hpp"
+#include "binary.hpp"
+#include "snapshot.hpp"
 
 #include <iostream>
 #include <algorithm>
 #include <sstream>
+#include <limits>
+#include <stdexcept>
+#include <system_error>
+#include <thread>
+#include <atomic>
+#include <mutex>
+#include <charconv>
+#include <cctype>
 
 namespace KV
 {
@@ -13,31 +26,92 @@ namespace KV
 		debugCallback = callback;
 	}
 
-	ParseException::LineColumn_t ResolveLineColumn ( const std::string_view &buffer, size_t index )
+	// Whatever nodes point into besides the buffer and the root's arena, kept alive by the root's source
+	struct DocumentStorage
 	{
-		constexpr auto UTF8_MB_CONTINUE = 2;
+		std::shared_ptr< const void > source;
+		std::vector< std::unique_ptr< std::pmr::monotonic_buffer_resource > > arenas; // Of parts parsed in parallel
+		std::vector< CompiledExpressionPtr > conditions; // See ParseOptions::keepConditionals
+
+		// Set for documents with lazy sections, what they're parsed with. Lazy sections view 'buffer', which 'source' owns.
+		std::string_view buffer;
+		std::optional< ExpressionEngine > expressionEngine;
+		ParseOptions options;
+
+		// Updated as lazy sections are parsed, through the const documents that reach them
+		mutable size_t nodeCount = 0; // Parsed so far, for ParseOptions::maxNodes
+		mutable std::optional< LineIndex > lines; // Positions errors in 'buffer', built by the first section that has any
+	};
+
+	static void ReportParseError( const LineIndex &lines, const ParseDiagnostic &e )
+	{
+		if ( !debugCallback )
+			return;
 
-		if ( index == std::string::npos || index >= buffer.size() )
-			{};
+		std::stringstream ss;
 
-		size_t line = 1;
-		size_t column = 0;
+		ss << "[Line: " << e.line << " Column: " << e.column << "] ";
+		ss << e.message << std::endl << std::endl;
 
-		for ( size_t i = 0; i < index; ++i  )
+		if ( lines.getBuffer().empty() )
 		{
-			const unsigned char &c = buffer[ i ];
+			debugCallback( ss.str() );
+			return;
+		}
 
-			if ( c == '\n' )
-			{
-				column = 0;
-				++line;
-			}
-			else if ( ( c >> 6 ) != UTF8_MB_CONTINUE && c != '\r' )
-				++column;
+		std::string line( lines.getLineText( e.line ) );
+		size_t tabCount = 0;
 
+		for ( auto it = line.begin(); it != line.end(); ++it )
+		{
+			if ( *it == '\t' )
+				++tabCount;
 		}
 
-		return ParseException::LineColumn_t{ line, column };
+		line.erase( std::remove( line.begin(), line.end(), '\t' ), line.end() );
+
+		ss << line << std::endl;
+		const size_t column = ( e.column > tabCount ) ? e.column - tabCount : 0;
+
+		for ( size_t i = 0; i < column; ++i )
+			ss << ' ';
+
+		ss << "^\n";
+		debugCallback(ss.str());
+	}
+
+	// See ParseOptions::hashContents
+	static void HashParsedDocument( const KeyValues &document, const ParseOptions &options )
+	{
+		if ( options.hashContents )
+			document.getContentHash();
+	}
+
+	// Postfix program, evaluated on a stack of bools
+	struct CompiledExpression
+	{
+		enum class OpCode : uint8_t
+		{
+			Load, // Pushes a condition
+			And,
+			Or,
+			Not
+		};
+
+		struct Instruction
+		{
+			OpCode op;
+			bool negate; // Load only
+			uint32_t condition; // Load only, index into 'names'
+		};
+
+		constexpr static const uint32_t cUnknownCondition = std::numeric_limits< uint32_t >::max();
+
+		std::string text;
+		std::vector< std::string > names;
+		std::vector< Instruction > code;
+		size_t stackSize = 0;
+		size_t depth = 0; // Scopes open at the deepest '(', checked against the depth limit on cache hits
 	};
 
 	ExpressionEngine::ExpressionEngine( bool useAutomaticDefaults /*= true*/ )
@@ -61,843 +135,1844 @@ namespace KV
 		}
 	}
 
-	void ExpressionEngine::setCondition( const std::string &condition, bool value )
+	ExpressionEngine::ExpressionEngine( const ExpressionEngine &other ) :
+		conditionIndices( other.conditionIndices ),
+		activeConditions( other.activeConditions )
 	{
-		conditions[ condition ] = value;
+		std::shared_lock< std::shared_mutex > lock( other.compiledMutex );
+		compiledExpressions = other.compiledExpressions;
 	}
 
-	bool ExpressionEngine::getCondition( const std::string &condition ) const
+	ExpressionEngine &ExpressionEngine::operator=( const ExpressionEngine &other )
 	{
-		if ( auto it = conditions.find( condition ); it != conditions.cend() )
-			return it->second;
+		if ( this == &other )
+			return *this;
 
-		return false;
-	}
+		conditionIndices = other.conditionIndices;
+		activeConditions = other.activeConditions;
 
-	ExpressionEngine::ExpressionResult ExpressionEngine::evaluateExpression( const std::string_view &expression, const size_t offset /*= 0*/ ) const
-	{
-		constexpr const std::array< char, 11 > controls = { '$', '&', '|', '!', '(', ')', '[', ']', '\n', ' ', '\t' };
-		constexpr const std::array< char, 7 > unsupportedOps = { '>', '<', '=', '+', '-', '*', '/' };
+		std::unique_lock< std::shared_mutex > lock( compiledMutex, std::defer_lock );
+		std::shared_lock< std::shared_mutex > otherLock( other.compiledMutex, std::defer_lock );
+		std::lock( lock, otherLock );
+		compiledExpressions = other.compiledExpressions;
 
-		enum class LogicOp
-		{
-			NONE,
-			OR,
-			AND,
-			UNSET // Special case for error handling when parsing
-		};
+		return *this;
+	}
 
-		auto peekChar = [ &expression ]( const size_t index ) -> char
-		{
-			return ( index < expression.size() ) ? expression[ index ] : '\0';
-		};
+	void ExpressionEngine::setCondition( const std::string &condition, bool value )
+	{
+		auto [ it, inserted ] = conditionIndices.try_emplace( condition, static_cast< uint32_t >( conditionIndices.size() ) );
+		const uint32_t index = it->second;
 
-		auto evaluate = [ & ]( const size_t start, const char expressionEnd, auto &evaluateRecursive ) -> ExpressionResult
+		if ( inserted )
 		{
-			LogicOp currentOp = LogicOp::NONE;
-			std::optional< bool > evaluation;
-
-			bool isNot = false;
-
-			for ( size_t i = start; i < expression.size(); ++i )
-			{
-				if ( expression[ i ] == '\n' )
-				{
-					const std::string errMsg = std::string( "Expected '" ) + expressionEnd + std::string( "', got EOL instead" );
-					throw ParseException( errMsg, ResolveLineColumn( expression, i ) );
-				}
-				else if ( expression[ i ] == expressionEnd )
-				{
-					if ( !evaluation.has_value() )
-						throw ParseException( "Expected an expression", ResolveLineColumn( expression, i ) );
-					else if ( currentOp != LogicOp::NONE && currentOp != LogicOp::UNSET )
-					{
-						const std::string errMsg = std::string( "Expected primary-expression before '" ) + expressionEnd + std::string( "' token" );
-						throw ParseException( errMsg, ResolveLineColumn( expression, i ) );
-					}
-					else
-						return { evaluation.value(), i };
-				}
-				else if ( expression[ i ] == '!' )
-				{
-					isNot = !isNot;
-					continue;
-				}
-				else if ( expression[ i ] == '(' )
-				{
-					ExpressionResult nextEvaluation = evaluateRecursive( i + 1, ')', evaluateRecursive );
+			activeConditions.resize( index / 64 + 1, 0 );
 
-					if ( isNot )
-					{
-						nextEvaluation.result = !nextEvaluation.result;
-						isNot = false;
-					}
-
-					switch ( currentOp )
-					{
-						case LogicOp::NONE:
-						{
-							evaluation = nextEvaluation.result;
-							break;
-						}
-						case LogicOp::OR:
-						{
-							evaluation = ( evaluation.value() || nextEvaluation.result );
-							break;
-						}
-						case LogicOp::AND:
-						{
-							evaluation = ( evaluation.value() && nextEvaluation.result );
-							break;
-						}
-						case LogicOp::UNSET:
-						{
-							throw ParseException( "Expected logical operator, expression incomplete", ResolveLineColumn( expression, i ) );
-							break;
-						}
-					}
-
-					currentOp = LogicOp::UNSET;
-					i = nextEvaluation.end;
-
-					continue;
-				}
-				else if ( expression[ i ] == '$' )
-				{
-					size_t len = 0;
-
-					for ( size_t j = i + 1; j < expression.size(); ++j )
-					{
-						if ( std::find( controls.begin(), controls.end(), expression[ j ] ) != controls.end() )
-							break;
-
-						++len;
-					}
-
-					if ( len == 0 )
-						throw ParseException( "Expected symbol", ResolveLineColumn( expression, i ) );
-					else
-					{
-						const std::string name = std::string( expression, i + 1, len );
-						const bool condition = ( isNot ) ? !getCondition( name ) : getCondition( name );
-
-						isNot = false;
-
-						switch ( currentOp )
-						{
-							case LogicOp::NONE:
-							{
-								evaluation = condition;
-								break;
-							}
-							case LogicOp::OR:
-							{
-								evaluation = ( evaluation.value() || condition );
-								break;
-							}
-							case LogicOp::AND:
-							{
-								evaluation = ( evaluation.value() && condition );
-								break;
-							}
-							case LogicOp::UNSET:
-							{
-								throw ParseException( "Expected logical operator, expression incomplete", ResolveLineColumn( expression, i ) );
-								break;
-							}
-						}
-
-						currentOp = LogicOp::UNSET;
-						i += len;
-						continue;
-					}
-
-				}
-				else if ( expression[ i ] == '&' )
-				{
-					if ( peekChar( i + 1 ) != '&' )
-					{
-						throw ParseException( "Bitwise operators not supported", ResolveLineColumn( expression, i ) );
-					}
-					else
-					{
-						currentOp = LogicOp::AND;
-						++i;
-						continue;
-					}
-				}
-				else if ( expression[ i ] == '|' )
-				{
-					if ( peekChar( i + 1 ) != '|' )
-					{
-						throw ParseException( "Bitwise operators not supported", ResolveLineColumn( expression, i ) );
-					}
-					else
-					{
-						currentOp = LogicOp::OR;
-						++i;
-						continue;
-					}
-				}
-				else if ( auto it = std::find( unsupportedOps.cbegin(), unsupportedOps.cend(), expression[ i ] ); it != unsupportedOps.cend() )
-				{
-					const std::string errMsg = std::string( "Unsupported operator '" ) + *it + std::string( "'" ) ;
-					throw ParseException( errMsg, ResolveLineColumn( expression, i ) );
-				}
-			}
-
-			throw ParseException( "Expected end of expression", ResolveLineColumn( expression, offset ) );
-		};
+			// Cached expressions resolved names they didn't know yet as always false
+			std::unique_lock< std::shared_mutex > lock( compiledMutex );
+			compiledExpressions.clear();
+		}
 
-		if ( expression[ offset ] != '[' )
-			throw ParseException( "Invalid expression", ResolveLineColumn( expression, offset ) );
+		const uint64_t bit = uint64_t( 1 ) << ( index % 64 );
 
-		return evaluate( offset + 1, ']', evaluate );
+		if ( value )
+			activeConditions[ index / 64 ] |= bit;
+		else
+			activeConditions[ index / 64 ] &= ~bit;
 	}
 
-	KeyValues &KeyValues::getRoot()
+	uint64_t ExpressionEngine::hashActiveConditions() const
 	{
-		if ( isRoot() )
-			return *this;
+		std::vector< std::string_view > names;
+		for ( const auto &[ name, index ] : conditionIndices )
+		{
+			if ( testCondition( index ) )
+				names.push_back( name );
+		}
 
-		auto root = parentKV;
-		while ( root->parentKV != nullptr )
-			root = root->parentKV;
+		std::sort( names.begin(), names.end() );
 
-		return *root;
+		uint64_t hash = 0;
+		for ( const std::string_view &name : names )
+			hash = HashBytes( name, hash + 1 );
+
+		return hash;
 	}
 
-	KeyValues &KeyValues::createKey( const std::string_view &name )
+	bool ExpressionEngine::getCondition( const std::string &condition ) const
 	{
-		auto it = keyvalues.insert( std::make_pair( std::string( name ), std::make_unique< KeyValues >() ) );
-		KeyValues &kv = *it->second;
-		kv.key = &it->first;
-		kv.parentKV = this;
-
-		if ( !isRoot() )
-			kv.depth = depth + 1;
+		if ( auto it = conditionIndices.find( condition ); it != conditionIndices.cend() )
+			return testCondition( it->second );
 
-		return kv;
+		return false;
 	}
 
-	KeyValues &KeyValues::createKeyValue( const std::string_view &name, const std::string_view &kvValue )
+	bool ExpressionEngine::testCondition( uint32_t index ) const
 	{
-		KeyValues &kv = createKey( name );
-		kv.setKeyValueFast( kvValue );
+		if ( index / 64 >= activeConditions.size() )
+			return false;
 
-		return kv;
+		return ( ( activeConditions[ index / 64 ] >> ( index % 64 ) ) & 1 ) != 0;
 	}
 
-	void KeyValues::removeKey( const std::string &name )
+	ExpressionEngine::ExpressionResult ExpressionEngine::evaluateExpression( const std::string_view &expression, const size_t offset /*= 0*/, const size_t maxDepth /*= std::numeric_limits< size_t >::max()*/ ) const
 	{
-		auto it = keyvalues.find( name );
-		if ( it != keyvalues.end() )
-			keyvalues.erase( it );
-	}
+		const CachedExpression *found = nullptr;
+		CachedExpression entry;
 
-	void KeyValues::removeKey( const std::string &name, size_t index )
-	{
-		if ( index >= keyvalues.count( name ) )
-			return;
+		const ExpressionResult result = findExpression( expression, offset, maxDepth, found, entry );
 
-		auto range = keyvalues.equal_range( name );
-		auto it = range.first;
-		std::advance( it, index );
+		if ( !result.error.empty() )
+			return result;
 
-		keyvalues.erase( it );
+		return ExpressionResult( runExpression( *found->compiled, found->conditions.data() ), result.end );
 	}
 
-	KeyValues &KeyValues::get( const std::string &name, size_t index )
+	ExpressionEngine::ExpressionResult ExpressionEngine::compileCondition( const std::string_view &expression, const size_t offset, const size_t maxDepth, std::shared_ptr< const CompiledExpression > &compiled ) const
 	{
-		auto range = keyvalues.equal_range( name );
+		const CachedExpression *found = nullptr;
+		CachedExpression entry;
 
-		auto it = range.first;
-		std::advance( it, index );
+		const ExpressionResult result = findExpression( expression, offset, maxDepth, found, entry );
 
-		return *it->second;
-	}
-
-	KeyValues &KeyValues::operator[]( const std::string &name )
-	{
-		if ( auto it = keyvalues.find( name ); it != keyvalues.end() )
-			return *it->second;
+		if ( result.error.empty() )
+			compiled = found->compiled;
 
-		return createKey( name );
+		return result;
 	}
 
-	size_t KeyValues::getCount( const std::string &name ) const
+	bool ExpressionEngine::evaluateCondition( const CompiledExpression &compiled ) const
 	{
-		return keyvalues.count( name );
+		return runExpression( compiled, resolveConditions( compiled ).data() );
 	}
 
-	bool KeyValues::getValueAsBool( bool defaultVal /*= false*/ ) const
+	ExpressionEngine::ExpressionResult ExpressionEngine::findExpression( const std::string_view &expression, const size_t offset, const size_t maxDepth, const CachedExpression *&found, CachedExpression &entry ) const
 	{
-		if ( !value )
-			return defaultVal;
+		if ( expression[ offset ] != '[' )
+			return ExpressionResult::makeError( "Invalid expression", offset );
 
-		try
-		{
-			return ( std::stoi( value.value() ) != 0 );
-		}
-		catch ( const std::exception& )
+		// The cache is keyed by the text up to the first ']'. Expressions that end later, with a ']' inside parentheses,
+		// or that have errors are compiled every time.
+		const size_t close = expression.find( ']', offset );
+		std::string_view text;
+
+		if ( close != std::string_view::npos )
 		{
-			return defaultVal;
-		}
-	}
+			text = expression.substr( offset, close - offset + 1 );
 
-	int KeyValues::getValueAsInt( int defaultVal /*= 0*/ ) const
-	{
-		if ( !value )
-			return defaultVal;
+			{
+				std::shared_lock< std::shared_mutex > lock( compiledMutex );
+				if ( auto it = compiledExpressions.find( text ); it != compiledExpressions.cend() )
+					found = &it->second; // Nodes stay put while other threads insert
+			}
 
-		try
-		{
-			return std::stoi( value.value() );
+			if ( found && found->compiled->depth <= maxDepth )
+				return ExpressionResult( true, close );
 		}
-		catch ( const std::exception& )
-		{
-			return defaultVal;
-		}
-	}
 
-	float KeyValues::getValueAsFloat( float defaultVal /*= 0.0f*/ ) const
-	{
-		if ( !value )
-			return defaultVal;
+		auto compiled = std::make_shared< CompiledExpression >();
+		const ExpressionResult result = compileExpression( expression, offset, maxDepth, *compiled );
 
-		try
-		{
-			return std::stof( value.value() );
-		}
-		catch ( const std::exception& )
-		{
-			return defaultVal;
-		}
-	}
+		if ( !result.error.empty() )
+			return result;
 
-	double KeyValues::getValueAsDouble( double defaultVal /*= 0.0*/ ) const
-	{
-		if ( !value )
-			return defaultVal;
+		compiled->text = std::string( expression.substr( offset, result.end - offset + 1 ) );
+		entry.conditions = resolveConditions( *compiled );
+		entry.compiled = std::move( compiled );
+		found = &entry;
 
-		try
-		{
-			return std::stod( value.value() );
-		}
-		catch ( const std::exception& )
+		if ( result.end == close )
 		{
-			return defaultVal;
+			std::unique_lock< std::shared_mutex > lock( compiledMutex );
+
+			if ( compiledExpressions.size() < cMaxCachedExpressions )
+			{
+				found = &compiledExpressions.try_emplace( entry.compiled->text, entry ).first->second;
+			}
 		}
+
+		return result;
 	}
 
-	std::string KeyValues::getKeyValue( const std::string &keyName, size_t index, const std::string &defaultVal /*= ""*/ ) const
+	std::vector< uint32_t > ExpressionEngine::resolveConditions( const CompiledExpression &compiled ) const
 	{
-		const size_t count = keyvalues.count( keyName );
-
-		if ( index >= count )
-			return defaultVal;
+		std::vector< uint32_t > conditions;
+		conditions.reserve( compiled.names.size() );
 
-		auto range = keyvalues.equal_range( keyName );
-		auto it = range.first;
-		std::advance( it, index );
-
-		return it->second->getValue( defaultVal );
-	}
+		for ( const std::string &name : compiled.names )
+		{
+			auto it = conditionIndices.find( name );
+			conditions.push_back( ( it != conditionIndices.cend() ) ? it->second : CompiledExpression::cUnknownCondition );
+		}
 
-	std::string KeyValues::getKeyValue( const std::string &keyName, const std::string &defaultVal /*= ""*/ ) const
-	{
-		auto it = keyvalues.find( keyName );
-		return it != keyvalues.end() ? it->second->getValue( defaultVal ) : defaultVal;
+		return conditions;
 	}
 
-	KeyValues KeyValues::parseFromFile( const std::string &kvPath, ExpressionEngine expressionEngine /*= ExpressionEngine( true )*/ )
+	bool ExpressionEngine::runExpression( const CompiledExpression &compiled, const uint32_t *conditions ) const
 	{
-		std::ifstream file( kvPath, std::ios::binary | std::ios::ate );
+		using OpCode = CompiledExpression::OpCode;
 
-		if ( !file.is_open() )
-			return {};
+		std::array< bool, 16 > localStack;
+		std::unique_ptr< bool[] > heapStack;
+		bool *stack = localStack.data();
 
-		const size_t fileSize = file.tellg();
-		file.seekg( std::ios::beg );
+		if ( compiled.stackSize > localStack.size() )
+		{
+			heapStack.reset( new bool[ compiled.stackSize ] );
+			stack = heapStack.get();
+		}
 
-		std::string buffer( fileSize, '\0' );
+		size_t top = 0;
 
-		file.read( buffer.data(), buffer.size() );
-		file.close();
+		for ( const CompiledExpression::Instruction &instruction : compiled.code )
+		{
+			switch ( instruction.op )
+			{
+				case OpCode::Load:
+				{
+					stack[ top++ ] = ( testCondition( conditions[ instruction.condition ] ) != instruction.negate );
+					break;
+				}
+				case OpCode::And:
+				{
+					--top;
+					stack[ top - 1 ] = ( stack[ top - 1 ] && stack[ top ] );
+					break;
+				}
+				case OpCode::Or:
+				{
+					--top;
+					stack[ top - 1 ] = ( stack[ top - 1 ] || stack[ top ] );
+					break;
+				}
+				case OpCode::Not:
+				{
+					stack[ top - 1 ] = !stack[ top - 1 ];
+					break;
+				}
+			}
+		}
 
-		return parseFromBuffer( buffer, expressionEngine );
+		return stack[ 0 ];
 	}
 
-	KeyValues KeyValues::parseFromBuffer( const std::string_view &buffer, ExpressionEngine expressionEngine /*= ExpressionEngine( true )*/ )
+	ExpressionEngine::ExpressionResult ExpressionEngine::compileExpression( const std::string_view &expression, const size_t offset, const size_t maxDepth, CompiledExpression &compiled ) const
 	{
-		auto getLine = [ &buffer ]( const size_t line ) -> std::string
-		{
-			size_t startLine = 1;
-			size_t index = 0;
+		using OpCode = CompiledExpression::OpCode;
 
-			while ( startLine != line && index < buffer.size() )
-			{
-				if ( buffer[ index ] == '\n' )
-					++startLine;
+		constexpr const std::array< char, 7 > unsupportedOps = { '>', '<', '=', '+', '-', '*', '/' };
 
-				++index;
-			}
+		enum class LogicOp
+		{
+			NONE,
+			OR,
+			AND,
+			UNSET // Special case for error handling when parsing
+		};
 
-			// Uh oh
-			if ( index >= buffer.size() )
-				return "";
+		// One scope per open '[' or '(', nested scopes are kept on an explicit stack. The value of a scope
+		// with an evaluation sits on the program's stack.
+		struct Scope
+		{
+			Scope( char expressionEnd, size_t start ) : expressionEnd( expressionEnd ), start( start ) {}
 
-			const size_t start = index;
-			while ( ++index < buffer.size() )
-			{
-				if ( buffer[ index ] == '\n' )
-					break;
-			}
+			char expressionEnd;
+			size_t start;
 
-			const size_t end = index;
-			std::string line_str( &buffer[ start ], end - start );
+			LogicOp currentOp = LogicOp::NONE;
+			bool hasEvaluation = false;
 
-			return line_str;
+			bool isNot = false;
 		};
 
-		auto peekChar = [ &buffer ]( const size_t index ) -> char
+		auto peekChar = [ &expression ]( const size_t index ) -> char
 		{
-			return ( index < buffer.size() ) ? buffer[ index ] : '\0';
+			return ( index < expression.size() ) ? expression[ index ] : '\0';
 		};
 
-		auto skipLineComment = [ &buffer ]( const size_t start ) -> size_t
+		auto isControl = []( const char c ) -> bool
 		{
-			for ( size_t i = start; i < buffer.size(); ++i )
+			switch ( c )
 			{
-				if ( buffer[ i ] == '\n' )
-					return i;
+				case '$': case '&': case '|': case '!': case '(': case ')': case '[': case ']': case '\n': case ' ': case '\t':
+					return true;
+				default:
+					return false;
 			}
-
-			return std::string::npos;
 		};
 
-		auto skipMultiLineComment = [ &buffer, &peekChar ]( const size_t start ) -> size_t
+		size_t stackHeight = 0;
+
+		auto emit = [ &compiled, &stackHeight ]( OpCode op, bool negate = false, uint32_t condition = 0 )
 		{
-			for ( size_t i = start; i < buffer.size(); ++i )
-			{
-				if ( buffer[ i ] == '/' && peekChar( i - 1 ) == '*' )
-					return i;
-			}
+			compiled.code.push_back( { op, negate, condition } );
 
-			return std::string::npos;
+			if ( op == OpCode::Load )
+				compiled.stackSize = std::max( compiled.stackSize, ++stackHeight );
+			else if ( op != OpCode::Not )
+				--stackHeight;
 		};
 
-		auto skipSection = [ &buffer, &peekChar, &skipLineComment, &skipMultiLineComment ]( const size_t start ) -> size_t
+		// Combines the operand on top of the stack with the scope's evaluation. Returns false if the
+		// operand isn't preceded by an operator, or if an operator isn't preceded by an operand.
+		auto applyOperand = [ &emit ]( Scope &scope ) -> bool
 		{
-			size_t depth = 0;
-			for ( size_t i = start; i < buffer.size(); ++i )
+			switch ( scope.currentOp )
 			{
-				const char &c = buffer[ i ];
-				if ( c == '\"' )
-				{
-					for ( ++i; i < buffer.size(); ++i )
-					{
-						if ( buffer[ i ] == '\"' )
-							break;
-					}
-
-					continue;
-				}
-				else if ( c == '/' && peekChar( i + 1 ) == '/' )
-				{
-					i = skipLineComment( i );
-					continue;
-				}
-				else if ( c == '/' && peekChar( i + 1 ) == '*' )
+				case LogicOp::NONE:
 				{
-					i = skipMultiLineComment( i );
-					continue;
+					scope.hasEvaluation = true;
+					break;
 				}
-				else if ( c == '{' )
+				case LogicOp::OR:
+				case LogicOp::AND:
 				{
-					++depth;
-					continue;
+					if ( !scope.hasEvaluation )
+						return false;
+
+					emit( ( scope.currentOp == LogicOp::OR ) ? OpCode::Or : OpCode::And );
+					break;
 				}
-				else if ( c == '}' )
+				case LogicOp::UNSET:
 				{
-					if ( depth == 0 )
-						return i;
-
-					--depth;
-					continue;
+					return false;
 				}
 			}
 
-			return std::string::npos;
+			scope.currentOp = LogicOp::UNSET;
+			return true;
 		};
 
-		auto isWhiteSpace = []( const char &c ) -> bool
+		std::vector< Scope > scopes;
+		scopes.emplace_back( ']', offset );
+
+		for ( size_t i = offset + 1; i < expression.size(); ++i )
 		{
-			for ( const char &other : cWhiteSpace )
+			Scope &scope = scopes.back();
+
+			if ( expression[ i ] == '\n' )
 			{
-				if ( c == other )
-					return true;
+				const std::string errMsg = std::string( "Expected '" ) + scope.expressionEnd + std::string( "', got EOL instead" );
+				return ExpressionResult::makeError( errMsg, i );
 			}
+			else if ( expression[ i ] == scope.expressionEnd )
+			{
+				if ( !scope.hasEvaluation )
+					return ExpressionResult::makeError( "Expected an expression", i );
+				else if ( scope.currentOp != LogicOp::NONE && scope.currentOp != LogicOp::UNSET )
+				{
+					const std::string errMsg = std::string( "Expected primary-expression before '" ) + scope.expressionEnd + std::string( "' token" );
+					return ExpressionResult::makeError( errMsg, i );
+				}
 
-			return false;
-		};
+				if ( scopes.size() == 1 )
+					return ExpressionResult( true, i );
 
-		auto readUntilNotWhitespace = [ &buffer, &isWhiteSpace ]( size_t index ) -> size_t
-		{
-			while ( index < buffer.size() )
-			{
-				if ( !isWhiteSpace( buffer[ index ] ) )
-					return index;
-
-				++index;
-			}
+				const size_t start = scope.start;
+				scopes.pop_back();
+				Scope &parent = scopes.back();
 
-			return std::string::npos;
-		};
+				if ( parent.isNot )
+					emit( OpCode::Not );
 
-		auto readQuote = [ &buffer ]( const size_t start, std::string_view &str ) -> size_t
-		{
-			size_t len = 0;
-			size_t index = start + 1;
-			for ( ; index < buffer.size(); ++index )
+				if ( !applyOperand( parent ) )
+					return ExpressionResult::makeError( "Expected logical operator, expression incomplete", start );
+				parent.isNot = false;
+			}
+			else if ( expression[ i ] == '!' )
 			{
-				const char &c = buffer[ index ];
-				if ( c == '"' )
-					break;
-				else if ( c == '\n' )
-					throw ParseException( "Expected '\"' but got EOL instead", ResolveLineColumn( buffer, index ) );
+				scope.isNot = !scope.isNot;
+			}
+			else if ( expression[ i ] == '(' )
+			{
+				if ( scopes.size() > maxDepth )
+					return ExpressionResult::makeError( "Expression nested deeper than " + std::to_string( maxDepth ) + " levels", i );
 
-				++len;
+				compiled.depth = std::max( compiled.depth, scopes.size() );
+				scopes.emplace_back( ')', i );
 			}
+			else if ( expression[ i ] == '$' )
+			{
+				size_t len = 0;
 
-			str = std::string_view( &buffer[ start + 1 ], len );
-			return ( index + 1 >= buffer.size() ) ? std::string::npos : index + 1;
-		};
+				while ( i + 1 + len < expression.size() && !isControl( expression[ i + 1 + len ] ) )
+					++len;
 
-		// HACKHACK: This is major hack for the parser to determine if 'str' is a control character or not
-		constexpr const std::array< char, 8 > specialControl = {
-			'\0', '{',
-			'\0', '}',
-			'\0', '[',
-			'\0', ']'
-		};
+				if ( len == 0 )
+					return ExpressionResult::makeError( "Expected symbol", i );
 
-		auto readString = [ &buffer, &readQuote, &isWhiteSpace, &peekChar, &skipLineComment, &skipMultiLineComment, &readUntilNotWhitespace, &specialControl ]( const size_t start, std::string_view &str, auto &readStringRecursive ) -> size_t
-		{
-			if ( start >= buffer.size() )
-			{
-				str = "";
-				return std::string::npos;
-			}
+				const std::string_view name = expression.substr( i + 1, len );
+				size_t condition = std::find( compiled.names.cbegin(), compiled.names.cend(), name ) - compiled.names.cbegin();
+				if ( condition == compiled.names.size() )
+					compiled.names.emplace_back( name );
 
-			const char &cStart = buffer[ start ];
-			auto findSpecialControl = [ &specialControl, &cStart ]() -> size_t
-			{
-				for ( size_t i = 1; i < specialControl.size(); i += 2 )
-				{
-					if ( cStart == specialControl[ i ] )
-						return i;
-				}
+				emit( OpCode::Load, scope.isNot, static_cast< uint32_t >( condition ) );
 
-				return 0;
-			};
+				scope.isNot = false;
+				if ( !applyOperand( scope ) )
+					return ExpressionResult::makeError( "Expected logical operator, expression incomplete", i );
 
-			if ( cStart == '\"' )
-				return readQuote( start, str );
-			else if ( size_t control = findSpecialControl(); control != 0 )
+				i += len;
+			}
+			else if ( expression[ i ] == '&' )
 			{
-				str = std::string_view( &specialControl[ control - 1 ], 2 );
-				const size_t next = start + 1;
+				if ( peekChar( i + 1 ) != '&' )
+					return ExpressionResult::makeError( "Bitwise operators not supported", i );
 
-				return ( next >= buffer.size() ) ? std::string::npos : next;
+				scope.currentOp = LogicOp::AND;
+				++i;
 			}
-			else if ( cStart == '/' && peekChar( start + 1 ) == '/' )
+			else if ( expression[ i ] == '|' )
 			{
-				size_t next = skipLineComment( start ) + 1;
-				next = readUntilNotWhitespace( next );
+				if ( peekChar( i + 1 ) != '|' )
+					return ExpressionResult::makeError( "Bitwise operators not supported", i );
 
-				return readStringRecursive( next, str, readStringRecursive );
+				scope.currentOp = LogicOp::OR;
+				++i;
 			}
-			else if ( cStart == '/' && peekChar( start + 1 ) == '*' )
+			else if ( auto it = std::find( unsupportedOps.cbegin(), unsupportedOps.cend(), expression[ i ] ); it != unsupportedOps.cend() )
 			{
-				size_t next = skipMultiLineComment( start ) + 1;
-				next = readUntilNotWhitespace( next );
-
-				return readStringRecursive( next, str, readStringRecursive );
+				const std::string errMsg = std::string( "Unsupported operator '" ) + *it + std::string( "'" ) ;
+				return ExpressionResult::makeError( errMsg, i );
 			}
+		}
+
+		return ExpressionResult::makeError( "Expected end of expression", offset );
+	}
+
+	NodeString::NodeString( NodeString &&other ) noexcept :
+		size( other.size ),
+		storage( other.storage )
+	{
+		if ( storage == Storage::Inline )
+			std::copy( other.local, other.local + size, local );
+		else
+			data = other.data;
+
+		other.size = 0;
+		other.storage = Storage::Inline;
+	}
+
+	void NodeString::assign( const std::string_view &str, std::pmr::memory_resource *resource )
+	{
+		release( resource );
+
+		if ( str.size() > std::numeric_limits< uint32_t >::max() )
+			throw std::length_error( "KeyValues string too long" );
+
+		if ( str.size() <= cLocalCapacity )
+		{
+			std::copy( str.begin(), str.end(), local );
+			size = static_cast< uint32_t >( str.size() );
+
+			return;
+		}
+
+		char *memory = static_cast< char* >( resource->allocate( str.size(), alignof( char ) ) );
+		std::copy( str.begin(), str.end(), memory );
+
+		data = memory;
+		size = static_cast< uint32_t >( str.size() );
+		storage = Storage::Allocated;
+	}
+
+	void NodeString::borrow( const std::string_view &str, std::pmr::memory_resource *resource )
+	{
+		release( resource );
+
+		if ( str.size() > std::numeric_limits< uint32_t >::max() )
+			throw std::length_error( "KeyValues string too long" );
+
+		data = str.data();
+		size = static_cast< uint32_t >( str.size() );
+		storage = Storage::Borrowed;
+	}
+
+	void NodeString::release( std::pmr::memory_resource *resource )
+	{
+		if ( storage == Storage::Allocated )
+			resource->deallocate( const_cast< char* >( data ), size, alignof( char ) );
+
+		size = 0;
+		storage = Storage::Inline;
+	}
+
+	ChildContainer::ChildContainer( std::pmr::memory_resource *resource, bool arenaBacked ) :
+		resource( resource ),
+		arenaBacked( arenaBacked ),
+		children( resource ),
+		slots( resource ),
+		groups( resource )
+	{
+	}
+
+	ChildContainer::ChildContainer( ChildContainer &&other ) noexcept :
+		resource( other.resource ),
+		arenaBacked( other.arenaBacked ),
+		children( std::move( other.children ) ),
+		slots( std::move( other.slots ) ),
+		groups( std::move( other.groups ) )
+	{
+	}
+
+	ChildContainer::~ChildContainer()
+	{
+		// Arena backed children go away with the arena's blocks
+		if ( !arenaBacked )
+		{
+			for ( KeyValues *kv : children )
+				destroy( kv );
+		}
+	}
+
+	KeyValues &ChildContainer::push_back( KeyValues *kv )
+	{
+		children.push_back( kv );
+		const uint32_t position = static_cast< uint32_t >( children.size() - 1 );
+
+		if ( isIndexed() )
+			indexChild( position );
+		else if ( children.size() > cIndexThreshold )
+			buildIndex();
+
+		return *children.back();
+	}
 
-			size_t index = start;
-			size_t len = 0;
-			for ( ; index < buffer.size(); ++index )
+	KeyValues *ChildContainer::find( const std::string_view &name ) const
+	{
+		return find( name, 0 );
+	}
+
+	KeyValues *ChildContainer::find( const std::string_view &name, size_t index ) const
+	{
+		const size_t position = findPosition( name, index );
+		return ( position != std::string::npos ) ? children[ position ] : nullptr;
+	}
+
+	size_t ChildContainer::count( const std::string_view &name ) const
+	{
+		if ( isIndexed() )
+		{
+			const size_t group = findGroup( name, std::hash< std::string_view >()( name ) );
+			return ( group != std::string::npos ) ? groups[ group ].size() : 0;
+		}
+
+		return std::count_if( children.begin(), children.end(), [ &name ]( const KeyValues *kv ) { return kv->getKeyView() == name; } );
+	}
+
+	bool ChildContainer::erase( const std::string_view &name, size_t index /*= 0*/ )
+	{
+		const size_t position = findPosition( name, index );
+
+		if ( position == std::string::npos )
+			return false;
+
+		// Keep the child alive until the index no longer references its key
+		KeyValues *removed = children[ position ];
+		children.erase( children.begin() + position );
+
+		if ( isIndexed() )
+		{
+			if ( children.size() <= cIndexThreshold / 2 )
 			{
-				const char &c = buffer[ index ];
-				if ( c == '{' || c == '}' || c == '[' || c == '"' || isWhiteSpace( c ) )
-					break;
-				else if ( c == '/' && peekChar( index + 1 ) == '/' )
+				slots.clear();
+				groups.clear();
+			}
+			else
+			{
+				const size_t erasedGroup = findGroup( name, std::hash< std::string_view >()( name ) );
+				KeyGroup &group = groups[ erasedGroup ];
+				const bool groupRemoved = ( group.size() == 1 );
+
+				if ( groupRemoved )
 				{
-					index = skipLineComment( index );
-					continue;
+					groups.erase( groups.begin() + erasedGroup );
+					rebuildSlots();
 				}
-				else if ( c == '/' && peekChar( index + 1 ) == '*' )
+				else
 				{
-					index = skipMultiLineComment( index );
-					continue;
+					if ( index == 0 )
+					{
+						group.first = group.duplicates.front();
+						group.duplicates.erase( group.duplicates.begin() );
+					}
+					else
+						group.duplicates.erase( group.duplicates.begin() + ( index - 1 ) );
+				}
+
+				// Every position after the erased child shifts down by one
+				for ( KeyGroup &other : groups )
+				{
+					if ( other.first > position )
+						--other.first;
+
+					for ( uint32_t &duplicate : other.duplicates )
+					{
+						if ( duplicate > position )
+							--duplicate;
+					}
 				}
 
-				++len;
+				// The group's name may have viewed the erased child's key
+				if ( !groupRemoved )
+					groups[ erasedGroup ].name = children[ groups[ erasedGroup ].first ]->getKeyView();
 			}
+		}
 
-			str = std::string_view( &buffer[ start ], len );
-			return ( index >= buffer.size() ) ? std::string::npos : index;
-		};
+		destroy( removed );
+		return true;
+	}
+
+	void ChildContainer::clear()
+	{
+		for ( KeyValues *kv : children )
+			destroy( kv );
 
-		KeyValues root;
+		children.clear();
+		slots.clear();
+		groups.clear();
+	}
+
+	void ChildContainer::destroy( KeyValues *kv )
+	{
+		if ( arenaBacked )
+			return;
 
-		auto doParse = [ & ]()
+		// Deep trees are torn down with a worklist instead of recursing through destructors
+		std::vector< KeyValues* > pending;
+
+		for ( ;; )
 		{
-			auto readSection = [ & ]( KeyValues &currentKV, const size_t startSection, auto &readSubSection ) -> size_t
-			{
-				std::optional< std::string_view > key;
-				std::optional< std::string_view > value;
-				std::optional< ExpressionEngine::ExpressionResult > expressionResult;
+			container_type &grandChildren = kv->keyvalues.children;
+			pending.insert( pending.end(), grandChildren.begin(), grandChildren.end() );
+			grandChildren.clear();
 
-				std::string_view str;
-				size_t index = readUntilNotWhitespace( startSection );
+			kv->~KeyValues();
+			resource->deallocate( kv, sizeof( KeyValues ), alignof( KeyValues ) );
 
-				for ( ; index < buffer.size(); index = readUntilNotWhitespace( index ) )
-				{
-					index = readString( index, str, readString );
-					const bool isControlCharacter = ( str.size() == 2 && str[ 0 ] == '\0' ); // Note: This is a total garbage hack
+			if ( pending.empty() )
+				break;
 
-					if ( isControlCharacter )
-					{
-						const char &control = str[ 1 ];
-						switch ( control )
-						{
-							case '{':
-							{
-								if ( !key.has_value() )
-									throw ParseException( "Unexpected start to subsection", ResolveLineColumn( buffer, index ) );
-								else if ( expressionResult.has_value() && !expressionResult->result )
-								{
-									if ( size_t skip = skipSection( index ); skip == std::string::npos )
-										throw ParseException( "Expected '}', got EOF instead", ResolveLineColumn( buffer, index ) );
-									else
-										index = skip;
-								}
-								else
-								{
-									KeyValues &nextKV = currentKV.createKey( key.value() );
-									index = readSubSection( nextKV, index, readSubSection );
-								}
-
-								key.reset();
-								value.reset();
-								expressionResult.reset();
-
-								break;
-							}
-							case '}':
-							{
-								if ( key.has_value() && !value.has_value() )
-									throw ParseException( "Unexpected end to section", ResolveLineColumn( buffer, index ) );
-								else if ( key.has_value() && value.has_value() && ( !expressionResult.has_value() || ( expressionResult.has_value() && expressionResult->result ) ) )
-									currentKV.createKeyValue( key.value(), value.value() );
-
-								return index;
-
-								break;
-							}
-							case '[':
-							{
-								if ( !key.has_value() )
-									throw ParseException( "Unexpected start of expression", ResolveLineColumn( buffer, index ) );
-								else
-								{
-									expressionResult = expressionEngine.evaluateExpression( buffer, index - 1 );
-									index = expressionResult->end + 1;
-								}
-
-								break;
-							}
-							case ']':
-							{
-								throw ParseException( "Unexpected expression end ']' token", ResolveLineColumn( buffer, index ) );
-								break;
-							}
-							default:
-								break;
-						}
-					}
-					else // Not a control character
-					{
-						if ( !key.has_value() )
-							key = str;
-						else if ( !value.has_value() )
-							value = str;
-						else
-						{
-							if ( !expressionResult.has_value() || ( expressionResult.has_value() && expressionResult->result ) )
-								currentKV.createKeyValue( key.value(), value.value() );
-
-							key = str;
-							value.reset();
-							expressionResult.reset();
-						}
-					}
-				}
+			kv = pending.back();
+			pending.pop_back();
+		}
+	}
 
-				// Note: We're assuming that if start == 0, we started in 'global' space
-				if ( startSection != 0 )
-					throw ParseException( "Expected '}', got EOF instead", ResolveLineColumn( buffer, startSection ) );
-				else
-				{
-					if ( key.has_value() && !value.has_value() )
-						throw ParseException( "Unexpected end to section", ResolveLineColumn( buffer, buffer.size() - 1 ) );
-					else if ( key.has_value() && value.has_value() && ( !expressionResult.has_value() || ( expressionResult.has_value() && expressionResult->result ) ) )
-						currentKV.createKeyValue( key.value(), value.value() );
-				}
+	void ChildContainer::release() noexcept
+	{
+		children.clear();
+		slots.clear();
+		groups.clear();
+	}
+
+	void ChildContainer::buildIndex()
+	{
+		groups.clear();
+		groups.reserve( children.size() );
 
-				return index;
-			};
+		slots.clear();
+		rebuildSlots();
 
-			readSection( root, 0, readSection );
-		};
+		for ( uint32_t position = 0; position < children.size(); ++position )
+			indexChild( position );
+	}
 
-		try
+	void ChildContainer::rebuildSlots()
+	{
+		// Keep the load factor at or below 1/2
+		size_t slotCount = std::max< size_t >( slots.size(), cIndexThreshold * 2 );
+		while ( slotCount < children.size() * 2 )
+			slotCount *= 2;
+
+		slots.assign( slotCount, cEmptySlot );
+
+		const size_t mask = slots.size() - 1;
+		for ( uint32_t i = 0; i < groups.size(); ++i )
 		{
-			doParse();
+			size_t slot = groups[ i ].hash & mask;
+			while ( slots[ slot ] != cEmptySlot )
+				slot = ( slot + 1 ) & mask;
+
+			slots[ slot ] = i + 1;
 		}
-		catch ( const ParseException &e )
+	}
+
+	void ChildContainer::indexChild( uint32_t position )
+	{
+		const std::string_view name = children[ position ]->getKeyView();
+		const size_t hash = std::hash< std::string_view >()( name );
+
+		if ( const size_t group = findGroup( name, hash ); group != std::string::npos )
 		{
-			if (debugCallback)
-			{
-				std::stringstream ss;
+			groups[ group ].duplicates.push_back( position );
+			return;
+		}
 
-				ss << "[Line: " << e.getLineNumber() << " Column: " << e.getColumn() << "] ";
-				ss << e.what() << std::endl << std::endl;
+		groups.push_back( KeyGroup{ name, hash, position, std::pmr::vector< uint32_t >( resource ) } );
 
-				std::string line = getLine( e.getLineNumber() );
-				size_t tabCount = 0;
+		if ( groups.size() * 2 > slots.size() )
+		{
+			rebuildSlots();
+			return;
+		}
 
-				for ( auto it = line.begin(); it != line.end(); ++it )
-				{
-					if ( *it == '\t' )
-						++tabCount;
-				}
+		const size_t mask = slots.size() - 1;
+		size_t slot = hash & mask;
+		while ( slots[ slot ] != cEmptySlot )
+			slot = ( slot + 1 ) & mask;
 
-				line.erase( std::remove( line.begin(), line.end(), '\t' ), line.end() );
+		slots[ slot ] = static_cast< uint32_t >( groups.size() );
+	}
+
+	size_t ChildContainer::findGroup( const std::string_view &name, size_t hash ) const
+	{
+		const size_t mask = slots.size() - 1;
 
-				ss << line << std::endl;
-				const size_t column = e.getColumn() - tabCount;
+		for ( size_t slot = hash & mask; slots[ slot ] != cEmptySlot; slot = ( slot + 1 ) & mask )
+		{
+			const KeyGroup &group = groups[ slots[ slot ] - 1 ];
+			if ( group.hash == hash && group.name == name )
+				return slots[ slot ] - 1;
+		}
 
-				for ( size_t i = 0; i < column; ++i )
-					ss << ' ';
+		return std::string::npos;
+	}
 
-				ss << "^\n";
-				debugCallback(ss.str());
-			}
+	size_t ChildContainer::findPosition( const std::string_view &name, size_t index ) const
+	{
+		if ( isIndexed() )
+		{
+			const size_t group = findGroup( name, std::hash< std::string_view >()( name ) );
+			return ( group != std::string::npos && index < groups[ group ].size() ) ? groups[ group ].at( index ) : std::string::npos;
+		}
+
+		for ( size_t position = 0; position < children.size(); ++position )
+		{
+			if ( children[ position ]->getKeyView() == name && index-- == 0 )
+				return position;
 		}
 
-		return root;
+		return std::string::npos;
 	}
 
-	void KeyValues::saveToFile( const std::string &kvPath )
+	KeyValues &KeyValues::getRoot()
 	{
-		KeyValues &root = getRoot();
+		if ( isRoot() )
+			return *this;
 
-		if ( root.isEmpty() )
-			return;
+		auto root = parentKV;
+		while ( root->parentKV != nullptr )
+			root = root->parentKV;
 
-		std::ofstream file( kvPath );
-		std::string buffer;
+		return *root;
+	}
 
-		saveToBuffer( buffer );
+	const KeyValues &KeyValues::getRoot() const
+	{
+		return const_cast< KeyValues* >( this )->getRoot();
+	}
 
-		file << buffer;
+	KeyValues::~KeyValues()
+	{
+		if ( !keyvalues.isArenaBacked() )
+		{
+			key.release( keyvalues.getResource() );
+			value.release( keyvalues.getResource() );
+		}
 	}
 
-	void KeyValues::saveToBuffer( std::string &out )
+	KeyValues *KeyValues::allocateChild()
 	{
-		KeyValues &root = getRoot();
+		// New children go after the ones a lazy section holds
+		expand();
+		invalidateHash();
 
-		if ( root.isEmpty() )
+		std::pmr::memory_resource *resource = keyvalues.getResource();
+
+		void *memory = resource->allocate( sizeof( KeyValues ), alignof( KeyValues ) );
+		KeyValues *newKV = new ( memory ) KeyValues( resource, keyvalues.isArenaBacked() );
+
+		newKV->parentKV = this;
+		newKV->cacheNumbers = cacheNumbers;
+
+		if ( !isRoot() )
+			newKV->depth = depth + 1;
+
+		return newKV;
+	}
+
+	void KeyValues::expandAll() const
+	{
+		if ( !getRoot().lazyDocument )
 			return;
 
-		std::stringstream ss;
+		std::vector< const KeyValues* > pending = { this };
 
-		auto writeTabs = [ &ss ]( size_t tabDepth )
+		// Sections are parsed in document order, like a whole parse would count them toward the limits
+		while ( !pending.empty() )
 		{
-			if ( tabDepth > 0 )
+			const KeyValues *kv = pending.back();
+			pending.pop_back();
+
+			kv->expand();
+
+			const size_t first = pending.size();
+			for ( const KeyValues *child : kv->keyvalues )
 			{
-				std::string tabs( tabDepth, '\t' );
-				ss << tabs;
+				if ( child->isSection() )
+					pending.push_back( child );
 			}
-		};
 
-		auto writeKey = [ & ]( KeyValues &kv )
-		{
-			writeTabs( kv.getDepth() );
-			ss << '\"' << kv.getKey() << '\"';
-		};
+			std::reverse( pending.begin() + first, pending.end() );
+		}
+	}
 
-		auto writeKV = [ & ]( KeyValues &kv )
-		{
-			writeKey( kv );
-			ss << ' ' << '\"' << kv.getValue() << '\"' << '\n';
-		};
+	uint64_t KeyValues::getContentHash() const
+	{
+		if ( hashValid )
+			return contentHash;
+
+		// Post order off a worklist, a section is hashed once its children are. The flag tells whether the node's children
+		// have been queued already.
+		std::vector< std::pair< const KeyValues*, bool > > pending = { { this, false } };
 
-		auto writeSectionRecursive = [ & ]( KeyValues &section ) -> void
+		while ( !pending.empty() )
 		{
-			auto writeSection = [ & ]( KeyValues &sectionKV, auto &writeFunc ) -> void
-			{
-				writeKey( sectionKV );
+			const KeyValues *kv = pending.back().first;
 
-				ss << '\n';
-				writeTabs( sectionKV.getDepth() );
-				ss << '{' << '\n';
+			if ( !pending.back().second )
+			{
+				pending.back().second = true;
 
-				for ( KeyValues &kv : sectionKV )
+				if ( kv->isSection() )
 				{
-					if ( kv.isSection() )
-						writeFunc( kv, writeFunc );
-					else
-						writeKV( kv );
-				}
+					kv->expand();
 
-				writeTabs( sectionKV.getDepth() );
-				ss << '}' << '\n';
+					for ( const KeyValues *child : kv->keyvalues )
+					{
+						if ( !child->hashValid )
+							pending.emplace_back( child, false );
+					}
+				}
 
-				// Write a new line if it's the end of a 'global' section
-				if ( sectionKV.getDepth() == 0 )
-					ss << '\n';
-			};
+				continue;
+			}
 
-			writeSection( section, writeSection );
-		};
+			pending.pop_back();
 
-		for ( KeyValues &kv : root )
-		{
-			if ( kv.isSection() )
-				writeSectionRecursive( kv );
+			if ( kv->hasValue )
+			{
+				NumberBuffer buffer;
+				kv->contentHash = HashValue( kv->getValueText( buffer ) );
+			}
 			else
-				writeKV( kv );
+			{
+				kv->contentHash = cSectionHash;
+
+				for ( const KeyValues *child : kv->keyvalues )
+					kv->contentHash = HashChild( kv->contentHash, child->key.view(), child->contentHash );
+			}
+
+			kv->hashValid = true;
 		}
 
-		out = ss.str();
+		return contentHash;
 	}
 
-	void KeyValues::setKeyValue( const std::string &kvValue )
+	bool KeyValues::operator==( const KeyValues &other ) const
 	{
-		if ( isSection() )
+		if ( key.view() != other.key.view() )
+			return false;
+
+		// Pairs of nodes whose keys are known to match
+		std::vector< std::pair< const KeyValues*, const KeyValues* > > pending = { { this, &other } };
+
+		while ( !pending.empty() )
 		{
-			for ( auto &kv : keyvalues )
+			const auto [ a, b ] = pending.back();
+			pending.pop_back();
+
+			if ( a == b )
+				continue;
+
+			if ( ( a->hashValid && b->hashValid && a->contentHash != b->contentHash ) || a->hasValue != b->hasValue )
+				return false;
+
+			if ( a->hasValue )
+			{
+				NumberBuffer bufferA, bufferB;
+				if ( a->getValueText( bufferA ) != b->getValueText( bufferB ) )
+					return false;
+
+				continue;
+			}
+
+			a->expand();
+			b->expand();
+
+			if ( a->keyvalues.size() != b->keyvalues.size() )
+				return false;
+
+			auto it = b->keyvalues.begin();
+			for ( const KeyValues *child : a->keyvalues )
 			{
-				kv.second->parentKV = parentKV;
-				--kv.second->depth;
+				const KeyValues *otherChild = *it;
+				++it;
+
+				if ( child->key.view() != otherChild->key.view() )
+					return false;
+
+				pending.emplace_back( child, otherChild );
+			}
+		}
+
+		return true;
+	}
+
+	void KeyValues::expandSection() const
+	{
+		// The root is never lazy, so neither is a const document itself, only the nodes reached through it
+		KeyValues &section = const_cast< KeyValues& >( *this );
+		const DocumentStorage &storage = *static_cast< const DocumentStorage* >( getRoot().source.get() );
+		const std::string_view body = value.view();
+
+		section.lazy = false;
+		section.value.release( keyvalues.getResource() );
+
+		Parser parser( body, *storage.expressionEngine, storage.options );
+		TreeBuilder builder( section, storage.options.zeroCopy, true );
+		parser.reportSkippedSections( builder );
+
+		// Limits count from the root, sections in this one are a level below it
+		parser.continueDocument( depth + 1, storage.nodeCount );
+
+		std::vector< ParseDiagnostic > diagnostics;
+		parser.parse( builder, diagnostics );
+		storage.nodeCount += keyvalues.size();
+
+		if ( diagnostics.empty() )
+			return;
+
+		if ( !storage.lines )
+			storage.lines.emplace( storage.buffer );
+
+		// Positions are made relative to the whole input rather than the section
+		const LineIndex &lines = *storage.lines;
+		const size_t start = body.data() - storage.buffer.data();
+
+		for ( ParseDiagnostic &diagnostic : diagnostics )
+		{
+			diagnostic.offset += start;
+			diagnostic.line = lines.getLine( diagnostic.offset );
+			diagnostic.column = lines.getColumn( diagnostic.offset );
+
+			ReportParseError( lines, diagnostic );
+		}
+	}
+
+	std::string_view KeyValues::getCondition() const
+	{
+		return ( condition ) ? std::string_view( condition->text ) : std::string_view();
+	}
+
+	bool KeyValues::isActive( const ExpressionEngine &expressionEngine ) const
+	{
+		return ( !condition || expressionEngine.evaluateCondition( *condition ) );
+	}
+
+	KeyValues KeyValues::materialize( const ExpressionEngine &expressionEngine ) const
+	{
+		KeyValues copy = ( keyvalues.isArenaBacked() ) ? KeyValues( std::make_unique< Arena >( ParseOptions().arenaBlockSize ) ) : KeyValues();
+		copy.cacheNumbers = cacheNumbers;
+
+		// Nodes parsed from the same expression text share it, so it's only evaluated the first time
+		std::unordered_map< const CompiledExpression*, bool > results;
+
+		auto isActive = [ &expressionEngine, &results ]( const KeyValues &kv ) -> bool
+		{
+			if ( !kv.condition )
+				return true;
+
+			auto [ it, inserted ] = results.try_emplace( kv.condition, false );
+			if ( inserted )
+				it->second = expressionEngine.evaluateCondition( *kv.condition );
+
+			return it->second;
+		};
+
+		// Sections are copied off a worklist instead of recursing, a section's children are all created before any of
+		// them is visited so their order is kept
+		std::vector< std::pair< const KeyValues*, KeyValues* > > pending = { { this, &copy } };
+
+		while ( !pending.empty() )
+		{
+			const auto [ from, to ] = pending.back();
+			pending.pop_back();
+
+			from->expand();
+
+			for ( const KeyValues *kv : from->keyvalues )
+			{
+				if ( !isActive( *kv ) )
+					continue;
+
+				if ( kv->valueIsNumber )
+					to->createKey( kv->key.view() ).setNumericValue( kv->numericValue );
+				else if ( kv->hasValue )
+					to->createKeyValue( kv->key.view(), kv->value.view() );
+				else
+					pending.emplace_back( kv, &to->createKey( kv->key.view() ) );
+			}
+		}
+
+		return copy;
+	}
+
+	void KeyValues::adoptChildren( KeyValues &other )
+	{
+		invalidateHash();
+
+		for ( KeyValues *kv : other.keyvalues )
+		{
+			kv->parentKV = this;
+			keyvalues.push_back( kv );
+		}
+
+		other.keyvalues.release();
+	}
+
+	KeyValues &KeyValues::createKey( const std::string_view &name )
+	{
+		KeyValues *newKV = allocateChild();
+		newKV->key.assign( name, keyvalues.getResource() );
+
+		return keyvalues.push_back( newKV );
+	}
+
+	KeyValues &KeyValues::createKeyValue( const std::string_view &name, const std::string_view &kvValue )
+	{
+		KeyValues &kv = createKey( name );
+		kv.setKeyValueFast( kvValue );
+
+		return kv;
+	}
+
+	KeyValues &KeyValues::createBorrowedKey( const std::string_view &name )
+	{
+		KeyValues *newKV = allocateChild();
+		newKV->key.borrow( name, keyvalues.getResource() );
+
+		return keyvalues.push_back( newKV );
+	}
+
+	KeyValues &KeyValues::createBorrowedKeyValue( const std::string_view &name, const std::string_view &kvValue )
+	{
+		KeyValues &kv = createBorrowedKey( name );
+		kv.value.borrow( kvValue, keyvalues.getResource() );
+		kv.hasValue = true;
+
+		return kv;
+	}
+
+	void KeyValues::removeKey( const std::string &name )
+	{
+		expand();
+		invalidateHash();
+		keyvalues.erase( name );
+	}
+
+	void KeyValues::removeKey( const std::string &name, size_t index )
+	{
+		expand();
+		invalidateHash();
+		keyvalues.erase( name, index );
+	}
+
+	KeyValues &KeyValues::get( const std::string &name, size_t index )
+	{
+		expand();
+		return *keyvalues.find( name, index );
+	}
+
+	KeyValues &KeyValues::operator[]( const std::string &name )
+	{
+		expand();
+		if ( KeyValues *kv = keyvalues.find( name ); kv )
+			return *kv;
+
+		return createKey( name );
+	}
+
+	size_t KeyValues::getCount( const std::string &name ) const
+	{
+		expand();
+		return keyvalues.count( name );
+	}
+
+	bool KeyValues::getValueAsBool( bool defaultVal /*= false*/ ) const
+	{
+		return getValueAs< bool >( defaultVal );
+	}
+
+	int KeyValues::getValueAsInt( int defaultVal /*= 0*/ ) const
+	{
+		return getValueAs< int >( defaultVal );
+	}
+
+	float KeyValues::getValueAsFloat( float defaultVal /*= 0.0f*/ ) const
+	{
+		return getValueAs< float >( defaultVal );
+	}
+
+	double KeyValues::getValueAsDouble( double defaultVal /*= 0.0*/ ) const
+	{
+		return getValueAs< double >( defaultVal );
+	}
+
+	// Reads the number at the start of 'text' like std::stoi, std::stof and friends would, skipping leading whitespace
+	// and a '+' sign which from_chars doesn't take
+	template< typename T >
+	static bool ParseNumber( std::string_view text, T &number )
+	{
+		text.remove_prefix( std::min( text.find_first_not_of( " \t\n\v\f\r" ), text.size() ) );
+
+		if ( text.size() > 1 && text[ 0 ] == '+' && text[ 1 ] != '-' )
+			text.remove_prefix( 1 );
+
+		// std::stof and std::stod take hex floats with a 0x prefix, from_chars only without one
+		if constexpr ( std::is_floating_point_v< T > )
+		{
+			const bool negative = ( !text.empty() && text[ 0 ] == '-' );
+			const std::string_view digits = text.substr( negative ? 1 : 0 );
+
+			if ( digits.size() > 2 && digits[ 0 ] == '0' && ( digits[ 1 ] == 'x' || digits[ 1 ] == 'X' ) &&
+				( std::isxdigit( static_cast< unsigned char >( digits[ 2 ] ) ) || digits[ 2 ] == '.' ) )
+			{
+				const std::errc error = std::from_chars( digits.data() + 2, digits.data() + digits.size(), number, std::chars_format::hex ).ec;
+
+				// Without any digits the 0 before the 'x' is the number
+				if ( error != std::errc::invalid_argument )
+				{
+					if ( error == std::errc() && negative )
+						number = -number;
+
+					return ( error == std::errc() );
+				}
+			}
+		}
+
+		return ( std::from_chars( text.data(), text.data() + text.size(), number ).ec == std::errc() );
+	}
+
+	template< typename T >
+	bool KeyValues::readNumber( T &number ) const
+	{
+		using Type = NumericValue::Type;
+
+		Type type;
+		T *cached;
+
+		if constexpr ( std::is_same_v< T, int64_t > )
+		{
+			type = Type::Integer;
+			cached = &numericValue.integer;
+		}
+		else if constexpr ( std::is_same_v< T, uint64_t > )
+		{
+			type = Type::Unsigned;
+			cached = &numericValue.unsignedInteger;
+		}
+		else if constexpr ( std::is_same_v< T, float > )
+		{
+			type = Type::Float;
+			cached = &numericValue.floatNumber;
+		}
+		else
+		{
+			static_assert( std::is_same_v< T, double >, "Numeric values aren't held as this type" );
+
+			type = Type::Double;
+			cached = &numericValue.doubleNumber;
+		}
+
+		if ( !hasValue )
+			return false;
+
+		// Assigned numbers read as another type go through their text, so they read the same as they'll be saved
+		if ( valueIsNumber )
+		{
+			if ( numericValue.type == type )
+			{
+				number = *cached;
+				return true;
+			}
+
+			NumberBuffer buffer;
+			return ParseNumber( getValueText( buffer ), number );
+		}
+
+		if ( cacheNumbers && numericValue.type == type )
+		{
+			if ( numericValue.valid )
+				number = *cached;
+
+			return numericValue.valid;
+		}
+
+		const bool valid = ParseNumber( value.view(), number );
+
+		if ( cacheNumbers )
+		{
+			numericValue.type = type;
+			numericValue.valid = valid;
+
+			if ( valid )
+				*cached = number;
+		}
+
+		return valid;
+	}
+
+	template bool KeyValues::readNumber< int64_t >( int64_t &number ) const;
+	template bool KeyValues::readNumber< uint64_t >( uint64_t &number ) const;
+	template bool KeyValues::readNumber< float >( float &number ) const;
+	template bool KeyValues::readNumber< double >( double &number ) const;
+
+	bool KeyValues::parseNumber( const std::string_view &text, int64_t &number )
+	{
+		return ParseNumber( text, number );
+	}
+
+	bool KeyValues::parseNumber( const std::string_view &text, uint64_t &number )
+	{
+		return ParseNumber( text, number );
+	}
+
+	bool KeyValues::parseNumber( const std::string_view &text, float &number )
+	{
+		return ParseNumber( text, number );
+	}
+
+	bool KeyValues::parseNumber( const std::string_view &text, double &number )
+	{
+		return ParseNumber( text, number );
+	}
+
+	bool KeyValues::nextComponent( std::string_view &text, std::string_view &component )
+	{
+		constexpr const char *cSeparators = " \t\n\v\f\r[]{}";
+
+		text.remove_prefix( std::min( text.find_first_not_of( cSeparators ), text.size() ) );
+		if ( text.empty() )
+			return false;
+
+		component = text.substr( 0, text.find_first_of( cSeparators ) );
+		text.remove_prefix( component.size() );
+
+		return true;
+	}
+
+	std::string KeyValues::getKeyValue( const std::string &keyName, size_t index, const std::string &defaultVal /*= ""*/ ) const
+	{
+		expand();
+		const KeyValues *kv = keyvalues.find( keyName, index );
+		return ( kv ) ? kv->getValue( defaultVal ) : defaultVal;
+	}
+
+	std::string KeyValues::getKeyValue( const std::string &keyName, const std::string &defaultVal /*= ""*/ ) const
+	{
+		expand();
+		const KeyValues *kv = keyvalues.find( keyName );
+		return ( kv ) ? kv->getValue( defaultVal ) : defaultVal;
+	}
+
+	KeyValues *KeyValues::find( const KeyPath &path )
+	{
+		return path.find( *this );
+	}
+
+	const KeyValues *KeyValues::find( const KeyPath &path ) const
+	{
+		return path.find( *this );
+	}
+
+	KeyValues KeyValues::parseFromFile( const std::string &kvPath, const ExpressionEngine &expressionEngine /*= ExpressionEngine( true )*/, const ParseOptions &options /*= ParseOptions()*/ )
+	{
+		return parseFile( kvPath, expressionEngine, options, true ).document;
+	}
+
+	KeyValues KeyValues::parseFromBuffer( const std::string_view &buffer, const ExpressionEngine &expressionEngine /*= ExpressionEngine( true )*/, const ParseOptions &options /*= ParseOptions()*/ )
+	{
+		return parseDocument( buffer, nullptr, expressionEngine, options, true ).document;
+	}
+
+	ParseResult KeyValues::tryParseFromFile( const std::string &kvPath, const ExpressionEngine &expressionEngine /*= ExpressionEngine( true )*/, const ParseOptions &options /*= ParseOptions()*/ )
+	{
+		return parseFile( kvPath, expressionEngine, options, false );
+	}
+
+	ParseResult KeyValues::tryParseFromBuffer( const std::string_view &buffer, const ExpressionEngine &expressionEngine /*= ExpressionEngine( true )*/, const ParseOptions &options /*= ParseOptions()*/ )
+	{
+		return parseDocument( buffer, nullptr, expressionEngine, options, false );
+	}
+
+	KeyValues KeyValues::parseFromOwnedBuffer( std::string buffer, const ExpressionEngine &expressionEngine /*= ExpressionEngine( true )*/, ParseOptions options /*= ParseOptions()*/ )
+	{
+		auto owner = std::make_shared< const std::string >( std::move( buffer ) );
+		options.zeroCopy = true;
+
+		return parseDocument( *owner, owner, expressionEngine, options, true ).document;
+	}
+
+	ParseResult KeyValues::parseFile( const std::string &kvPath, const ExpressionEngine &expressionEngine, const ParseOptions &options, bool reportErrors )
+	{
+		std::shared_ptr< const MappedFile > file;
+
+		try
+		{
+			file = std::make_shared< const MappedFile >( kvPath );
+		}
+		catch ( const std::system_error &e )
+		{
+			if ( reportErrors && debugCallback )
+				debugCallback( std::string( e.what() ) + "\n" );
+
+			ParseResult result;
+			result.diagnostics.push_back( ParseDiagnostic{ ParseErrorCode::FileError, 0, 0, 0, e.what() } );
+
+			return result;
+		}
+
+		if ( options.snapshotCacheDirectory.empty() || options.keepConditionals )
+			return parseDocument( file->view(), ( options.zeroCopy ) ? file : nullptr, expressionEngine, options, reportErrors );
+
+		const SnapshotCache cache( options.snapshotCacheDirectory, kvPath, file->view(), expressionEngine.hashActiveConditions() );
+
+		if ( std::optional< KeyValues > cached = cache.load( options ) )
+		{
+			HashParsedDocument( *cached, options );
+			return ParseResult{ std::move( *cached ), std::vector< ParseDiagnostic >() };
+		}
+
+		// Zero copy documents keep the mapping alive, otherwise it's released as soon as parsing is done. Lazy documents copy
+		// the file, so it can change under them.
+		ParseResult result = parseDocument( file->view(), ( options.zeroCopy ) ? file : nullptr, expressionEngine, options, reportErrors );
+
+		// Storing a lazy document would parse all of it
+		if ( result.succeeded() && !result.document.lazyDocument )
+			cache.store( result.document );
+
+		return result;
+	}
+
+	ParseResult KeyValues::parseDocument( const std::string_view &input, std::shared_ptr< const void > owner, const ExpressionEngine &expressionEngine, const ParseOptions &options, bool reportErrors )
+	{
+		// The tryParse functions, which don't report errors, return every error with the document so they parse all of it
+		const bool lazy = ( options.lazySections && !options.keepConditionals && reportErrors );
+
+		// Lazy sections are parsed out of the input later on, so it's copied unless something already keeps it alive
+		std::string_view buffer = input;
+		if ( lazy && !owner && !options.zeroCopy && buffer.size() <= options.maxInputSize )
+		{
+			auto copy = std::make_shared< const std::string >( buffer );
+			buffer = *copy;
+			owner = std::move( copy );
+		}
+
+		// The first block is sized after the input, it usually holds the whole document unless it's lazy
+		ParseResult result = {
+			( options.useArena ) ? KeyValues( std::make_unique< Arena >( std::max( options.arenaBlockSize, ( lazy ) ? 0 : buffer.size() * 2 ) ) ) : KeyValues(),
+			std::vector< ParseDiagnostic >()
+		};
+
+		KeyValues &root = result.document;
+		root.source = std::move( owner );
+		root.cacheNumbers = options.cacheNumericValues;
+
+		if ( !lazy && options.parseThreads != 1 && buffer.size() <= options.maxInputSize && parseInParallel( root, buffer, expressionEngine, options ) )
+		{
+			HashParsedDocument( root, options );
+			return result;
+		}
+
+		Parser parser( buffer, expressionEngine, options );
+		TreeBuilder builder( root, options.zeroCopy, lazy );
+
+		if ( options.keepConditionals )
+			parser.keepConditions( builder );
+		else if ( lazy )
+			parser.reportSkippedSections( builder );
+
+		parser.parse( builder, result.diagnostics );
+
+		if ( lazy )
+		{
+			auto storage = std::make_shared< DocumentStorage >();
+			storage->source = std::move( root.source );
+			storage->buffer = buffer;
+			storage->expressionEngine.emplace( expressionEngine );
+			storage->options = options;
+			storage->nodeCount = root.keyvalues.size();
+
+			root.source = std::move( storage );
+			root.lazyDocument = true;
+		}
+
+		if ( !builder.getConditions().empty() )
+		{
+			auto storage = std::make_shared< DocumentStorage >();
+			storage->source = std::move( root.source );
+			storage->conditions = std::move( builder.getConditions() );
+
+			root.source = std::move( storage );
+		}
+
+		if ( reportErrors )
+		{
+			for ( const ParseDiagnostic &diagnostic : result.diagnostics )
+				ReportParseError( parser.getLineIndex(), diagnostic );
+		}
+
+		HashParsedDocument( root, options );
+		return result;
+	}
+
+	bool KeyValues::parseInParallel( KeyValues &root, const std::string_view &buffer, const ExpressionEngine &expressionEngine, const ParseOptions &options )
+	{
+		// Smaller ranges cost more in thread handoffs and splicing than they win back
+		constexpr const size_t cMinRangeSize = 64 * 1024;
+
+		size_t threadCount = ( options.parseThreads == 0 ) ? std::thread::hardware_concurrency() : options.parseThreads;
+		const std::vector< size_t > ends = SplitTopLevelSections( buffer, std::max( cMinRangeSize, buffer.size() / ( std::max< size_t >( threadCount, 1 ) * 4 ) ) );
+
+		threadCount = std::min( threadCount, ends.size() );
+		if ( threadCount < 2 )
+			return false;
+
+		struct Range
+		{
+			Range( const std::string_view &text, KeyValues &&part ) : text( text ), part( std::move( part ) ) {}
+
+			std::string_view text;
+			KeyValues part;
+			size_t nodeCount = 0;
+			std::vector< CompiledExpressionPtr > conditions;
+		};
+
+		std::vector< Range > ranges;
+		ranges.reserve( ends.size() );
+
+		for ( size_t i = 0, start = 0; i < ends.size(); start = ends[ i++ ] )
+		{
+			const std::string_view text = buffer.substr( start, ends[ i ] - start );
+
+			if ( options.useArena )
+				ranges.emplace_back( text, KeyValues( std::make_unique< Arena >( std::max( options.arenaBlockSize, text.size() * 2 ) ) ) );
+			else
+				ranges.emplace_back( text, KeyValues() );
+
+			ranges.back().part.cacheNumbers = options.cacheNumericValues;
+		}
+
+		// Workers take the next range until there are none left, or one of them failed
+		std::atomic< size_t > nextRange{ 0 };
+		std::atomic< bool > failed{ false };
+
+		auto work = [ & ]()
+		{
+			for ( size_t i = nextRange++; i < ranges.size() && !failed; i = nextRange++ )
+			{
+				Range &range = ranges[ i ];
+				TreeBuilder builder( range.part, options.zeroCopy );
+				Parser parser( range.text, expressionEngine, options );
+
+				if ( options.keepConditionals )
+					parser.keepConditions( builder );
+
+				if ( !parser.parseRange( builder, i + 1 == ranges.size(), range.nodeCount ) )
+					failed = true;
+
+				range.conditions = std::move( builder.getConditions() );
+			}
+		};
+
+		std::vector< std::thread > workers;
+		for ( size_t i = 1; i < threadCount; ++i )
+		{
+			// Carry on with the threads we got if the system won't give us more
+			try
+			{
+				workers.emplace_back( work );
+			}
+			catch ( const std::system_error & )
+			{
+				break;
+			}
+		}
+
+		work();
+
+		for ( std::thread &worker : workers )
+			worker.join();
+
+		size_t nodeCount = 0;
+		for ( const Range &range : ranges )
+			nodeCount += range.nodeCount;
+
+		// Errors are left to the serial parse, which reports them against the whole buffer
+		if ( failed || nodeCount > options.maxNodes )
+			return false;
+
+		// Arena backed parts keep their nodes in their own arenas, which the root takes over
+		auto storage = std::make_shared< DocumentStorage >();
+		storage->source = std::move( root.source );
+
+		for ( Range &range : ranges )
+		{
+			root.adoptChildren( range.part );
+
+			if ( range.part.arena )
+				storage->arenas.push_back( std::move( range.part.arena ) );
+
+			storage->conditions.insert( storage->conditions.end(), range.conditions.begin(), range.conditions.end() );
+		}
+
+		root.source = std::move( storage );
+		return true;
+	}
+
+	bool KeyValues::parseEvents( const std::string_view &buffer, ParseHandler &handler, const ExpressionEngine &expressionEngine /*= ExpressionEngine( true )*/, const ParseOptions &options /*= ParseOptions()*/ )
+	{
+		Parser parser( buffer, expressionEngine, options );
+		std::vector< ParseDiagnostic > diagnostics;
+
+		parser.parse( handler, diagnostics );
+
+		for ( const ParseDiagnostic &diagnostic : diagnostics )
+			ReportParseError( parser.getLineIndex(), diagnostic );
+
+		return diagnostics.empty();
+	}
+
+	StreamParser::StreamParser( ParseHandler &handler, const ExpressionEngine &expressionEngine /*= ExpressionEngine( true )*/, const ParseOptions &options /*= ParseOptions()*/ ) :
+		parser( std::make_unique< ChunkParser >( handler, expressionEngine, options ) )
+	{
+	}
+
+	StreamParser::~StreamParser() = default;
+
+	bool StreamParser::feed( const std::string_view &chunk )
+	{
+		if ( parser->feed( chunk ) )
+			return true;
+
+		reportErrors();
+		return false;
+	}
+
+	bool StreamParser::finish()
+	{
+		if ( parser->finish() )
+			return true;
+
+		reportErrors();
+		return false;
+	}
+
+	const std::vector< ParseDiagnostic > &StreamParser::getDiagnostics() const
+	{
+		return parser->getDiagnostics();
+	}
+
+	void StreamParser::reportErrors()
+	{
+		const std::vector< ParseDiagnostic > &diagnostics = parser->getDiagnostics();
+
+		// There's no buffer to quote the offending line from
+		for ( ; reported < diagnostics.size(); ++reported )
+			ReportParseError( LineIndex( std::string_view() ), diagnostics[ reported ] );
+	}
+
+	KeyValues KeyValues::parseFromBinary( const std::string_view &buffer, const ParseOptions &options /*= ParseOptions()*/ )
+	{
+		return std::move( parseBinaryDocument( buffer, nullptr, options, true ).document );
+	}
+
+	KeyValues KeyValues::parseFromBinaryFile( const std::string &path, const ParseOptions &options /*= ParseOptions()*/ )
+	{
+		std::shared_ptr< const MappedFile > file;
+
+		try
+		{
+			file = std::make_shared< const MappedFile >( path );
+		}
+		catch ( const std::system_error &e )
+		{
+			if ( debugCallback )
+				debugCallback( std::string( e.what() ) + "\n" );
+
+			return KeyValues();
+		}
+
+		// Zero copy documents keep the mapping alive, otherwise it's released as soon as parsing is done
+		return std::move( parseBinaryDocument( file->view(), ( options.zeroCopy ) ? file : nullptr, options, true ).document );
+	}
+
+	ParseResult KeyValues::tryParseFromBinary( const std::string_view &buffer, const ParseOptions &options /*= ParseOptions()*/ )
+	{
+		return parseBinaryDocument( buffer, nullptr, options, false );
+	}
+
+	ParseResult KeyValues::parseBinaryDocument( const std::string_view &buffer, std::shared_ptr< const void > owner, const ParseOptions &options, bool reportErrors )
+	{
+		// Binary documents are about as large in memory as they are on disk
+		ParseResult result = {
+			( options.useArena ) ? KeyValues( std::make_unique< Arena >( std::max( options.arenaBlockSize, buffer.size() * 2 ) ) ) : KeyValues(),
+			std::vector< ParseDiagnostic >()
+		};
+
+		KeyValues &root = result.document;
+		root.source = std::move( owner );
+		root.cacheNumbers = options.cacheNumericValues;
+
+		BinaryParser parser( buffer, options );
+		parser.parse( root, result.diagnostics );
+
+		if ( reportErrors && debugCallback )
+		{
+			for ( const ParseDiagnostic &diagnostic : result.diagnostics )
+				debugCallback( "[Offset: " + std::to_string( diagnostic.offset ) + "] " + diagnostic.message + "\n\n" );
+		}
+
+		HashParsedDocument( root, options );
+		return result;
+	}
+
+	void KeyValues::saveToBinary( std::string &out ) const
+	{
+		const KeyValues &root = getRoot();
+
+		// Counted first so the document can be written straight into the string
+		CountingOutput counter;
+		BinarySerializer< CountingOutput >( counter ).write( root );
+
+		out.resize( counter.getCount() );
+
+		BufferOutput output( out.data() );
+		BinarySerializer< BufferOutput >( output ).write( root );
+	}
+
+	bool KeyValues::saveToBinary( OutputSink &sink ) const
+	{
+		SinkOutput output( sink );
+		BinarySerializer< SinkOutput >( output ).write( getRoot() );
+
+		return output.finish();
+	}
+
+	bool KeyValues::saveToBinaryFile( const std::string &path ) const
+	{
+		FILE *file = std::fopen( path.c_str(), "wb" );
+		if ( !file )
+			return false;
+
+		// The serializer buffers on its own
+		std::setvbuf( file, nullptr, _IONBF, 0 );
+
+		FileSink sink( file );
+		const bool saved = saveToBinary( sink );
+
+		return ( std::fclose( file ) == 0 && saved );
+	}
+
+	bool KeyValues::saveToSnapshot( std::string &out ) const
+	{
+		return SnapshotWriter::write( getRoot(), out );
+	}
+
+	bool KeyValues::saveToSnapshotFile( const std::string &path ) const
+	{
+		std::string snapshot;
+		if ( !saveToSnapshot( snapshot ) )
+			return false;
+
+		FILE *file = std::fopen( path.c_str(), "wb" );
+		if ( !file )
+			return false;
+
+		const bool written = ( std::fwrite( snapshot.data(), 1, snapshot.size(), file ) == snapshot.size() );
+		return ( std::fclose( file ) == 0 && written );
+	}
+
+	static size_t GetSaveThreads( const SaveOptions &options )
+	{
+		return ( options.saveThreads == 0 ) ? std::thread::hardware_concurrency() : options.saveThreads;
+	}
+
+	bool KeyValues::saveToFile( const std::string &kvPath, const SaveOptions &options /*= SaveOptions()*/ ) const
+	{
+		const KeyValues &root = getRoot();
+		if ( root.isEmpty() )
+			return true;
+
+		if ( options.saveThreads != 1 )
+		{
+			ParallelSerializer serializer( root, options, GetSaveThreads( options ) );
+			if ( serializer.canSplit() )
+				return serializer.saveToFile( kvPath );
+		}
+
+		// Binary, so the file holds the same bytes whether it's saved on one thread or several
+		FILE *file = std::fopen( kvPath.c_str(), "wb" );
+		if ( !file )
+			return false;
+
+		// The serializer buffers on its own
+		std::setvbuf( file, nullptr, _IONBF, 0 );
+
+		FileSink sink( file );
+		const bool saved = saveToSink( sink, options );
+
+		return ( std::fclose( file ) == 0 && saved );
+	}
+
+	void KeyValues::saveToBuffer( std::string &out, const SaveOptions &options /*= SaveOptions()*/ ) const
+	{
+		out.clear();
+
+		const KeyValues &root = getRoot();
+		if ( root.isEmpty() )
+			return;
+
+		if ( options.saveThreads != 1 )
+		{
+			ParallelSerializer serializer( root, options, GetSaveThreads( options ) );
+			if ( serializer.canSplit() )
+			{
+				serializer.saveToBuffer( out );
+				return;
+			}
+		}
+
+		// Counted first so the text can be written straight into the string
+		out.resize( getSaveSize( options ) );
+
+		BufferOutput output( out.data() );
+		Serializer< BufferOutput > serializer( output, options );
+
+		for ( const KeyValues &kv : root )
+			serializer.write( kv );
+	}
+
+	bool KeyValues::saveToSink( OutputSink &sink, const SaveOptions &options /*= SaveOptions()*/ ) const
+	{
+		SinkOutput output( sink );
+		Serializer< SinkOutput > serializer( output, options );
+
+		for ( const KeyValues &kv : getRoot() )
+			serializer.write( kv );
+
+		return output.finish();
+	}
+
+	size_t KeyValues::getSaveSize( const SaveOptions &options /*= SaveOptions()*/ ) const
+	{
+		CountingOutput output;
+		Serializer< CountingOutput > serializer( output, options );
+
+		for ( const KeyValues &kv : getRoot() )
+			serializer.write( kv );
+
+		return output.getCount();
+	}
+
+	void KeyValues::setKeyValue( const std::string &kvValue )
+	{
+		makeValue();
+		invalidateHash();
+
+		value.assign( kvValue, keyvalues.getResource() );
+		valueIsNumber = false;
+		numericValue.type = NumericValue::Type::Empty;
+	}
+
+	void KeyValues::setNumericValue( const NumericValue &numeric )
+	{
+		makeValue();
+		invalidateHash();
+
+		value.release( keyvalues.getResource() );
+		valueIsNumber = true;
+		numericValue = numeric;
+	}
+
+	void KeyValues::makeValue()
+	{
+		if ( isSection() )
+		{
+			expand();
+
+			for ( auto &kv : keyvalues )
+			{
+				kv->parentKV = parentKV;
+				--kv->depth;
+			}
+		}
+
+		hasValue = true;
+	}
+
+	std::string KeyValues::getValue( const std::string &defaultVal /*= std::string()*/ ) const
+	{
+		if ( !hasValue )
+			return defaultVal;
+
+		NumberBuffer buffer;
+		return std::string( getValueText( buffer ) );
+	}
+
+	std::string_view KeyValues::getValueText( NumberBuffer &buffer ) const
+	{
+		if ( !valueIsNumber )
+			return value.view();
+
+		char *const begin = buffer.data();
+		char *const end = buffer.data() + buffer.size();
+		std::to_chars_result result = { begin, std::errc() };
+
+		// Without a precision floating point numbers are written in their shortest round trip form
+		switch ( numericValue.type )
+		{
+			case NumericValue::Type::Integer:
+				result = std::to_chars( begin, end, numericValue.integer );
+				break;
+			case NumericValue::Type::Unsigned:
+				result = std::to_chars( begin, end, numericValue.unsignedInteger );
+				break;
+			case NumericValue::Type::Float:
+				result = std::to_chars( begin, end, numericValue.floatNumber );
+				break;
+			case NumericValue::Type::Double:
+				result = std::to_chars( begin, end, numericValue.doubleNumber );
+				break;
+			case NumericValue::Type::Pointer:
+				result = std::to_chars( begin, end, numericValue.unsignedInteger );
+				break;
+			case NumericValue::Type::Color:
+			{
+				for ( size_t i = 0; i < sizeof( numericValue.color ); ++i )
+				{
+					if ( i > 0 )
+						*result.ptr++ = ' ';
+
+					result = std::to_chars( result.ptr, end, numericValue.color[ i ] );
+				}
 			}
+			break;
+			case NumericValue::Type::Empty:
+				break;
 		}
 
-		value = kvValue;
+		return std::string_view( begin, result.ptr - begin );
 	}
 }
\ No newline at end of file
@@ -1,6 +1,13 @@
 #include <iostream>
+#include <fstream>
+#include <filesystem>
+#include <algorithm>
+#include <cstring>
+#include <thread>
+#include <atomic>
 
 #include "keyvalues.hpp"
+#include "snapshot.hpp" // To build malformed snapshots
 
 #ifdef _WIN32
 #define NOMINMAX
@@ -12,6 +19,26 @@ void DebugCallback( const std::string_view &output )
 	std::cout << output;
 }
 
+// Counted so main can return an error when any check fails
+size_t failedChecks = 0;
+
+void Check( bool passed, const std::string &description )
+{
+	if ( passed )
+		return;
+
+	std::cout << "Check failed: " << description << std::endl;
+	++failedChecks;
+}
+
+// Documents are compared by the text they save to
+std::string SaveText( const KV::KeyValues &kv )
+{
+	std::string text;
+	kv.saveToBuffer( text );
+	return text;
+}
+
 void SerializeTest()
 {
 	KV::KeyValues root;
@@ -61,6 +88,1171 @@ void ParseErrorTest()
 	KV::KeyValues::parseFromBuffer( test );
 }
 
+void ParseEventsTest()
+{
+	const std::string test =
+	R"(VertexLitGeneric
+		{
+			$basetexture "path/to/vtf"
+			Proxies
+			{
+				Sine { resultVar $alpha }
+			}
+		}
+		UnlitGeneric
+		{
+			$basetexture "path/to/other/vtf"
+		}
+	)";
+
+	struct BaseTextureHandler : public KV::ParseHandler
+	{
+		Action onSectionBegin( const std::string_view &key ) override
+		{
+			return ( key == "Proxies" ) ? Action::SkipSection : Action::Continue;
+		}
+
+		Action onKeyValue( const std::string_view &key, const std::string_view &value ) override
+		{
+			if ( key == "$basetexture" )
+			{
+				std::cout << value << std::endl;
+				textures.emplace_back( value );
+			}
+			else if ( key == "resultVar" )
+			{
+				sawSkipped = true;
+			}
+
+			return Action::Continue;
+		}
+
+		std::vector< std::string > textures;
+		bool sawSkipped = false;
+	};
+
+	std::cout << "Parse events test:" << std::endl;
+
+	BaseTextureHandler handler;
+	Check( KV::KeyValues::parseEvents( test, handler ), "parsing events succeeds" );
+	Check( handler.textures == std::vector< std::string >{ "path/to/vtf", "path/to/other/vtf" }, "every value is raised in order" );
+	Check( !handler.sawSkipped, "a skipped section raises no events" );
+
+	std::cout << std::endl;
+}
+
+void StreamParseTest()
+{
+	const std::string test = R"(Sprite { $spriteorigin "[ 0.50 0.50 ]" /* centered */ $translucent 1 })";
+
+	struct PairHandler : public KV::ParseHandler
+	{
+		Action onKeyValue( const std::string_view &key, const std::string_view &value ) override
+		{
+			pairs.append( key ).append( " = " ).append( value ).append( "\n" );
+			return Action::Continue;
+		}
+
+		std::string pairs;
+	};
+
+	std::cout << "Stream parse test:" << std::endl;
+
+	// Chunk boundaries fall inside strings and comments
+	PairHandler handler;
+	KV::StreamParser parser( handler );
+
+	for ( size_t i = 0; i < test.size(); i += 5 )
+		parser.feed( std::string_view( test ).substr( i, 5 ) );
+
+	Check( parser.finish(), "a stream parse succeeds" );
+	Check( handler.pairs == "$spriteorigin = [ 0.50 0.50 ]\n$translucent = 1\n", "values split between chunks are put back together" );
+
+	std::cout << handler.pairs;
+
+	// Fed a byte at a time, every boundary is tried
+	PairHandler bytes;
+	KV::StreamParser byteParser( bytes );
+
+	for ( size_t i = 0; i < test.size(); ++i )
+		byteParser.feed( std::string_view( test ).substr( i, 1 ) );
+
+	Check( byteParser.finish() && bytes.pairs == handler.pairs, "feeding a byte at a time raises the same values" );
+
+	std::cout << std::endl;
+}
+
+void ConditionalsTest()
+{
+	const std::string test = R"(Shader { $basetexture "dev/dev_measuregeneric01" $bumpmap "dev/normal" [!$LOWEND] $lightwarp "dev/warp" [$WINDOWS || $LINUX] })";
+
+	KV::ParseOptions options;
+	options.keepConditionals = true;
+
+	// Parsed once, then materialized for every target
+	const KV::KeyValues kv = KV::KeyValues::parseFromBuffer( test, KV::ExpressionEngine( false ), options );
+
+	KV::ExpressionEngine desktop( true );
+	KV::ExpressionEngine lowEnd( false );
+	lowEnd.setCondition( "LOWEND", true );
+
+	std::cout << "Conditionals test:" << std::endl;
+
+	std::string condition;
+	for ( const KV::KeyValues &shader : kv )
+	{
+		for ( const KV::KeyValues &param : shader )
+		{
+			if ( param.getKey() == "$bumpmap" && param.hasCondition() )
+				condition = param.getCondition();
+		}
+	}
+
+	Check( condition == "[!$LOWEND]", "a kept node holds its condition" );
+
+	std::vector< std::string > kept;
+
+	for ( const KV::ExpressionEngine *expressionEngine : { &desktop, &lowEnd } )
+	{
+		const KV::KeyValues target = kv.materialize( *expressionEngine );
+		std::string keys;
+
+		for ( const KV::KeyValues &shader : target )
+		{
+			for ( const KV::KeyValues &param : shader )
+			{
+				std::cout << param.getKey() << " = " << param.getValue() << std::endl;
+				keys += param.getKey() + " ";
+			}
+		}
+
+		kept.push_back( keys );
+		std::cout << std::endl;
+	}
+
+	// Only Windows and Linux builds have a lightwarp, the desktop engine is set up for the platform it runs on
+#if defined( _WIN32 ) || defined( __linux__ )
+	Check( kept.size() == 2 && kept[ 0 ] == "$basetexture $bumpmap $lightwarp ", "the desktop target keeps what its conditions allow" );
+#endif
+	Check( kept.size() == 2 && kept[ 1 ] == "$basetexture ", "the low end target leaves out what its conditions don't allow" );
+}
+
+void ChildContainerTest()
+{
+	// Past 16 children lookups go through the hash index
+	KV::KeyValues root;
+	for ( int i = 0; i < 40; ++i )
+		root.createKeyValue( "key" + std::to_string( i % 8 ), std::to_string( i ) );
+
+	std::cout << "Child container test:" << std::endl;
+
+	Check( root.getCount( "key3" ) == 5, "every duplicate of a key is counted" );
+	Check( root.get( "key3", 0 ).getValue() == "3" && root.get( "key3", 4 ).getValue() == "35", "duplicates are found in the order they were added" );
+
+	root.removeKey( "key3" );
+	root.removeKey( "key5", 2 );
+
+	Check( root.getCount( "key3" ) == 4 && root.get( "key3", 0 ).getValue() == "11", "removing the first of a key keeps the others" );
+	Check( root.getCount( "key5" ) == 4 && root.get( "key5", 2 ).getValue() == "29", "removing a key by index keeps the others" );
+	Check( root.getCount( "key8" ) == 0 && root.getKeyValue( "key3", 4, "missing" ) == "missing", "missing keys aren't found" );
+
+	// Removing keys doesn't change the order of the others
+	size_t count = 0;
+	int last = -1;
+	bool ordered = true;
+
+	for ( KV::KeyValues &kv : root )
+	{
+		const int value = std::stoi( kv.getValue() );
+		ordered = ordered && ( value > last );
+		last = value;
+		++count;
+	}
+
+	Check( count == 38 && ordered, "children are iterated in the order they were added" );
+
+	std::cout << std::endl;
+}
+
+void ArenaTest()
+{
+	const std::string test = R"(Material { $basetexture "path/to/a/texture/with/a/name/too/long/to/be/stored/inline" Proxies { Sine { resultVar $alpha } } })";
+
+	// Blocks this small make the document span several of them
+	KV::ParseOptions options;
+	options.useArena = true;
+	options.arenaBlockSize = 64;
+
+	KV::KeyValues arena = KV::KeyValues::parseFromBuffer( test, KV::ExpressionEngine( true ), options );
+	KV::KeyValues heap = KV::KeyValues::parseFromBuffer( test );
+
+	std::cout << "Arena test:" << std::endl;
+
+	Check( SaveText( arena ) == SaveText( heap ), "an arena backed document holds the same nodes" );
+
+	// Edits allocate from the arena too
+	for ( KV::KeyValues *root : { &arena, &heap } )
+	{
+		KV::KeyValues &material = ( *root )[ "Material" ];
+		material[ "$basetexture" ] = "short";
+		material[ "$bumpmap" ] = "path/to/another/texture/with/a/name/too/long/to/be/stored/inline";
+		material.removeKey( "Proxies" );
+	}
+
+	Check( SaveText( arena ) == SaveText( heap ), "edits to an arena backed document match edits to one on the heap" );
+
+	KV::KeyValues moved = std::move( arena );
+	Check( SaveText( moved ) == SaveText( heap ), "a moved document keeps its arena" );
+
+	std::cout << std::endl;
+}
+
+void ZeroCopyTest()
+{
+	const std::string test = R"(Material { $basetexture "path/to/vtf" "$key with spaces" "value with spaces" Proxies { Sine { resultVar $alpha } } })";
+
+	KV::ParseOptions options;
+	options.zeroCopy = true;
+
+	KV::KeyValues borrowed = KV::KeyValues::parseFromBuffer( test, KV::ExpressionEngine( true ), options );
+	KV::KeyValues copied = KV::KeyValues::parseFromBuffer( test );
+
+	// The buffer handed over is gone once the call returns, the document keeps it alive
+	KV::KeyValues owned = KV::KeyValues::parseFromOwnedBuffer( std::string( test ) );
+
+	std::cout << "Zero copy test:" << std::endl;
+
+	Check( SaveText( borrowed ) == SaveText( copied ), "a zero copy document holds the same nodes" );
+	Check( SaveText( owned ) == SaveText( copied ), "a document owning its buffer holds the same nodes" );
+
+	// Setting a borrowed value stores a copy instead of writing to the buffer
+	borrowed[ "Material" ][ "$basetexture" ] = "other/vtf";
+	borrowed[ "Material" ][ "$key with spaces" ] = "a value long enough not to be stored inline in the node";
+
+	Check( borrowed[ "Material" ].getKeyValue( "$basetexture" ) == "other/vtf", "a borrowed value can be set" );
+	Check( borrowed[ "Material" ].getKeyValue( "$key with spaces" ) == "a value long enough not to be stored inline in the node", "a borrowed value can be set to a longer one" );
+	Check( test.find( "\"path/to/vtf\"" ) != std::string::npos, "setting a borrowed value leaves the buffer alone" );
+
+	std::cout << std::endl;
+}
+
+void ScannerTest()
+{
+	std::cout << "Scanner test:" << std::endl;
+
+	// Padding moves every structural character across the scanner's block boundaries
+	size_t failures = 0;
+
+	for ( size_t padding = 0; padding < 80; ++padding )
+	{
+		const std::string filler( padding, 'x' );
+		const std::string test = std::string( padding, ' ' ) + "Material // comment with \" { }\n{\n\t$basetexture \"" + filler + "{ } // \"\n\t" + filler + "key " + filler + "value\n}\n";
+
+		KV::KeyValues root = KV::KeyValues::parseFromBuffer( test );
+		if ( root.getCount( "Material" ) != 1 )
+		{
+			++failures;
+			continue;
+		}
+
+		const KV::KeyValues &material = root.get( "Material", 0 );
+		if ( material.getKeyValue( "$basetexture" ) != filler + "{ } // " || material.getKeyValue( filler + "key" ) != filler + "value" )
+			++failures;
+	}
+
+	Check( failures == 0, "structural characters are found wherever they fall" );
+
+	std::cout << std::endl;
+}
+
+void LimitsTest()
+{
+	std::cout << "Limits test:" << std::endl;
+
+	// Nested far deeper than a recursive parser could go on the call stack
+	const size_t depth = 100000;
+
+	std::string deep;
+	for ( size_t i = 0; i < depth; ++i )
+		deep += "a{";
+
+	deep += "b 1";
+	deep.append( depth, '}' );
+
+	KV::KeyValues root = KV::KeyValues::parseFromBuffer( deep );
+
+	size_t found = 0;
+	for ( KV::KeyValues *kv = &root; kv->getCount( "a" ) == 1; kv = &kv->get( "a", 0 ) )
+		++found;
+
+	Check( found == depth, "deep nesting is parsed without running out of stack" );
+
+	// Exceeding a limit is a parse error
+	std::string reported;
+	KV::setDebugCallback( [ &reported ]( const std::string_view &output ) { reported += output; } );
+
+	KV::ParseOptions options;
+	options.maxDepth = 64;
+	KV::KeyValues::parseFromBuffer( deep, KV::ExpressionEngine( true ), options );
+	Check( reported.find( "Sections nested deeper than 64 levels" ) != std::string::npos, "nesting past maxDepth is reported" );
+
+	options = KV::ParseOptions();
+	options.maxNodes = 1000;
+	reported.clear();
+	KV::KeyValues::parseFromBuffer( deep, KV::ExpressionEngine( true ), options );
+	Check( reported.find( "Document has more than 1000 nodes" ) != std::string::npos, "more nodes than maxNodes is reported" );
+
+	options = KV::ParseOptions();
+	options.maxInputSize = 16;
+	reported.clear();
+	KV::KeyValues::parseFromBuffer( deep, KV::ExpressionEngine( true ), options );
+	Check( reported.find( "Input exceeds the maximum size of 16 bytes" ) != std::string::npos, "input larger than maxInputSize is reported" );
+
+	KV::setDebugCallback( &DebugCallback );
+
+	std::cout << std::endl;
+}
+
+void MappedFileTest()
+{
+	const std::filesystem::path path = std::filesystem::temp_directory_path() / "testkv_mapped.txt";
+	const std::string test = "Material { $basetexture \"path/to/vtf\" Proxies { Sine { resultVar $alpha } } }\n";
+
+	std::ofstream( path, std::ios::binary | std::ios::trunc ) << test;
+
+	std::cout << "Mapped file test:" << std::endl;
+
+	KV::KeyValues parsed = KV::KeyValues::parseFromBuffer( test );
+	KV::KeyValues mapped = KV::KeyValues::parseFromFile( path.string() );
+	Check( SaveText( mapped ) == SaveText( parsed ), "a mapped file parses like the same text in a buffer" );
+
+	// Zero copy documents keep viewing the mapping
+	KV::ParseOptions options;
+	options.zeroCopy = true;
+
+	KV::KeyValues borrowed = KV::KeyValues::parseFromFile( path.string(), KV::ExpressionEngine( true ), options );
+	Check( SaveText( borrowed ) == SaveText( parsed ), "a zero copy document of a mapped file holds the same nodes" );
+
+	// An empty file has nothing to map
+	std::ofstream( path, std::ios::binary | std::ios::trunc );
+	Check( KV::KeyValues::parseFromFile( path.string() ).isEmpty(), "an empty file gives an empty document" );
+
+	std::filesystem::remove( path );
+
+	std::string reported;
+	KV::setDebugCallback( [ &reported ]( const std::string_view &output ) { reported += output; } );
+
+	const KV::KeyValues missing = KV::KeyValues::parseFromFile( path.string() );
+	KV::setDebugCallback( &DebugCallback );
+
+	Check( missing.isEmpty() && reported.find( "Failed to open" ) != std::string::npos, "a missing file gives an empty document and is reported" );
+
+	std::cout << std::endl;
+}
+
+void ParallelParseTest()
+{
+	// Enough top level sections to split into several ranges
+	std::string text;
+	for ( int i = 0; i < 4000; ++i )
+		text += "Material" + std::to_string( i ) + " { $basetexture \"path/to/vtf\" $alpha 0.5 Proxies { Sine { resultVar $alpha } } }\n";
+
+	KV::ParseOptions serial;
+	KV::ParseOptions parallel;
+	parallel.parseThreads = 4;
+
+	std::cout << "Parallel parse test:" << std::endl;
+
+	KV::KeyValues serialRoot = KV::KeyValues::parseFromBuffer( text, KV::ExpressionEngine( true ), serial );
+	KV::KeyValues parallelRoot = KV::KeyValues::parseFromBuffer( text, KV::ExpressionEngine( true ), parallel );
+	Check( SaveText( parallelRoot ) == SaveText( serialRoot ), "a parallel parse builds the same document as a serial one" );
+
+	// Falls back to the serial parse, which reports the error against the whole buffer
+	const size_t broken = text.find( '\n', text.size() / 2 ) + 1;
+	const size_t brokenLine = std::count( text.begin(), text.begin() + broken, '\n' ) + 1;
+	text.insert( broken, "Broken { { }\n" );
+
+	std::string serialReport;
+	KV::setDebugCallback( [ &serialReport ]( const std::string_view &output ) { serialReport += output; } );
+	KV::KeyValues serialBroken = KV::KeyValues::parseFromBuffer( text, KV::ExpressionEngine( true ), serial );
+
+	std::string parallelReport;
+	KV::setDebugCallback( [ &parallelReport ]( const std::string_view &output ) { parallelReport += output; } );
+	KV::KeyValues parallelBroken = KV::KeyValues::parseFromBuffer( text, KV::ExpressionEngine( true ), parallel );
+
+	KV::setDebugCallback( &DebugCallback );
+
+	Check( !parallelReport.empty() && parallelReport == serialReport, "an error is reported the same way by both parses" );
+	Check( parallelReport.find( "[Line: " + std::to_string( brokenLine ) + " " ) != std::string::npos, "the error is on the line it was inserted at" );
+	Check( SaveText( parallelBroken ) == SaveText( serialBroken ), "a parse with errors keeps the same nodes" );
+
+	std::cout << std::endl;
+}
+
+void LineIndexTest()
+{
+	std::cout << "Line index test:" << std::endl;
+
+	std::string reported;
+	KV::setDebugCallback( [ &reported ]( const std::string_view &output ) { reported += output; } );
+
+	// Columns count UTF-8 characters rather than bytes, and CRLF ends a line like LF does
+	KV::KeyValues::parseFromBuffer( "Material\r\n{\r\n\t\"h\xC3\xA9llo\" \"w\xC3\xB6rld\"\r\n\t\"\xC3\xA9\" \"unterminated\r\n}" );
+	Check( reported.find( "[Line: 4 Column: 18]" ) != std::string::npos, "an error is placed by line and by character" );
+
+	// Far into a large document
+	std::string large;
+	for ( int i = 0; i < 10000; ++i )
+		large += "Material" + std::to_string( i ) + " { $alpha 1 }\n";
+
+	large += "Broken { { }\n";
+
+	reported.clear();
+	KV::KeyValues::parseFromBuffer( large );
+	Check( reported.find( "[Line: 10001 Column: 10]" ) != std::string::npos, "an error far into a document is placed on its line" );
+
+	KV::setDebugCallback( &DebugCallback );
+
+	std::cout << std::endl;
+}
+
+void TryParseTest()
+{
+	std::cout << "Try parse test:" << std::endl;
+
+	// Unterminated quote on the third line
+	const KV::ParseResult quote = KV::KeyValues::tryParseFromBuffer( "Material\n{\n\t$basetexture \"path\n" );
+	Check( quote.diagnostics.size() == 1, "an unterminated quote is reported once" );
+
+	if ( !quote.diagnostics.empty() )
+	{
+		const KV::ParseDiagnostic &diagnostic = quote.diagnostics.front();
+		Check( diagnostic.code == KV::ParseErrorCode::UnterminatedQuote, "the error is an unterminated quote" );
+		Check( diagnostic.line == 3 && diagnostic.column == 19, "the error is at the end of the third line" );
+	}
+
+	// Both errors are found in one pass, and the key after them is kept
+	const std::string errors =
+	R"(Material
+		{
+			{ $alpha 1 }
+			] $color 3
+			$detail 4
+		}
+	)";
+
+	KV::ParseOptions recover;
+	recover.recoverFromErrors = true;
+
+	const KV::ParseResult recovered = KV::KeyValues::tryParseFromBuffer( errors, KV::ExpressionEngine( true ), recover );
+	Check( recovered.diagnostics.size() == 2, "recovering reports every error" );
+
+	if ( recovered.diagnostics.size() == 2 )
+	{
+		Check( recovered.diagnostics[ 0 ].code == KV::ParseErrorCode::UnexpectedSectionStart && recovered.diagnostics[ 0 ].line == 3, "the first error is the section without a key" );
+		Check( recovered.diagnostics[ 1 ].code == KV::ParseErrorCode::UnexpectedExpressionEnd && recovered.diagnostics[ 1 ].line == 4, "the second error is the stray ']'" );
+	}
+
+	std::string detail;
+	for ( const KV::KeyValues &material : recovered.document )
+		detail = material.getKeyValue( "$detail" );
+
+	Check( detail == "4", "the key after the errors is kept" );
+
+	// Errors inside sections are still returned when lazy sections are asked for
+	KV::ParseOptions lazy;
+	lazy.lazySections = true;
+
+	const KV::ParseResult lazyResult = KV::KeyValues::tryParseFromBuffer( "Material\n{\n\t{ $alpha 1 }\n}\n", KV::ExpressionEngine( true ), lazy );
+	Check( !lazyResult.succeeded(), "a lazy parse doesn't succeed with an error inside a section" );
+	Check( lazyResult.diagnostics.size() == 1 && lazyResult.diagnostics.front().line == 3, "the error inside the section is returned" );
+
+	std::cout << std::endl;
+}
+
+void ExpressionTest()
+{
+	const std::string test = R"(Root { both 1 [$A && $B] either 1 [$A || $B] notB 1 [!$B] grouped 1 [!($A && $B) && ($A || $B)] })";
+
+	KV::ExpressionEngine expressionEngine( false );
+	expressionEngine.setCondition( "A", true );
+	expressionEngine.setCondition( "B", false );
+
+	// Keys kept by a parse with the engine's current conditions
+	auto getKeys = [ & ]()
+	{
+		KV::KeyValues root = KV::KeyValues::parseFromBuffer( test, expressionEngine );
+
+		std::string keys;
+		for ( KV::KeyValues &kv : root[ "Root" ] )
+			keys += kv.getKey() + " ";
+
+		return keys;
+	};
+
+	std::cout << "Expression test:" << std::endl;
+
+	Check( getKeys() == "either notB grouped ", "operators and parentheses are evaluated" );
+
+	// Compiled expressions are cached, the results have to follow the conditions
+	expressionEngine.setCondition( "B", true );
+	Check( getKeys() == "both either ", "changing a condition changes the results of cached expressions" );
+
+	std::cout << std::endl;
+}
+
+void TypedReadTest()
+{
+	KV::KeyValues root;
+	KV::KeyValues &value = root.createKeyValue( "value", "  42" );
+
+	std::cout << "Typed read test:" << std::endl;
+
+	Check( value.getValueAs< int >( -1 ) == 42, "leading whitespace is skipped" );
+
+	value.setKeyValue( "+7" );
+	Check( value.getValueAs< int >( -1 ) == 7, "a plus sign is skipped" );
+
+	value.setKeyValue( "12abc" );
+	Check( value.getValueAs< int >( -1 ) == 12, "text after a number is ignored" );
+
+	value.setKeyValue( "abc" );
+	Check( value.getValueAs< int >( -1 ) == -1, "a value that isn't a number gives the default" );
+
+	value.setKeyValue( "300" );
+	Check( value.getValueAs< uint8_t >( 7 ) == 7, "a number that doesn't fit gives the default" );
+
+	value.setKeyValue( "-1" );
+	Check( value.getValueAs< unsigned int >( 5 ) == 5, "a negative number read as unsigned gives the default" );
+
+	value.setKeyValue( "1e3" );
+	Check( value.getValueAs< double >() == 1000.0, "exponents are read" );
+
+	value.setKeyValue( "2" );
+	Check( value.getValueAs< bool >() && !root.createKeyValue( "zero", "0" ).getValueAs< bool >( true ), "bools are read as integers" );
+
+	Check( root.createKey( "section" ).getValueAs< int >( -3 ) == -3, "a section gives the default" );
+
+	// Cached numbers are dropped when the value is set
+	KV::ParseOptions options;
+	options.cacheNumericValues = true;
+
+	KV::KeyValues cached = KV::KeyValues::parseFromBuffer( "value 1.5", KV::ExpressionEngine( true ), options );
+	KV::KeyValues &number = cached[ "value" ];
+
+	Check( number.getValueAs< double >() == 1.5 && number.getValueAs< double >() == 1.5, "a cached number reads the same again" );
+
+	number.setKeyValue( "2.5" );
+	Check( number.getValueAs< double >() == 2.5, "setting the value drops the cached number" );
+
+	std::cout << std::endl;
+}
+
+void NumberFormatTest()
+{
+	KV::KeyValues root;
+	root[ "tenth" ] = 0.1;
+	root[ "third" ] = 1.0 / 3.0;
+	root[ "large" ] = 1e300;
+	root[ "float" ] = 0.1f;
+	root[ "min" ] = std::numeric_limits< int64_t >::min();
+	root[ "max" ] = std::numeric_limits< uint64_t >::max();
+	root[ "negative" ] = int8_t( -5 );
+	root[ "bool" ] = true;
+
+	std::cout << "Number format test:" << std::endl;
+
+	// Shortest text that reads back to the same number
+	Check( root[ "tenth" ].getValue() == "0.1" && root[ "float" ].getValue() == "0.1" && root[ "large" ].getValue() == "1e+300", "numbers are written in their shortest form" );
+	Check( root[ "min" ].getValue() == "-9223372036854775808" && root[ "max" ].getValue() == "18446744073709551615", "integers are written whole" );
+	Check( root[ "negative" ].getValue() == "-5" && root[ "bool" ].getValue() == "1", "small integers and bools are written as numbers" );
+
+	// Saved and parsed again, every number reads back the same
+	std::string text;
+	root.saveToBuffer( text );
+
+	KV::KeyValues parsed = KV::KeyValues::parseFromBuffer( text );
+	Check( parsed[ "tenth" ].getValueAs< double >() == 0.1 && parsed[ "third" ].getValueAs< double >() == 1.0 / 3.0 && parsed[ "large" ].getValueAs< double >() == 1e300, "doubles read back to the same value" );
+	Check( parsed[ "float" ].getValueAs< float >() == 0.1f, "floats read back to the same value" );
+	Check( parsed[ "min" ].getValueAs< int64_t >() == std::numeric_limits< int64_t >::min() && parsed[ "max" ].getValueAs< uint64_t >() == std::numeric_limits< uint64_t >::max(), "integers read back to the same value" );
+
+	std::cout << std::endl;
+}
+
+void VectorTest()
+{
+	const std::string test = R"(Model { $color "[0 0.5 1]" $origin "1 2" $bounds "{1 2 3 4}" $mixed "1 a 2" })";
+
+	KV::KeyValues root = KV::KeyValues::parseFromBuffer( test );
+	KV::KeyValues &model = root[ "Model" ];
+
+	std::cout << "Vector test:" << std::endl;
+
+	const std::array< float, 3 > color = model[ "$color" ].getValueAsVector< 3, float >();
+	Check( color[ 0 ] == 0.0f && color[ 1 ] == 0.5f && color[ 2 ] == 1.0f, "brackets around a vector are skipped" );
+	Check( model[ "$origin" ].getValueAsVector< 3, float >( { 9.0f, 9.0f, 9.0f } )[ 0 ] == 9.0f, "a value with too few numbers gives the default" );
+
+	int numbers[ 4 ] = {};
+	Check( model[ "$bounds" ].getValueAsArray( numbers, 4 ) == 4 && numbers[ 3 ] == 4, "braces around an array are skipped" );
+	Check( model[ "$origin" ].getValueAsArray( numbers, 4 ) == 2 && numbers[ 1 ] == 2, "an array stops at the end of the value" );
+	Check( model[ "$mixed" ].getValueAsArray( numbers, 4 ) == 1 && numbers[ 0 ] == 1, "an array stops at the first component that isn't a number" );
+
+	// One entry per child, lined up with the children
+	KV::KeyValues lights = KV::KeyValues::parseFromBuffer( R"(Lights { Sun { color "1 1 0.5" } Ambient { } Fill { color "0.25 0.25 0.25" } })" );
+
+	std::vector< std::array< float, 3 > > colors;
+	lights[ "Lights" ].getChildValuesAsVector< 3, float >( "color", colors, { -1.0f, -1.0f, -1.0f } );
+
+	Check( colors.size() == 3 && colors[ 0 ][ 2 ] == 0.5f && colors[ 1 ][ 0 ] == -1.0f && colors[ 2 ][ 1 ] == 0.25f, "children without the key get the default" );
+
+	std::cout << std::endl;
+}
+
+void SinkTest()
+{
+	// Collects what it's given, failing once it would hold more than 'limit' bytes
+	struct StringSink : public KV::OutputSink
+	{
+		bool write( const char *data, size_t size ) override
+		{
+			++writes;
+
+			if ( text.size() + size > limit )
+				return false;
+
+			text.append( data, size );
+			return true;
+		}
+
+		std::string text;
+		size_t limit = std::numeric_limits< size_t >::max();
+		size_t writes = 0;
+	};
+
+	// Large enough to be written in several chunks
+	KV::KeyValues root;
+	for ( int i = 0; i < 2000; ++i )
+		root[ "Material" + std::to_string( i ) ][ "$basetexture" ] = "path/to/vtf";
+
+	root[ "Quoted key" ][ "$value" ] = "with spaces";
+	root[ "Quoted key" ][ "$empty" ] = "";
+	root[ "Quoted key" ][ "$alpha" ] = 0.5;
+
+	std::cout << "Sink test:" << std::endl;
+
+	std::string buffer;
+	root.saveToBuffer( buffer );
+
+	StringSink sink;
+	Check( root.saveToSink( sink ) && sink.text == buffer, "a sink is given the same text as a buffer" );
+	Check( sink.writes > 1, "a large document is written in several chunks" );
+	Check( root.getSaveSize() == buffer.size(), "getSaveSize matches what's saved" );
+
+	StringSink failing;
+	failing.limit = 1;
+	Check( !root.saveToSink( failing ) && failing.writes == 1, "a failing sink ends the save" );
+
+	// Compact output only quotes what has to be
+	KV::SaveOptions options;
+	options.compact = true;
+
+	std::string compact;
+	root.saveToBuffer( compact, options );
+
+	Check( compact.size() < buffer.size(), "a compact save is smaller" );
+	Check( SaveText( KV::KeyValues::parseFromBuffer( compact ) ) == buffer, "a compact save reads back into the same document" );
+
+	std::cout << std::endl;
+}
+
+void ParallelSaveTest()
+{
+	// Large enough to be split between threads, with numbers and nested sections in every piece
+	KV::KeyValues root;
+	for ( int i = 0; i < 200; ++i )
+	{
+		KV::KeyValues &material = root.createKey( "Material" + std::to_string( i ) );
+		for ( int j = 0; j < 100; ++j )
+		{
+			material[ "$param" + std::to_string( j ) ] = j * 0.25;
+			material.createKey( "Proxies" )[ "Sine" ][ "resultVar" ] = "$alpha";
+		}
+	}
+
+	std::cout << "Parallel save test:" << std::endl;
+
+	for ( bool compact : { false, true } )
+	{
+		KV::SaveOptions options;
+		options.compact = compact;
+
+		std::string serial;
+		root.saveToBuffer( serial, options );
+
+		options.saveThreads = 4;
+
+		std::string parallel;
+		root.saveToBuffer( parallel, options );
+
+		Check( parallel == serial, "a parallel save writes the same text as a serial one" );
+		Check( root.getSaveSize( options ) == parallel.size(), "getSaveSize matches what a parallel save writes" );
+
+		Check( root.saveToFile( "test_parallel_save.txt", options ), "a parallel save to a file succeeds" );
+
+		std::ifstream file( "test_parallel_save.txt", std::ios::binary );
+		const std::string saved( ( std::istreambuf_iterator< char >( file ) ), std::istreambuf_iterator< char >() );
+		Check( saved == serial, "a parallel save to a file writes the same bytes as a serial one" );
+
+		// Small documents are saved serially, they write the same text too
+		KV::KeyValues small;
+		small[ "Material" ][ "$basetexture" ] = "path/to/vtf";
+
+		std::string smallSerial;
+		std::string smallParallel;
+		options.saveThreads = 1;
+		small.saveToBuffer( smallSerial, options );
+		options.saveThreads = 4;
+		small.saveToBuffer( smallParallel, options );
+
+		Check( smallParallel == smallSerial, "a small document saved with threads writes the same text" );
+	}
+
+	std::cout << std::endl;
+}
+
+void BinaryTest()
+{
+	const std::string test =
+	R"(VertexLitGeneric
+		{
+			$basetexture "path/to/vtf"
+			$basetexture "duplicate"
+			$empty ""
+			Proxies
+			{
+				Sine { resultVar $alpha sineperiod 8 }
+				Empty { }
+			}
+		}
+	)";
+
+	KV::KeyValues root = KV::KeyValues::parseFromBuffer( test );
+	root[ "VertexLitGeneric" ][ "$alpha" ] = 0.75;
+
+	std::cout << "Binary test:" << std::endl;
+
+	std::string binary;
+	root.saveToBinary( binary );
+
+	const KV::ParseResult loaded = KV::KeyValues::tryParseFromBinary( binary );
+	Check( loaded.succeeded(), "a binary save loads without errors" );
+	Check( SaveText( loaded.document ) == SaveText( root ), "a binary save loads back into the same document" );
+
+	// Cut short, it has to fail rather than load part of the document
+	const KV::ParseResult truncated = KV::KeyValues::tryParseFromBinary( std::string_view( binary ).substr( 0, binary.size() / 2 ) );
+	Check( !truncated.succeeded() && truncated.diagnostics.front().code == KV::ParseErrorCode::InvalidBinary, "a truncated binary save is rejected" );
+
+	std::cout << std::endl;
+}
+
+void SnapshotTest()
+{
+	std::cout << "Snapshot test:" << std::endl;
+
+	// Two empty sections, nodes 1 and 2 are the root's children
+	const KV::KeyValues sections = KV::KeyValues::parseFromBuffer( "First { } Second { }" );
+
+	std::string snapshot;
+	Check( sections.saveToSnapshot( snapshot ), "a document is saved to a snapshot" );
+	Check( SaveText( KV::Snapshot::fromBuffer( snapshot ).toKeyValues() ) == SaveText( sections ), "a snapshot loads back into the same document" );
+
+	// Node 2 made its own child instead of the root's, which still accounts for every node once
+	KV::SnapshotHeader header;
+	std::memcpy( &header, snapshot.data(), sizeof( header ) );
+
+	KV::SnapshotNode nodes[ 3 ];
+	std::memcpy( nodes, snapshot.data() + header.nodesOffset, sizeof( nodes ) );
+	nodes[ 0 ].childCount = 1;
+	nodes[ 2 ].firstChild = 2;
+	nodes[ 2 ].childCount = 1;
+	std::memcpy( &snapshot[ header.nodesOffset ], nodes, sizeof( nodes ) );
+
+	bool rejected = false;
+	try
+	{
+		KV::Snapshot::fromBuffer( snapshot );
+	}
+	catch ( const std::runtime_error & )
+	{
+		rejected = true;
+	}
+
+	Check( rejected, "a snapshot with a node before its parent is rejected" );
+
+	// Cached snapshots are only used for the same contents parsed with the same conditions
+	const std::filesystem::path directory = std::filesystem::temp_directory_path() / "testkv_snapshots";
+	const std::filesystem::path path = directory / "material.txt";
+
+	std::filesystem::remove_all( directory );
+	std::filesystem::create_directories( directory );
+
+	KV::ParseOptions options;
+	options.snapshotCacheDirectory = ( directory / "cache" ).string();
+
+	auto getTexture = [ & ]( const KV::ExpressionEngine &expressionEngine )
+	{
+		KV::KeyValues root = KV::KeyValues::parseFromFile( path.string(), expressionEngine, options );
+		return root[ "Material" ][ "$basetexture" ].getValue();
+	};
+
+	const KV::ExpressionEngine desktop( true );
+	KV::ExpressionEngine lowEnd( true );
+	lowEnd.setCondition( "LOWEND", true );
+
+	std::ofstream( path, std::ios::binary | std::ios::trunc ) << "Material { $basetexture \"first\" }\n";
+	Check( getTexture( desktop ) == "first", "a file is parsed the first time" );
+
+	std::filesystem::path cachePath;
+	for ( const std::filesystem::directory_entry &entry : std::filesystem::directory_iterator( options.snapshotCacheDirectory ) )
+	{
+		if ( entry.path().extension() == ".kvsnap" )
+			cachePath = entry.path();
+	}
+
+	Check( !cachePath.empty(), "the parsed file is stored in the cache" );
+
+	// The cached copy of the value is changed, a document holding it came from the cache
+	std::string cached;
+	{
+		std::ifstream file( cachePath, std::ios::binary );
+		cached.assign( std::istreambuf_iterator< char >( file ), std::istreambuf_iterator< char >() );
+	}
+
+	const size_t first = cached.find( "first" );
+	if ( first != std::string::npos )
+		cached.replace( first, 5, "cache" );
+
+	std::ofstream( cachePath, std::ios::binary | std::ios::trunc ) << cached;
+
+	Check( getTexture( desktop ) == "cache", "an unchanged file is loaded from the cache" );
+	Check( getTexture( lowEnd ) == "first", "other conditions don't use the cached snapshot" );
+
+	std::ofstream( path, std::ios::binary | std::ios::trunc ) << "Material { $basetexture \"second\" }\n";
+	Check( getTexture( lowEnd ) == "second", "changed contents don't use the cached snapshot" );
+
+	std::filesystem::remove_all( directory );
+
+	std::cout << std::endl;
+}
+
+// Empty if there's no match
+std::string GetMatchValue( const KV::KeyValues *kv ) { return ( kv ) ? kv->getValue() : std::string(); }
+std::string GetMatchValue( const KV::SnapshotView &view ) { return std::string( view.getValue() ); }
+std::string GetMatchValue( const KV::PersistentView &view ) { return std::string( view.getValue() ); }
+
+// Runs the same queries on every kind of document, 'Match' is what they find
+template< typename Root, typename Match >
+void CheckKeyPaths( const Root &root, const std::string &kind )
+{
+	// Empty has no resultVar
+	std::vector< Match > matches;
+	Check( KV::KeyPath( "Material/Proxies/*/resultVar" ).findAll( root, matches ) == 2, kind + ": a wildcard matches in every section" );
+	Check( matches.size() == 2 && GetMatchValue( matches[ 0 ] ) == "$alpha" && GetMatchValue( matches[ 1 ] ) == "$color", kind + ": wildcard matches are in document order" );
+
+	Check( GetMatchValue( KV::KeyPath( "Material/$basetexture" ).find( root ) ) == "first", kind + ": a path finds the first of a key" );
+	Check( GetMatchValue( KV::KeyPath( "Material/$basetexture#1" ).find( root ) ) == "second", kind + ": #n finds the n-th of a key" );
+	Check( GetMatchValue( KV::KeyPath( "Material/$basetexture#2" ).find( root ) ).empty(), kind + ": #n past the last of a key finds nothing" );
+
+	matches.clear();
+	Check( KV::KeyPath( "Material/$basetexture#*" ).findAll( root, matches ) == 2, kind + ": #* finds every one of a key" );
+
+	KV::KeyPathSet paths;
+	const size_t linear = paths.add( "Material/Proxies/Linear/resultVar" );
+	const size_t missing = paths.add( "Material/Proxies/Missing" );
+	const size_t second = paths.add( "Material/$basetexture#1" );
+	const size_t sine = paths.add( "Material/Proxies/*/resultVar" );
+
+	std::vector< Match > results;
+	paths.resolve( root, results );
+
+	Check( results.size() == 4, kind + ": a batch has a result for every path" );
+
+	if ( results.size() == 4 )
+	{
+		Check( GetMatchValue( results[ linear ] ) == "$color" && GetMatchValue( results[ second ] ) == "second", kind + ": a batch finds every path" );
+		Check( GetMatchValue( results[ sine ] ) == "$alpha", kind + ": a batch finds the first match of a wildcard" );
+		Check( !results[ missing ], kind + ": a batch finds nothing for a missing path" );
+	}
+}
+
+void KeyPathTest()
+{
+	const std::string test =
+	R"(Material
+		{
+			$basetexture "first"
+			$basetexture "second"
+			Proxies
+			{
+				Sine { resultVar $alpha }
+				Linear { resultVar $color }
+				Empty { }
+			}
+		}
+	)";
+
+	std::cout << "Key path test:" << std::endl;
+
+	const KV::KeyValues root = KV::KeyValues::parseFromBuffer( test );
+	CheckKeyPaths< KV::KeyValues, const KV::KeyValues* >( root, "KeyValues" );
+
+	std::string snapshot;
+	root.saveToSnapshot( snapshot );
+	CheckKeyPaths< KV::SnapshotView, KV::SnapshotView >( KV::Snapshot::fromBuffer( snapshot ).getRoot(), "SnapshotView" );
+
+	const KV::PersistentDocument persistent( root );
+	CheckKeyPaths< KV::PersistentView, KV::PersistentView >( persistent.getRoot(), "PersistentView" );
+
+	std::cout << std::endl;
+}
+
+void LazyTest()
+{
+	const std::string test =
+	R"(Material
+		{
+			$basetexture "path/to/vtf"
+			Proxies
+			{
+				Sine { resultVar $alpha }
+				Linear { resultVar $color }
+			}
+		}
+	)";
+
+	const std::string broken = test + "Broken\n{\n\t{ $alpha 1 }\n}\n";
+
+	std::cout << "Lazy test:" << std::endl;
+
+	// Errors in lazy sections go to the debug callback once the section is parsed
+	std::string reported;
+	KV::setDebugCallback( [ &reported ]( const std::string_view &output ) { reported += output; } );
+
+	KV::ParseOptions options;
+	options.lazySections = true;
+
+	KV::KeyValues lazy = KV::KeyValues::parseFromBuffer( broken, KV::ExpressionEngine( true ), options );
+	Check( reported.empty(), "a lazy parse doesn't parse the sections" );
+
+	Check( lazy[ "Material" ][ "$basetexture" ].getValue() == "path/to/vtf", "indexing parses a section" );
+
+	size_t proxies = 0;
+	for ( const KV::KeyValues &proxy : lazy[ "Material" ][ "Proxies" ] )
+		proxies += ( proxy.find( "resultVar" ) ) ? 1 : 0;
+
+	Check( proxies == 2, "iterating and find parse a section" );
+
+	const KV::KeyValues *resultVar = lazy.find( KV::KeyPath( "Material/Proxies/Linear/resultVar" ) );
+	Check( resultVar && resultVar->getValue() == "$color", "a path query parses the sections on its way" );
+	Check( reported.empty(), "a section that isn't read isn't parsed" );
+
+	lazy[ "Broken" ].begin();
+	Check( reported.find( "Unexpected start to subsection" ) != std::string::npos, "an error in a section is reported once it's read" );
+
+	Check( SaveText( KV::KeyValues::parseFromBuffer( test, KV::ExpressionEngine( true ), options ) ) == SaveText( KV::KeyValues::parseFromBuffer( test ) ), "a lazy document holds the same nodes as an eager parse" );
+
+	// Limits count every section parsed so far, not only the one being parsed
+	KV::ParseOptions limited = options;
+	limited.maxNodes = 5;
+
+	reported.clear();
+	KV::KeyValues::parseFromBuffer( test, KV::ExpressionEngine( true ), limited ).expandAll();
+	Check( reported.find( "Document has more than 5 nodes" ) != std::string::npos, "the node limit applies across sections" );
+
+	limited = options;
+	limited.maxDepth = 2;
+
+	reported.clear();
+	KV::KeyValues::parseFromBuffer( test, KV::ExpressionEngine( true ), limited ).expandAll();
+	Check( reported.find( "Sections nested deeper than 2 levels" ) != std::string::npos, "the depth limit applies across sections" );
+
+	KV::setDebugCallback( &DebugCallback );
+
+	std::cout << std::endl;
+}
+
+void PersistentTest()
+{
+	const std::string test = R"(Material { $basetexture "path/to/vtf" Proxies { Sine { resultVar $alpha } } } Other { $alpha 1 })";
+
+	const KV::PersistentDocument original( KV::KeyValues::parseFromBuffer( test ) );
+
+	std::cout << "Persistent test:" << std::endl;
+
+	KV::PersistentDocument edited = original;
+	Check( edited.set( KV::KeyPath( "Material/$basetexture" ), "other/vtf" ), "setting an existing key succeeds" );
+	Check( edited.set( KV::KeyPath( "Material/$bumpmap" ), "normal/vtf" ), "setting a missing key creates it" );
+	Check( edited.remove( KV::KeyPath( "Material/Proxies" ) ), "removing a section succeeds" );
+	Check( !edited.remove( KV::KeyPath( "Missing" ) ), "removing a missing key fails" );
+
+	const KV::PersistentView material = edited.getRoot()[ "Material" ];
+	Check( material.getKeyValue( "$basetexture" ) == "other/vtf" && material.getKeyValue( "$bumpmap" ) == "normal/vtf" && !material[ "Proxies" ], "the edited version has the edits" );
+
+	// The version the edits started from is left as it was
+	const KV::PersistentView unchanged = original.getRoot()[ "Material" ];
+	Check( unchanged.getKeyValue( "$basetexture" ) == "path/to/vtf" && !unchanged[ "$bumpmap" ] && unchanged[ "Proxies" ][ "Sine" ].getKeyValue( "resultVar" ) == "$alpha", "the original version is unchanged" );
+	Check( SaveText( original.toKeyValues() ) == SaveText( KV::KeyValues::parseFromBuffer( test ) ), "the original version still holds the document it was made from" );
+
+	// Past 16 children sections are indexed, edits keep the index in order
+	KV::PersistentDocument wide;
+	for ( int i = 0; i < 20; ++i )
+		wide.set( KV::KeyPath( "Section/" + std::string( ( i % 2 ) ? "odd#" : "even#" ) + std::to_string( i / 2 ) ), std::to_string( i ) );
+
+	wide.remove( KV::KeyPath( "Section/even#3" ) );
+	wide.set( KV::KeyPath( "Section/even#9" ), "20" );
+
+	const KV::PersistentView section = wide.getRoot()[ "Section" ];
+	Check( section.getCount( "even" ) == 10 && section.getCount( "odd" ) == 10, "edits keep the count of every key" );
+	Check( section.get( "even", 2 ).getValue() == "4" && section.get( "even", 3 ).getValue() == "8" && section.get( "even", 9 ).getValue() == "20", "edits keep keys in order" );
+
+	const KV::PersistentDocument rebuilt( wide.toKeyValues() );
+	Check( rebuilt.getRoot()[ "Section" ].get( "even", 9 ).getValue() == "20" && rebuilt.getRoot()[ "Section" ].get( "odd", 9 ).getValue() == "19", "an edited document converts back in order" );
+
+	// Readers copy the document while it's being edited, every copy is one whole version
+	KV::PersistentDocument live;
+	std::atomic< bool > editing{ true };
+	std::atomic< bool > torn{ false };
+
+	std::thread reader( [ & ]()
+	{
+		while ( editing )
+		{
+			const KV::PersistentDocument version = live;
+			const KV::PersistentView config = version.getRoot()[ "Config" ];
+
+			if ( config.getKeyValue( "first" ) != config.getKeyValue( "second" ) )
+				torn = true;
+		}
+	} );
+
+	for ( int i = 0; i < 1000; ++i )
+	{
+		KV::KeyValues values;
+		values[ "first" ] = i;
+		values[ "second" ] = i;
+
+		live.set( KV::KeyPath( "Config" ), KV::PersistentDocument( values ) );
+	}
+
+	editing = false;
+	reader.join();
+
+	Check( !torn, "a copy made during an edit is a whole version" );
+
+	std::cout << std::endl;
+}
+
+void ReloadTest()
+{
+	const std::filesystem::path path = std::filesystem::temp_directory_path() / "testkv_reload.txt";
+
+	// Written next to the file and renamed over it, so the watcher never sees it half written
+	auto write = [ & ]( const std::string &contents )
+	{
+		const std::filesystem::path written = path.string() + ".tmp";
+		std::ofstream( written, std::ios::binary | std::ios::trunc ) << contents;
+		std::filesystem::rename( written, path );
+	};
+
+	write( "Material { $basetexture \"first\" }\n" );
+
+	std::cout << "Reload test:" << std::endl;
+
+	{
+		KV::ReloadManager manager;
+		const KV::DocumentHandle &handle = manager.watch( path.string() );
+		const uint64_t watched = handle.getVersion();
+
+		// The background thread may pick the change up first, either way it's in once checkNow returns
+		write( "Material { $basetexture \"second/texture\" }\n" );
+		manager.checkNow();
+
+		const uint64_t rewritten = handle.getVersion();
+		Check( rewritten > watched, "a rewritten file is published" );
+		Check( handle.read()->find( "Material" )->getKeyValue( "$basetexture" ) == "second/texture", "the new version has the new contents" );
+
+		// Held across the broken rewrite below, the version it pins has to stay readable
+		const KV::DocumentHandle::ReadGuard guard = handle.read();
+
+		write( "Material { $basetexture \"third\" \n" );
+		manager.checkNow();
+
+		Check( handle.getVersion() == rewritten, "a broken file isn't published" );
+		Check( handle.read()->find( "Material" )->getKeyValue( "$basetexture" ) == "second/texture", "a broken file keeps the last version" );
+		Check( guard->find( "Material" )->getKeyValue( "$basetexture" ) == "second/texture", "a guard keeps reading its version" );
+	}
+
+	std::filesystem::remove( path );
+
+	// A replaced version is only freed once the guard reading it is released
+	KV::DocumentHandle handle;
+
+	KV::KeyValues first;
+	first[ "version" ] = "first";
+	handle.publish( std::move( first ) );
+
+	{
+		const KV::DocumentHandle::ReadGuard guard = handle.read();
+
+		KV::KeyValues second;
+		second[ "version" ] = "second";
+		handle.publish( std::move( second ) );
+
+		Check( handle.reclaim() == 1, "a version being read isn't freed" );
+		Check( guard->getKeyValue( "version" ) == "first", "the guard still reads the old version" );
+		Check( handle.read()->getKeyValue( "version" ) == "second", "new reads see the new version" );
+	}
+
+	Check( handle.reclaim() == 0, "the old version is freed once the guard is released" );
+
+	std::cout << std::endl;
+}
+
+void ContentHashTest()
+{
+	const std::string test = R"(Material { $basetexture "path/to/vtf" Proxies { Sine { resultVar $alpha } } })";
+
+	KV::KeyValues root = KV::KeyValues::parseFromBuffer( test );
+	const uint64_t hash = root.getContentHash();
+
+	std::cout << "Content hash test:" << std::endl;
+
+	// Edits deep in the document change the root's hash, undoing them gives it back
+	KV::KeyValues &sine = root[ "Material" ][ "Proxies" ][ "Sine" ];
+	sine[ "resultVar" ].setKeyValue( "$color" );
+	Check( root.getContentHash() != hash, "setting a value changes the hash" );
+
+	sine[ "resultVar" ].setKeyValue( "$alpha" );
+	Check( root.getContentHash() == hash, "setting the value back restores the hash" );
+
+	sine.createKeyValue( "sineperiod", "8" );
+	Check( root.getContentHash() != hash, "adding a key changes the hash" );
+
+	sine.removeKey( "sineperiod" );
+	Check( root.getContentHash() == hash, "removing the key restores the hash" );
+
+	// Both kinds of document hash their contents the same way
+	const KV::PersistentDocument persistent( root );
+	Check( persistent.getRoot().getContentHash() == hash, "a persistent document hashes the same as a KeyValues" );
+	Check( root == KV::KeyValues::parseFromBuffer( test ), "a document equals a parse of the same text" );
+
+	KV::PersistentDocument edited = persistent;
+	edited.set( KV::KeyPath( "Material/$basetexture" ), "other/vtf" );
+	Check( edited != persistent && persistent == KV::PersistentDocument( KV::KeyValues::parseFromBuffer( test ) ), "persistent documents compare by their contents" );
+
+	std::cout << std::endl;
+}
+
 int main()
 {
 #ifdef _WIN32
@@ -72,7 +1264,32 @@ int main()
 	SerializeTest();
 	ParseFileTest();
 	ParseStringTest();
+	ParseEventsTest();
+	StreamParseTest();
+	ConditionalsTest();
 	ParseErrorTest();
+	ChildContainerTest();
+	ArenaTest();
+	ZeroCopyTest();
+	ScannerTest();
+	LimitsTest();
+	MappedFileTest();
+	ParallelParseTest();
+	LineIndexTest();
+	TryParseTest();
+	ExpressionTest();
+	TypedReadTest();
+	NumberFormatTest();
+	VectorTest();
+	SinkTest();
+	ParallelSaveTest();
+	BinaryTest();
+	SnapshotTest();
+	KeyPathTest();
+	LazyTest();
+	PersistentTest();
+	ReloadTest();
+	ContentHashTest();
 
-	return 0;
+	return ( failedChecks == 0 ) ? 0 : 1;
 }
\ No newline at end of file
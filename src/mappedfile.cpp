@@ -0,0 +1,137 @@
+#include "mappedfile.hpp"
+
+#include <system_error>
+#include <limits>
+#include <cstdint>
+
+#ifdef _WIN32
+#define WIN32_LEAN_AND_MEAN
+#define NOMINMAX
+#include <Windows.h>
+#else
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <cerrno>
+#endif
+
+namespace KV
+{
+#ifdef _WIN32
+	MappedFile::MappedFile( const std::string &path )
+	{
+		auto fail = [ &path ]( const char *what, DWORD error )
+		{
+			throw std::system_error( static_cast< int >( error ), std::system_category(), std::string( what ) + " '" + path + "'" );
+		};
+
+		HANDLE file = CreateFileA( path.c_str(), GENERIC_READ, FILE_SHARE_READ, nullptr, OPEN_EXISTING, FILE_FLAG_SEQUENTIAL_SCAN, nullptr );
+		if ( file == INVALID_HANDLE_VALUE )
+			fail( "Failed to open", GetLastError() );
+
+		LARGE_INTEGER fileSize;
+		if ( !GetFileSizeEx( file, &fileSize ) )
+		{
+			const DWORD error = GetLastError();
+			CloseHandle( file );
+			fail( "Failed to get the size of", error );
+		}
+
+		if ( static_cast< uint64_t >( fileSize.QuadPart ) > std::numeric_limits< size_t >::max() )
+		{
+			CloseHandle( file );
+			throw std::system_error( std::make_error_code( std::errc::file_too_large ), "Failed to map '" + path + "'" );
+		}
+
+		// Empty files can't be mapped
+		size = static_cast< size_t >( fileSize.QuadPart );
+		if ( size == 0 )
+		{
+			CloseHandle( file );
+			return;
+		}
+
+		mapping = CreateFileMappingA( file, nullptr, PAGE_READONLY, 0, 0, nullptr );
+		const DWORD error = GetLastError();
+		CloseHandle( file );
+
+		if ( !mapping )
+			fail( "Failed to map", error );
+
+		data = static_cast< const char* >( MapViewOfFile( mapping, FILE_MAP_READ, 0, 0, 0 ) );
+		if ( !data )
+		{
+			const DWORD viewError = GetLastError();
+			CloseHandle( mapping );
+			fail( "Failed to map", viewError );
+		}
+	}
+
+	MappedFile::~MappedFile()
+	{
+		if ( data )
+			UnmapViewOfFile( data );
+
+		if ( mapping )
+			CloseHandle( mapping );
+	}
+#else
+	MappedFile::MappedFile( const std::string &path )
+	{
+		auto fail = [ &path ]( const char *what, int error )
+		{
+			throw std::system_error( error, std::generic_category(), std::string( what ) + " '" + path + "'" );
+		};
+
+		const int fd = open( path.c_str(), O_RDONLY | O_CLOEXEC );
+		if ( fd == -1 )
+			fail( "Failed to open", errno );
+
+		struct stat info;
+		if ( fstat( fd, &info ) == -1 )
+		{
+			const int error = errno;
+			close( fd );
+			fail( "Failed to get the size of", error );
+		}
+
+		if ( !S_ISREG( info.st_mode ) )
+		{
+			close( fd );
+			fail( "Failed to map", EINVAL );
+		}
+
+		if ( static_cast< uint64_t >( info.st_size ) > std::numeric_limits< size_t >::max() )
+		{
+			close( fd );
+			fail( "Failed to map", EFBIG );
+		}
+
+		// Empty files can't be mapped
+		size = static_cast< size_t >( info.st_size );
+		if ( size == 0 )
+		{
+			close( fd );
+			return;
+		}
+
+		void *address = mmap( nullptr, size, PROT_READ, MAP_PRIVATE, fd, 0 );
+		const int error = errno;
+		close( fd );
+
+		if ( address == MAP_FAILED )
+			fail( "Failed to map", error );
+
+		// Only a hint, the mapping works the same if it's ignored
+		madvise( address, size, MADV_SEQUENTIAL );
+		data = static_cast< const char* >( address );
+	}
+
+	MappedFile::~MappedFile()
+	{
+		if ( data )
+			munmap( const_cast< char* >( data ), size );
+	}
+#endif
+}
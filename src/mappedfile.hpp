@@ -0,0 +1,30 @@
+#pragma once
+
+#include <string>
+#include <string_view>
+
+namespace KV
+{
+	// Read only memory mapping of a whole file, advised for sequential access since the
+	// parser reads it front to back once. Zero copy documents keep it alive as their source.
+	class MappedFile
+	{
+	public:
+		// Throws std::system_error if the file can't be opened or mapped
+		explicit MappedFile( const std::string &path );
+		~MappedFile();
+
+		MappedFile( const MappedFile& ) = delete;
+		MappedFile &operator=( const MappedFile& ) = delete;
+
+		std::string_view view() const { return std::string_view( data, size ); }
+
+	private:
+		const char *data = nullptr;
+		size_t size = 0;
+
+#ifdef _WIN32
+		void *mapping = nullptr;
+#endif
+	};
+}
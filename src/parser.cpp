@@ -0,0 +1,1016 @@
+#include "parser.hpp"
+
+#include <algorithm>
+#include <string>
+
+namespace KV
+{
+	std::vector< size_t > SplitTopLevelSections( const std::string_view &buffer, size_t minRangeSize )
+	{
+		StructuralIndex scanner( buffer );
+		std::vector< size_t > ends;
+
+		size_t depth = 0;
+		size_t rangeStart = 0;
+
+		for ( size_t i = scanner.findStructural( 0 ); i != std::string::npos; i = scanner.findStructural( i ) )
+		{
+			const char &c = buffer[ i ];
+			if ( c == '"' )
+			{
+				i = scanner.findChar( i + 1, '"' );
+				if ( i != std::string::npos )
+					++i;
+
+				continue;
+			}
+			else if ( c == '/' && scanner.peekChar( i + 1 ) == '/' )
+			{
+				i = scanner.skipLineComment( i );
+				continue;
+			}
+			else if ( c == '/' && scanner.peekChar( i + 1 ) == '*' )
+			{
+				i = scanner.skipMultiLineComment( i );
+				continue;
+			}
+			else if ( c == '[' )
+			{
+				// Expressions end at the first ']' outside parentheses, or at a newline where they're an error
+				size_t parens = 0;
+				for ( ++i; i < buffer.size(); ++i )
+				{
+					if ( buffer[ i ] == '(' )
+						++parens;
+					else if ( buffer[ i ] == ')' && parens > 0 )
+						--parens;
+					else if ( buffer[ i ] == '\n' || ( buffer[ i ] == ']' && parens == 0 ) )
+						break;
+				}
+			}
+			else if ( c == '{' )
+				++depth;
+			else if ( c == '}' )
+			{
+				// A stray '}' ends the document, whatever follows stays in the last range
+				if ( depth == 0 )
+					break;
+
+				if ( --depth == 0 && i + 1 - rangeStart >= minRangeSize )
+				{
+					ends.push_back( i + 1 );
+					rangeStart = i + 1;
+				}
+			}
+
+			++i;
+		}
+
+		// Whatever follows the last cut is merged into the last range
+		if ( !ends.empty() && buffer.size() - ends.back() < minRangeSize )
+			ends.pop_back();
+
+		ends.push_back( buffer.size() );
+		return ends;
+	}
+
+	ParseHandler::Action TreeBuilder::onSectionBegin( const std::string_view &key )
+	{
+		KeyValues &parent = *sections.back();
+		KeyValues &section = attachCondition( ( zeroCopy ) ? parent.createBorrowedKey( key ) : parent.createKey( key ) );
+
+		if ( lazy )
+		{
+			skippedSection = &section;
+			return Action::SkipSection;
+		}
+
+		sections.push_back( &section );
+		return Action::Continue;
+	}
+
+	ParseHandler::Action TreeBuilder::onKeyValue( const std::string_view &key, const std::string_view &value )
+	{
+		KeyValues &parent = *sections.back();
+		attachCondition( ( zeroCopy ) ? parent.createBorrowedKeyValue( key, value ) : parent.createKeyValue( key, value ) );
+
+		return Action::Continue;
+	}
+
+	ParseHandler::Action TreeBuilder::onSectionEnd()
+	{
+		sections.pop_back();
+		return Action::Continue;
+	}
+
+	void TreeBuilder::onSectionSkipped( const std::string_view &body )
+	{
+		// Sections skipped for a false conditional never reached us
+		if ( !skippedSection )
+			return;
+
+		skippedSection->value.borrow( body, skippedSection->keyvalues.getResource() );
+		skippedSection->lazy = true;
+		skippedSection = nullptr;
+	}
+
+	void TreeBuilder::setCondition( const CompiledExpressionPtr &condition )
+	{
+		pendingCondition = condition.get();
+
+		if ( knownConditions.insert( pendingCondition ).second )
+			conditions.push_back( condition );
+	}
+
+	KeyValues &TreeBuilder::attachCondition( KeyValues &kv )
+	{
+		kv.condition = pendingCondition;
+		pendingCondition = nullptr;
+
+		return kv;
+	}
+
+	Grammar::Grammar( ParseHandler &handler, const ParseOptions &options, bool copyStrings ) :
+		handler( handler ),
+		options( options ),
+		copyStrings( copyStrings )
+	{
+	}
+
+	bool Grammar::onString( const std::string_view &str, size_t offset )
+	{
+		if ( !key.has_value() )
+			setKey( str );
+		else if ( !value.has_value() )
+			setValue( str );
+		else
+		{
+			if ( isActive() && !emitKeyValue( offset ) )
+				return false;
+
+			setKey( str );
+			value.reset();
+			expressionResult.reset();
+			expressionCondition.reset();
+		}
+
+		return true;
+	}
+
+	ParseHandler::Action Grammar::onSectionStart( size_t offset )
+	{
+		if ( !key.has_value() )
+		{
+			fail( ParseErrorCode::UnexpectedSectionStart, "Unexpected start to subsection", offset );
+			return ParseHandler::Action::Stop;
+		}
+
+		ParseHandler::Action action = ParseHandler::Action::SkipSection;
+
+		if ( isActive() )
+		{
+			if ( baseDepth + sections.size() >= options.maxDepth )
+			{
+				fail( ParseErrorCode::NestedTooDeep, "Sections nested deeper than " + std::to_string( options.maxDepth ) + " levels", offset );
+				return ParseHandler::Action::Stop;
+			}
+
+			if ( !countNode( offset ) )
+				return ParseHandler::Action::Stop;
+
+			passCondition();
+			action = handler.onSectionBegin( key.value() );
+		}
+
+		if ( action == ParseHandler::Action::Stop )
+			stopped = true;
+		else if ( action == ParseHandler::Action::Continue )
+			sections.push_back( offset );
+
+		resetPending();
+		return action;
+	}
+
+	bool Grammar::onSectionEnd( size_t offset )
+	{
+		if ( key.has_value() && !value.has_value() )
+		{
+			fail( ParseErrorCode::UnexpectedSectionEnd, "Unexpected end to section", offset );
+			if ( !options.recoverFromErrors )
+				return false;
+
+			// The key is dropped and the section still closes when recovering
+			failed = false;
+		}
+		else if ( key.has_value() && value.has_value() && isActive() && !emitKeyValue( offset ) )
+			return false;
+
+		resetPending();
+
+		// A stray '}' in global space ends the document
+		if ( sections.empty() )
+			return false;
+
+		sections.pop_back();
+
+		if ( handler.onSectionEnd() == ParseHandler::Action::Stop )
+		{
+			stopped = true;
+			return false;
+		}
+
+		return true;
+	}
+
+	bool Grammar::onExpressionStart( size_t offset )
+	{
+		if ( !key.has_value() )
+			return fail( ParseErrorCode::UnexpectedExpressionStart, "Unexpected start of expression", offset );
+
+		return true;
+	}
+
+	void Grammar::onExpressionCondition( CompiledExpressionPtr condition )
+	{
+		expressionResult = true;
+		expressionCondition = std::move( condition );
+	}
+
+	bool Grammar::onExpressionEnd( size_t offset )
+	{
+		return fail( ParseErrorCode::UnexpectedExpressionEnd, "Unexpected expression end ']' token", offset );
+	}
+
+	bool Grammar::finish( size_t lastOffset )
+	{
+		if ( !sections.empty() )
+			return fail( ParseErrorCode::UnterminatedSection, "Expected '}', got EOF instead", sections.back() );
+
+		if ( key.has_value() && !value.has_value() )
+			return fail( ParseErrorCode::UnexpectedSectionEnd, "Unexpected end to section", lastOffset );
+		else if ( key.has_value() && value.has_value() && isActive() )
+			return emitKeyValue( lastOffset );
+
+		return true;
+	}
+
+	bool Grammar::fail( ParseErrorCode code, std::string message, size_t offset )
+	{
+		errors.push_back( SyntaxError{ code, std::move( message ), offset } );
+		failed = true;
+
+		return false;
+	}
+
+	bool Grammar::recover()
+	{
+		if ( !options.recoverFromErrors || errors.empty() )
+			return false;
+
+		// Limits are there to bound the work done on hostile input, carrying on would defeat them
+		const ParseErrorCode code = errors.back().code;
+		if ( code == ParseErrorCode::InputTooLarge || code == ParseErrorCode::TooManyNodes )
+			return false;
+
+		failed = false;
+		resetPending();
+
+		return true;
+	}
+
+	void Grammar::setKey( const std::string_view &str )
+	{
+		if ( copyStrings )
+			key = keyStorage.assign( str.data(), str.size() );
+		else
+			key = str;
+	}
+
+	void Grammar::setValue( const std::string_view &str )
+	{
+		if ( copyStrings )
+			value = valueStorage.assign( str.data(), str.size() );
+		else
+			value = str;
+	}
+
+	void Grammar::resetPending()
+	{
+		key.reset();
+		value.reset();
+		expressionResult.reset();
+		expressionCondition.reset();
+	}
+
+	bool Grammar::emitKeyValue( size_t offset )
+	{
+		if ( !countNode( offset ) )
+			return false;
+
+		passCondition();
+		if ( handler.onKeyValue( key.value(), value.value() ) == ParseHandler::Action::Stop )
+		{
+			stopped = true;
+			return false;
+		}
+
+		return true;
+	}
+
+	bool Grammar::countNode( size_t offset )
+	{
+		if ( ++nodeCount > options.maxNodes )
+			return fail( ParseErrorCode::TooManyNodes, "Document has more than " + std::to_string( options.maxNodes ) + " nodes", offset );
+
+		return true;
+	}
+
+	void Grammar::passCondition()
+	{
+		if ( conditionBuilder && expressionCondition )
+			conditionBuilder->setCondition( expressionCondition );
+	}
+
+	Parser::Parser( const std::string_view &buffer, const ExpressionEngine &expressionEngine, const ParseOptions &options ) :
+		buffer( buffer ),
+		expressionEngine( expressionEngine ),
+		options( options ),
+		scanner( buffer ),
+		lines( buffer )
+	{
+	}
+
+	bool Parser::parse( ParseHandler &handler, std::vector< ParseDiagnostic > &diagnostics )
+	{
+		Grammar grammar( handler, options, false );
+		grammar.continueDocument( baseDepth, baseNodeCount );
+
+		if ( conditionBuilder )
+			grammar.keepConditions( *conditionBuilder );
+
+		if ( buffer.size() > options.maxInputSize )
+			grammar.fail( ParseErrorCode::InputTooLarge, "Input exceeds the maximum size of " + std::to_string( options.maxInputSize ) + " bytes", 0 );
+		else if ( parseTokens( grammar ) )
+			grammar.finish( buffer.size() - 1 );
+
+		for ( const SyntaxError &error : grammar.getErrors() )
+			diagnostics.push_back( MakeDiagnostic( error, lines ) );
+
+		return ( grammar.getErrors().empty() && !grammar.wasStopped() );
+	}
+
+	bool Parser::parseRange( ParseHandler &handler, bool lastRange, size_t &nodeCount )
+	{
+		Grammar grammar( handler, options, false );
+		if ( conditionBuilder )
+			grammar.keepConditions( *conditionBuilder );
+
+		if ( !parseTokens( grammar ) || ( lastRange && !grammar.finish( buffer.size() - 1 ) ) || !grammar.getErrors().empty() )
+			return false;
+
+		nodeCount = grammar.getNodeCount();
+		return ( lastRange || ( !grammar.hasPending() && grammar.getDepth() == 0 && lastSectionEnd == buffer.size() ) );
+	}
+
+	bool Parser::parseTokens( Grammar &grammar )
+	{
+		for ( index = scanner.skipWhiteSpace( 0 ); index < buffer.size(); index = scanner.skipWhiteSpace( index ) )
+		{
+			const Token token = readToken( grammar );
+			bool keepGoing = true;
+
+			switch ( token.type )
+			{
+				case TokenType::String:
+				{
+					keepGoing = grammar.onString( token.str, index );
+					break;
+				}
+				case TokenType::SectionStart:
+				{
+					const ParseHandler::Action action = grammar.onSectionStart( index );
+
+					if ( action == ParseHandler::Action::Stop )
+						keepGoing = false;
+					else if ( action == ParseHandler::Action::SkipSection )
+					{
+						if ( size_t skip = skipSection( index ); skip == std::string::npos )
+							keepGoing = grammar.fail( ParseErrorCode::UnterminatedSection, "Expected '}', got EOF instead", index );
+						else
+						{
+							if ( skipBuilder )
+								skipBuilder->onSectionSkipped( buffer.substr( index, skip - index ) );
+
+							index = skip + 1;
+						}
+					}
+
+					break;
+				}
+				case TokenType::SectionEnd:
+				{
+					keepGoing = grammar.onSectionEnd( index );
+					lastSectionEnd = index;
+					break;
+				}
+				case TokenType::ExpressionStart:
+				{
+					if ( ( keepGoing = grammar.onExpressionStart( index ) ) )
+					{
+						CompiledExpressionPtr condition;
+						const ExpressionEngine::ExpressionResult result = ( grammar.keepsConditions() ) ?
+							expressionEngine.compileCondition( buffer, index - 1, options.maxDepth, condition ) :
+							expressionEngine.evaluateExpression( buffer, index - 1, options.maxDepth );
+
+						if ( !result.error.empty() )
+							keepGoing = grammar.fail( ParseErrorCode::InvalidExpression, result.error, result.end );
+						else
+						{
+							if ( condition )
+								grammar.onExpressionCondition( std::move( condition ) );
+							else
+								grammar.onExpressionResult( result.result );
+
+							index = result.end + 1;
+						}
+					}
+
+					break;
+				}
+				case TokenType::ExpressionEnd:
+				{
+					keepGoing = grammar.onExpressionEnd( index );
+					break;
+				}
+				case TokenType::Error:
+				{
+					keepGoing = false;
+					break;
+				}
+				case TokenType::End:
+					break;
+			}
+
+			if ( !keepGoing )
+			{
+				if ( !grammar.hasFailed() || !grammar.recover() )
+					return false;
+
+				index = resynchronize( index, token.type == TokenType::SectionStart );
+			}
+		}
+
+		return true;
+	}
+
+	Parser::Token Parser::readToken( Grammar &grammar )
+	{
+		// Comments are skipped along with the whitespace following them
+		while ( index < buffer.size() && buffer[ index ] == '/' )
+		{
+			if ( scanner.peekChar( index + 1 ) == '/' )
+				index = scanner.skipWhiteSpace( scanner.skipLineComment( index ) );
+			else if ( scanner.peekChar( index + 1 ) == '*' )
+				index = scanner.skipWhiteSpace( scanner.skipMultiLineComment( index ) );
+			else
+				break;
+		}
+
+		if ( index >= buffer.size() )
+		{
+			index = std::string::npos;
+			return Token{ TokenType::End, std::string_view() };
+		}
+
+		switch ( buffer[ index++ ] )
+		{
+			case '"':
+				return readQuote( index - 1, grammar );
+			case '{':
+				return Token{ TokenType::SectionStart, std::string_view() };
+			case '}':
+				return Token{ TokenType::SectionEnd, std::string_view() };
+			case '[':
+				return Token{ TokenType::ExpressionStart, std::string_view() };
+			case ']':
+				return Token{ TokenType::ExpressionEnd, std::string_view() };
+			default:
+				return Token{ TokenType::String, readUnquoted( index - 1 ) };
+		}
+	}
+
+	Parser::Token Parser::readQuote( size_t start, Grammar &grammar )
+	{
+		size_t end = scanner.findStructural( start + 1 );
+		for ( ; end != std::string::npos; end = scanner.findStructural( end + 1 ) )
+		{
+			const char &c = buffer[ end ];
+			if ( c == '"' )
+				break;
+			else if ( c == '\n' )
+			{
+				grammar.fail( ParseErrorCode::UnterminatedQuote, "Expected '\"' but got EOL instead", end );
+				index = end;
+
+				return Token{ TokenType::Error, std::string_view() };
+			}
+		}
+
+		if ( end == std::string::npos )
+			end = buffer.size();
+
+		index = end + 1;
+		return Token{ TokenType::String, std::string_view( &buffer[ start + 1 ], end - start - 1 ) };
+	}
+
+	std::string_view Parser::readUnquoted( size_t start )
+	{
+		// Unquoted strings end at whitespace, '{', '}', '[', '"' or the start of a comment
+		size_t end = scanner.findTokenEnd( start );
+		for ( ; end != std::string::npos; end = scanner.findTokenEnd( end + 1 ) )
+		{
+			const char &c = buffer[ end ];
+			if ( c == ']' || ( c == '/' && scanner.peekChar( end + 1 ) != '/' && scanner.peekChar( end + 1 ) != '*' ) )
+				continue;
+
+			break;
+		}
+
+		if ( end == std::string::npos )
+			end = buffer.size();
+
+		index = end;
+		return std::string_view( &buffer[ start ], end - start );
+	}
+
+	size_t Parser::skipSection( size_t start )
+	{
+		size_t depth = 0;
+		for ( size_t i = scanner.findStructural( start ); i != std::string::npos; i = scanner.findStructural( i ) )
+		{
+			const char &c = buffer[ i ];
+			if ( c == '"' )
+			{
+				i = scanner.findChar( i + 1, '"' );
+				if ( i != std::string::npos )
+					++i;
+
+				continue;
+			}
+			else if ( c == '/' && scanner.peekChar( i + 1 ) == '/' )
+			{
+				i = scanner.skipLineComment( i );
+				continue;
+			}
+			else if ( c == '/' && scanner.peekChar( i + 1 ) == '*' )
+			{
+				i = scanner.skipMultiLineComment( i );
+				continue;
+			}
+			else if ( c == '{' )
+				++depth;
+			else if ( c == '}' )
+			{
+				if ( depth == 0 )
+					return i;
+
+				--depth;
+			}
+
+			++i;
+		}
+
+		return std::string::npos;
+	}
+
+	size_t Parser::resynchronize( size_t start, bool inSection )
+	{
+		size_t depth = ( inSection ) ? 1 : 0;
+		for ( size_t i = scanner.findStructural( start ); i != std::string::npos; i = scanner.findStructural( i ) )
+		{
+			const char &c = buffer[ i ];
+			if ( c == '"' )
+			{
+				i = scanner.findChar( i + 1, '"' );
+				if ( i != std::string::npos )
+					++i;
+
+				continue;
+			}
+			else if ( c == '/' && scanner.peekChar( i + 1 ) == '/' )
+			{
+				i = scanner.skipLineComment( i );
+				if ( depth == 0 )
+					return i;
+
+				continue;
+			}
+			else if ( c == '/' && scanner.peekChar( i + 1 ) == '*' )
+			{
+				i = scanner.skipMultiLineComment( i );
+				continue;
+			}
+			else if ( c == '\n' && depth == 0 )
+				return i + 1;
+			else if ( c == '{' )
+				++depth;
+			else if ( c == '}' )
+			{
+				if ( depth == 0 )
+					return i;
+
+				if ( --depth == 0 && inSection )
+					return i + 1;
+			}
+
+			++i;
+		}
+
+		return std::string::npos;
+	}
+
+	ChunkParser::ChunkParser( ParseHandler &handler, const ExpressionEngine &expressionEngine, const ParseOptions &options ) :
+		expressionEngine( expressionEngine ),
+		options( options ),
+		grammar( handler, this->options, true )
+	{
+		// Recovering means looking ahead for where to carry on, which a chunk may not have
+		this->options.recoverFromErrors = false;
+	}
+
+	bool ChunkParser::feed( const std::string_view &chunk )
+	{
+		if ( done )
+			return false;
+
+		if ( chunk.size() > options.maxInputSize - current.offset )
+		{
+			grammar.fail( ParseErrorCode::InputTooLarge, "Input exceeds the maximum size of " + std::to_string( options.maxInputSize ) + " bytes", current.offset );
+			recordError();
+			done = true;
+
+			return false;
+		}
+
+		constexpr auto UTF8_MB_CONTINUE = 2;
+
+		for ( const char c : chunk )
+		{
+			const unsigned char byte = static_cast< unsigned char >( c );
+
+			next = current;
+			++next.offset;
+
+			// Same rules as LineIndex
+			if ( c == '\n' )
+			{
+				++next.line;
+				next.column = 0;
+			}
+			else if ( ( byte >> 6 ) != UTF8_MB_CONTINUE && c != '\r' )
+				++next.column;
+
+			if ( !consume( c ) )
+			{
+				if ( grammar.hasFailed() )
+					recordError();
+
+				done = true;
+				return false;
+			}
+
+			previous = current;
+			current = next;
+		}
+
+		return true;
+	}
+
+	bool ChunkParser::finish()
+	{
+		if ( done )
+			return ( diagnostics.empty() && !grammar.wasStopped() );
+
+		done = true;
+		next = current;
+
+		bool keepGoing = true;
+
+		if ( skipping )
+			keepGoing = grammar.fail( ParseErrorCode::UnterminatedSection, "Expected '}', got EOF instead", skipStart.offset );
+		else
+		{
+			switch ( state )
+			{
+				case State::Slash:
+				case State::Unquoted:
+				case State::UnquotedSlash:
+				{
+					if ( state == State::Slash )
+						token.assign( 1, '/' );
+					else if ( state == State::UnquotedSlash )
+						token.push_back( '/' );
+
+					keepGoing = grammar.onString( token, current.offset );
+					break;
+				}
+				case State::Quoted:
+				{
+					// An unterminated quote runs to the end of the input
+					keepGoing = grammar.onString( token, current.offset + 1 );
+					break;
+				}
+				case State::Expression:
+				{
+					keepGoing = evaluateExpression();
+					break;
+				}
+				case State::Default:
+				case State::LineComment:
+				case State::MultiLineComment:
+					break;
+			}
+		}
+
+		if ( keepGoing )
+			grammar.finish( previous.offset );
+
+		if ( grammar.hasFailed() )
+			recordError();
+
+		return ( diagnostics.empty() && !grammar.wasStopped() );
+	}
+
+	bool ChunkParser::consume( char c )
+	{
+		switch ( state )
+		{
+			case State::Default:
+				return ( skipping ) ? consumeSkipped( c ) : consumeDefault( c );
+			case State::Slash:
+			{
+				if ( c == '/' )
+					state = State::LineComment;
+				else if ( c == '*' )
+				{
+					state = State::MultiLineComment;
+					previousStar = false;
+				}
+				else
+				{
+					state = State::Default;
+
+					// A lone '/' starts an unquoted string, and is ignored in skipped sections
+					if ( skipping )
+						return consumeSkipped( c );
+
+					token.assign( 1, '/' );
+					state = State::Unquoted;
+					return consume( c );
+				}
+
+				return true;
+			}
+			case State::Quoted:
+			{
+				if ( c == '"' )
+				{
+					state = State::Default;
+					return ( skipping ) ? true : grammar.onString( token, next.offset );
+				}
+				else if ( skipping )
+					return true;
+				else if ( c == '\n' )
+					return grammar.fail( ParseErrorCode::UnterminatedQuote, "Expected '\"' but got EOL instead", current.offset );
+
+				token.push_back( c );
+				return true;
+			}
+			case State::Unquoted:
+			{
+				// Unquoted strings end at whitespace, '{', '}', '[', '"' or the start of a comment
+				switch ( c )
+				{
+					case ' ':
+					case '\t':
+					case '\r':
+					case '\n':
+					case '{':
+					case '}':
+					case '[':
+					case '"':
+					{
+						if ( !endUnquoted( current.offset ) )
+							return false;
+
+						return consumeDefault( c );
+					}
+					case '/':
+					{
+						state = State::UnquotedSlash;
+						return true;
+					}
+					default:
+					{
+						token.push_back( c );
+						return true;
+					}
+				}
+			}
+			case State::UnquotedSlash:
+			{
+				if ( c == '/' || c == '*' )
+				{
+					if ( !endUnquoted( previous.offset ) )
+						return false;
+
+					state = ( c == '/' ) ? State::LineComment : State::MultiLineComment;
+					previousStar = false;
+					return true;
+				}
+
+				token.push_back( '/' );
+				state = State::Unquoted;
+				return consume( c );
+			}
+			case State::LineComment:
+			{
+				if ( c == '\n' )
+					state = State::Default;
+
+				return true;
+			}
+			case State::MultiLineComment:
+			{
+				if ( c == '/' && previousStar )
+					state = State::Default;
+
+				previousStar = ( c == '*' );
+				return true;
+			}
+			case State::Expression:
+			{
+				expression.push_back( c );
+
+				// Parentheses are counted so a ']' inside them doesn't end the expression early, a newline
+				// always ends it since the expression engine reports those as errors
+				if ( c == '(' )
+					++expressionParens;
+				else if ( c == ')' && expressionParens > 0 )
+					--expressionParens;
+				else if ( c == '\n' || ( c == ']' && expressionParens == 0 ) )
+				{
+					state = State::Default;
+					return evaluateExpression();
+				}
+
+				return true;
+			}
+		}
+
+		return true;
+	}
+
+	bool ChunkParser::consumeDefault( char c )
+	{
+		state = State::Default;
+
+		switch ( c )
+		{
+			case ' ':
+			case '\t':
+			case '\r':
+			case '\n':
+				return true;
+			case '/':
+			{
+				state = State::Slash;
+				return true;
+			}
+			case '"':
+			{
+				token.clear();
+				state = State::Quoted;
+				return true;
+			}
+			case '{':
+			{
+				const ParseHandler::Action action = grammar.onSectionStart( next.offset );
+
+				if ( action == ParseHandler::Action::Stop )
+					return false;
+				else if ( action == ParseHandler::Action::SkipSection )
+				{
+					skipping = true;
+					skipDepth = 0;
+					skipStart = next;
+				}
+				else
+					sections.push_back( next );
+
+				return true;
+			}
+			case '}':
+			{
+				const bool keepGoing = grammar.onSectionEnd( next.offset );
+				sections.resize( grammar.getDepth() );
+
+				return keepGoing;
+			}
+			case '[':
+			{
+				if ( !grammar.onExpressionStart( next.offset ) )
+					return false;
+
+				expression.assign( 1, '[' );
+				expressionStart = current;
+				expressionParens = 0;
+				state = State::Expression;
+
+				return true;
+			}
+			case ']':
+				return grammar.onExpressionEnd( next.offset );
+			default:
+			{
+				token.assign( 1, c );
+				state = State::Unquoted;
+				return true;
+			}
+		}
+	}
+
+	bool ChunkParser::consumeSkipped( char c )
+	{
+		// Skipped sections only look at quotes, comments and braces, like Parser::skipSection
+		switch ( c )
+		{
+			case '"':
+				state = State::Quoted;
+				break;
+			case '/':
+				state = State::Slash;
+				break;
+			case '{':
+				++skipDepth;
+				break;
+			case '}':
+			{
+				if ( skipDepth == 0 )
+					skipping = false;
+				else
+					--skipDepth;
+
+				break;
+			}
+		}
+
+		return true;
+	}
+
+	bool ChunkParser::endUnquoted( size_t offset )
+	{
+		state = State::Default;
+		return grammar.onString( token, offset );
+	}
+
+	bool ChunkParser::evaluateExpression()
+	{
+		const ExpressionEngine::ExpressionResult result = expressionEngine.evaluateExpression( expression, 0, options.maxDepth );
+
+		if ( !result.error.empty() )
+			return grammar.fail( ParseErrorCode::InvalidExpression, result.error, expressionStart.offset + result.end );
+
+		grammar.onExpressionResult( result.result );
+		return true;
+	}
+
+	void ChunkParser::recordError()
+	{
+		const SyntaxError &error = grammar.getErrors().back();
+		const Position position = resolve( error.offset );
+
+		diagnostics.push_back( ParseDiagnostic{ error.code, error.offset, position.line, position.column, error.message } );
+	}
+
+	ChunkParser::Position ChunkParser::resolve( size_t offset ) const
+	{
+		for ( auto it = sections.rbegin(); it != sections.rend(); ++it )
+		{
+			if ( it->offset == offset )
+				return *it;
+		}
+
+		for ( const Position *position : { &current, &next, &previous, &skipStart } )
+		{
+			if ( position->offset == offset )
+				return *position;
+		}
+
+		// Expression errors point inside the expression, which never spans lines
+		if ( offset >= expressionStart.offset && offset - expressionStart.offset < expression.size() )
+			return Position{ offset, expressionStart.line, expressionStart.column + LineIndex( expression ).getColumn( offset - expressionStart.offset ) };
+
+		return current;
+	}
+}
@@ -0,0 +1,301 @@
+#pragma once
+
+#include "keyvalues.hpp"
+#include "scanner.hpp"
+
+#include <string_view>
+#include <string>
+#include <optional>
+#include <vector>
+#include <memory>
+#include <unordered_set>
+
+namespace KV
+{
+	// Cuts the buffer after top level '}'s into ranges of at least 'minRangeSize' bytes, returning the end of every
+	// range. Braces are matched like Parser::skipSection does, also stepping over bracketed expressions. The cuts
+	// are only a guess, Parser::parseRange checks each range really ends at the close of a top level section.
+	std::vector< size_t > SplitTopLevelSections( const std::string_view &buffer, size_t minRangeSize );
+
+	// Syntax error at a byte offset into the input, turned into a ParseDiagnostic by whoever knows
+	// how to map offsets back to lines and columns
+	struct SyntaxError
+	{
+		ParseErrorCode code;
+		std::string message;
+		size_t offset;
+	};
+
+	inline ParseDiagnostic MakeDiagnostic( const SyntaxError &error, const LineIndex &lines )
+	{
+		return ParseDiagnostic{ error.code, error.offset, lines.getLine( error.offset ), lines.getColumn( error.offset ), error.message };
+	}
+
+	using CompiledExpressionPtr = std::shared_ptr< const CompiledExpression >;
+
+	// Builds a KeyValues tree out of parse events
+	class TreeBuilder : public ParseHandler
+	{
+	public:
+		// With 'lazy' set sections are skipped and left for KeyValues::expand, see ParseOptions::lazySections
+		TreeBuilder( KeyValues &root, bool zeroCopy, bool lazy = false ) : zeroCopy( zeroCopy ), lazy( lazy ) { sections.push_back( &root ); }
+
+		Action onSectionBegin( const std::string_view &key ) override;
+		Action onKeyValue( const std::string_view &key, const std::string_view &value ) override;
+		Action onSectionEnd() override;
+
+		// Attaches 'condition' to the node created by the next event. The builder keeps every distinct
+		// condition alive until they're taken over by the document.
+		void setCondition( const CompiledExpressionPtr &condition );
+		std::vector< CompiledExpressionPtr > &getConditions() { return conditions; }
+
+		// Called by the parser with the contents of every section it skipped, 'body' runs from after the '{' up to the '}'
+		void onSectionSkipped( const std::string_view &body );
+
+	private:
+		KeyValues &attachCondition( KeyValues &kv );
+
+		bool zeroCopy;
+		bool lazy;
+		std::vector< KeyValues* > sections;
+		KeyValues *skippedSection = nullptr; // Lazy section waiting for its contents
+
+		const CompiledExpression *pendingCondition = nullptr;
+		std::vector< CompiledExpressionPtr > conditions;
+		std::unordered_set< const CompiledExpression* > knownConditions;
+	};
+
+	// Turns tokens into ParseHandler events: pairs strings up into keys and values, applies conditionals
+	// and tracks open sections. Shared by Parser and ChunkParser, which only differ in how they find tokens.
+	// Every method takes the offset the token ends at for error reporting. Errors are recorded rather than
+	// thrown, validating lots of broken files shouldn't cost an unwind per error.
+	class Grammar
+	{
+	public:
+		// With copyStrings set pending keys and values are copied, for tokenizers whose strings don't outlive the call
+		Grammar( ParseHandler &handler, const ParseOptions &options, bool copyStrings );
+
+		// These return false once parsing has to end, because the handler stopped it, a stray '}' ended the document
+		// or there was an error
+		bool onString( const std::string_view &str, size_t offset );
+		bool onSectionEnd( size_t offset );
+
+		// Continue if the section was entered, SkipSection if the tokenizer has to skip past the matching '}'
+		// and Stop if parsing has to end
+		ParseHandler::Action onSectionStart( size_t offset );
+
+		// The tokenizer evaluates the expression itself between these two, or only compiles it when keeping conditions
+		bool onExpressionStart( size_t offset );
+		void onExpressionResult( bool result ) { expressionResult = result; }
+		void onExpressionCondition( CompiledExpressionPtr condition );
+
+		// Nodes carrying a conditional are all emitted, 'builder' gets their conditions instead
+		void keepConditions( TreeBuilder &builder ) { conditionBuilder = &builder; }
+		bool keepsConditions() const { return ( conditionBuilder != nullptr ); }
+
+		bool onExpressionEnd( size_t offset ); // Always an error
+
+		// 'lastOffset' is the offset of the last byte of the input
+		bool finish( size_t lastOffset );
+
+		// Records an error found by the tokenizer, returns false
+		bool fail( ParseErrorCode code, std::string message, size_t offset );
+
+		// Called after an error when recovering, drops whatever was pending so the tokenizer can carry on from
+		// where it resynchronized. Returns false if the parse has to end instead.
+		bool recover();
+
+		// See Parser::continueDocument
+		void continueDocument( size_t depth, size_t nodes ) { baseDepth = depth; nodeCount = nodes; }
+
+		bool wasStopped() const { return stopped; }
+		bool hasFailed() const { return failed; }
+		bool hasPending() const { return key.has_value(); }
+		size_t getDepth() const { return sections.size(); }
+		size_t getNodeCount() const { return nodeCount; }
+		const std::vector< SyntaxError > &getErrors() const { return errors; }
+
+	private:
+		bool isActive() const { return ( !expressionResult.has_value() || expressionResult.value() ); }
+		void setKey( const std::string_view &str );
+		void setValue( const std::string_view &str );
+		void resetPending();
+
+		// Return false if the handler asked us to stop or there was an error
+		bool emitKeyValue( size_t offset );
+		bool countNode( size_t offset );
+		void passCondition();
+
+		ParseHandler &handler;
+		const ParseOptions &options;
+		bool copyStrings;
+		bool stopped = false;
+		bool failed = false;
+		size_t baseDepth = 0;
+		size_t nodeCount = 0;
+		std::vector< SyntaxError > errors;
+
+		std::optional< std::string_view > key;
+		std::optional< std::string_view > value;
+		std::optional< bool > expressionResult;
+		CompiledExpressionPtr expressionCondition;
+		TreeBuilder *conditionBuilder = nullptr;
+		std::string keyStorage;
+		std::string valueStorage;
+
+		// Offsets just past the opening '{' of every open section
+		std::vector< size_t > sections;
+	};
+
+	// Text parser, raises events on a ParseHandler. Sections are tracked on an explicit stack rather
+	// than through recursion, so nesting depth is bound by ParseOptions::maxDepth and not by the size
+	// of the call stack.
+	class Parser
+	{
+	public:
+		Parser( const std::string_view &buffer, const ExpressionEngine &expressionEngine, const ParseOptions &options );
+
+		// Syntax errors and exceeded limits are appended to 'diagnostics'. Returns false if there were any, or if
+		// the handler stopped the parse.
+		bool parse( ParseHandler &handler, std::vector< ParseDiagnostic > &diagnostics );
+
+		// Parses a range of a larger document cut by SplitTopLevelSections. Returns false if the range has errors,
+		// or if it isn't the last range and doesn't end right after a top level section, in which case the caller
+		// parses the whole document with parse() instead.
+		bool parseRange( ParseHandler &handler, bool lastRange, size_t &nodeCount );
+
+		// Shared with error reporting, so the line index is built at most once per parse
+		const LineIndex &getLineIndex() const { return lines; }
+
+		// See Grammar::keepConditions
+		void keepConditions( TreeBuilder &builder ) { conditionBuilder = &builder; }
+
+		// Hands the contents of every skipped section to 'builder', for lazy sections
+		void reportSkippedSections( TreeBuilder &builder ) { skipBuilder = &builder; }
+
+		// For the body of a lazy section 'depth' sections deep, in a document that already has 'nodeCount' nodes. The
+		// limits then apply to the whole document rather than to the section.
+		void continueDocument( size_t depth, size_t nodeCount ) { baseDepth = depth; baseNodeCount = nodeCount; }
+
+	private:
+		enum class TokenType
+		{
+			String,
+			SectionStart,
+			SectionEnd,
+			ExpressionStart,
+			ExpressionEnd,
+			Error, // Already recorded on the grammar
+			End
+		};
+
+		struct Token
+		{
+			TokenType type;
+			std::string_view str;
+		};
+
+		// Reads the token at 'index' and moves 'index' past it
+		Token readToken( Grammar &grammar );
+		Token readQuote( size_t start, Grammar &grammar );
+		std::string_view readUnquoted( size_t start );
+
+		// Returns the offset of the '}' closing the section whose body starts at 'start'
+		size_t skipSection( size_t start );
+
+		// Where to carry on after an error: past the end of the line, or right before a '}' closing the current section.
+		// Sections opened on the way are skipped whole. With 'inSection' set 'start' is inside a section the error
+		// was at the start of, which is skipped instead.
+		size_t resynchronize( size_t start, bool inSection );
+
+		bool parseTokens( Grammar &grammar );
+
+		std::string_view buffer;
+		const ExpressionEngine &expressionEngine;
+		const ParseOptions &options;
+
+		StructuralIndex scanner;
+		LineIndex lines;
+		TreeBuilder *conditionBuilder = nullptr;
+		TreeBuilder *skipBuilder = nullptr;
+		size_t index = 0;
+		size_t lastSectionEnd = 0; // Offset after the last '}' closing a section
+		size_t baseDepth = 0;
+		size_t baseNodeCount = 0;
+	};
+
+	// Resumable parser behind StreamParser. Input is tokenized a byte at a time by a state machine, so a chunk
+	// can end anywhere: inside a quoted string, a comment, a bracketed expression or a skipped section. Only
+	// the token or expression being read is buffered, never the input as a whole. Lines and columns are
+	// tracked as the input goes by since there is no buffer to resolve them against later.
+	class ChunkParser
+	{
+	public:
+		ChunkParser( ParseHandler &handler, const ExpressionEngine &expressionEngine, const ParseOptions &options );
+
+		// Both return false once there was an error, the handler stopped the parse or a stray '}' ended the document
+		bool feed( const std::string_view &chunk );
+		bool finish();
+
+		const std::vector< ParseDiagnostic > &getDiagnostics() const { return diagnostics; }
+
+	private:
+		enum class State
+		{
+			Default,
+			Slash, // Seen a '/' which may start a comment
+			Quoted,
+			Unquoted,
+			UnquotedSlash, // Seen a '/' inside an unquoted string which may start a comment
+			LineComment,
+			MultiLineComment,
+			Expression
+		};
+
+		struct Position
+		{
+			size_t offset;
+			size_t line;
+			size_t column;
+		};
+
+		// Returns false if parsing has to end
+		bool consume( char c );
+		bool consumeDefault( char c );
+		bool consumeSkipped( char c );
+		bool endUnquoted( size_t offset );
+		bool evaluateExpression();
+
+		// Records the grammar's last error, resolving its position while the input around it is still known
+		void recordError();
+		Position resolve( size_t offset ) const;
+
+		ExpressionEngine expressionEngine;
+		ParseOptions options;
+		Grammar grammar;
+
+		State state = State::Default;
+		bool done = false;
+		bool previousStar = false; // Inside multi-line comments
+		size_t expressionParens = 0;
+
+		std::string token;
+		std::string expression;
+		Position expressionStart = { 0, 1, 0 };
+
+		// Sections skipped because of a false conditional or the handler, at most one at a time
+		bool skipping = false;
+		size_t skipDepth = 0;
+		Position skipStart = { 0, 1, 0 };
+
+		// Position of the byte being consumed, of the one after it and of the one before it
+		Position current = { 0, 1, 0 };
+		Position next = { 0, 1, 0 };
+		Position previous = { 0, 1, 0 };
+
+		// Start of every open section, so errors at EOF can point at them
+		std::vector< Position > sections;
+
+		std::vector< ParseDiagnostic > diagnostics;
+	};
+}
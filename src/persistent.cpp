@@ -0,0 +1,423 @@
+#include "persistent.hpp"
+#include "snapshot.hpp"
+
+#include <algorithm>
+#include <numeric>
+#include <utility>
+
+namespace KV
+{
+	namespace
+	{
+		// Orders positions in a child index by the key of the child they point to
+		struct ChildKeyLess
+		{
+			const std::vector< PersistentView::NodePtr > &children;
+
+			bool operator()( uint32_t position, const std::string_view &name ) const { return ( children[ position ]->key < name ); }
+			bool operator()( const std::string_view &name, uint32_t position ) const { return ( name < children[ position ]->key ); }
+		};
+
+		// Shared by every empty document
+		const PersistentView::NodePtr &GetEmptyRoot()
+		{
+			static const PersistentView::NodePtr emptyRoot = []()
+			{
+				auto root = std::make_shared< PersistentNode >();
+				root->computeHash();
+
+				return root;
+			}();
+
+			return emptyRoot;
+		}
+	}
+
+	void PersistentNode::buildIndex()
+	{
+		childIndex.clear();
+
+		if ( children.size() <= cIndexThreshold )
+			return;
+
+		childIndex.resize( children.size() );
+		std::iota( childIndex.begin(), childIndex.end(), 0 );
+
+		std::stable_sort( childIndex.begin(), childIndex.end(), [ this ]( uint32_t a, uint32_t b )
+		{
+			return ( children[ a ]->key < children[ b ]->key );
+		} );
+	}
+
+	void PersistentNode::appendChild( PersistentView::NodePtr child )
+	{
+		children.push_back( std::move( child ) );
+
+		if ( children.size() == cIndexThreshold + 1 )
+		{
+			buildIndex();
+			return;
+		}
+
+		if ( childIndex.empty() )
+			return;
+
+		// After every other child of the same name, it's the last of them
+		const uint32_t position = static_cast< uint32_t >( children.size() - 1 );
+		childIndex.insert( std::upper_bound( childIndex.begin(), childIndex.end(), children.back()->key, ChildKeyLess{ children } ), position );
+	}
+
+	void PersistentNode::eraseChild( size_t position )
+	{
+		if ( children.size() - 1 <= cIndexThreshold )
+			childIndex.clear();
+		else
+		{
+			// Looked up among the children of its name before it's erased, those after it then move down by one
+			const auto first = std::lower_bound( childIndex.begin(), childIndex.end(), std::string_view( children[ position ]->key ), ChildKeyLess{ children } );
+			childIndex.erase( std::find( first, childIndex.end(), static_cast< uint32_t >( position ) ) );
+
+			for ( uint32_t &entry : childIndex )
+			{
+				if ( entry > position )
+					--entry;
+			}
+		}
+
+		children.erase( children.begin() + position );
+	}
+
+	void PersistentNode::computeHash()
+	{
+		if ( hasValue )
+		{
+			hash = HashValue( value );
+			return;
+		}
+
+		hash = cSectionHash;
+		for ( const PersistentView::NodePtr &child : children )
+			hash = HashChild( hash, child->key, child->hash );
+	}
+
+	size_t PersistentNode::find( const std::string_view &name, size_t index ) const
+	{
+		if ( childIndex.empty() )
+		{
+			for ( size_t position = 0; position < children.size(); ++position )
+			{
+				if ( children[ position ]->key == name && index-- == 0 )
+					return position;
+			}
+
+			return std::string::npos;
+		}
+
+		const auto [ first, last ] = std::equal_range( childIndex.begin(), childIndex.end(), name, ChildKeyLess{ children } );
+		return ( index < static_cast< size_t >( last - first ) ) ? first[ index ] : std::string::npos;
+	}
+
+	size_t PersistentNode::count( const std::string_view &name ) const
+	{
+		if ( childIndex.empty() )
+			return std::count_if( children.begin(), children.end(), [ &name ]( const PersistentView::NodePtr &child ) { return child->key == name; } );
+
+		const auto [ first, last ] = std::equal_range( childIndex.begin(), childIndex.end(), name, ChildKeyLess{ children } );
+		return static_cast< size_t >( last - first );
+	}
+
+	bool PersistentView::isSection() const
+	{
+		return ( node && !node->hasValue );
+	}
+
+	size_t PersistentView::getChildCount() const
+	{
+		return ( node ) ? node->children.size() : 0;
+	}
+
+	std::string_view PersistentView::getKey() const
+	{
+		return ( node ) ? std::string_view( node->key ) : std::string_view();
+	}
+
+	std::string_view PersistentView::getValue( const std::string_view &defaultVal /*= std::string_view()*/ ) const
+	{
+		return ( node && node->hasValue ) ? std::string_view( node->value ) : defaultVal;
+	}
+
+	uint64_t PersistentView::getContentHash() const
+	{
+		return ( node ) ? node->hash : 0;
+	}
+
+	bool PersistentView::operator==( const PersistentView &other ) const
+	{
+		if ( !node || !other.node )
+			return ( node == other.node );
+
+		if ( node->key != other.node->key )
+			return false;
+
+		// Pairs of nodes whose keys are known to match
+		std::vector< std::pair< const PersistentNode*, const PersistentNode* > > pending = { { node, other.node } };
+
+		while ( !pending.empty() )
+		{
+			const auto [ a, b ] = pending.back();
+			pending.pop_back();
+
+			if ( a == b )
+				continue;
+
+			if ( a->hash != b->hash || a->hasValue != b->hasValue || a->children.size() != b->children.size() )
+				return false;
+
+			if ( a->hasValue )
+			{
+				if ( a->value != b->value )
+					return false;
+
+				continue;
+			}
+
+			for ( size_t i = 0; i < a->children.size(); ++i )
+			{
+				if ( a->children[ i ]->key != b->children[ i ]->key )
+					return false;
+
+				pending.emplace_back( a->children[ i ].get(), b->children[ i ].get() );
+			}
+		}
+
+		return true;
+	}
+
+	PersistentView PersistentView::get( const std::string_view &name, size_t index /*= 0*/ ) const
+	{
+		if ( !node )
+			return PersistentView();
+
+		const size_t position = node->find( name, index );
+		return ( position != std::string::npos ) ? PersistentView( node->children[ position ].get() ) : PersistentView();
+	}
+
+	size_t PersistentView::getCount( const std::string_view &name ) const
+	{
+		return ( node ) ? node->count( name ) : 0;
+	}
+
+	std::string_view PersistentView::getKeyValue( const std::string_view &keyName, const std::string_view &defaultVal /*= std::string_view()*/ ) const
+	{
+		return get( keyName ).getValue( defaultVal );
+	}
+
+	PersistentView::const_iterator PersistentView::begin() const
+	{
+		return const_iterator( ( node ) ? node->children.data() : nullptr );
+	}
+
+	PersistentView::const_iterator PersistentView::end() const
+	{
+		return const_iterator( ( node ) ? node->children.data() + node->children.size() : nullptr );
+	}
+
+	PersistentDocument::PersistentDocument() :
+		root( GetEmptyRoot() )
+	{
+	}
+
+	PersistentDocument::PersistentDocument( const KeyValues &kv )
+	{
+		auto document = std::make_shared< PersistentNode >();
+
+		// Nodes are only shared once they're complete, until then they're filled in off a worklist
+		std::vector< std::pair< const KeyValues*, PersistentNode* > > pending = { { &kv, document.get() } };
+
+		// Every section in the order it was filled in, so going through it backwards hashes children before their parents
+		std::vector< PersistentNode* > sections;
+
+		while ( !pending.empty() )
+		{
+			const auto [ from, to ] = pending.back();
+			pending.pop_back();
+
+			for ( const KeyValues &child : *from )
+			{
+				auto node = std::make_shared< PersistentNode >();
+				node->key = child.getKeyView();
+
+				if ( child.isSection() )
+					pending.emplace_back( &child, node.get() );
+				else
+				{
+					node->value = child.getValue();
+					node->hasValue = true;
+					node->computeHash();
+				}
+
+				to->children.push_back( std::move( node ) );
+			}
+
+			to->buildIndex();
+			sections.push_back( to );
+		}
+
+		for ( auto it = sections.rbegin(); it != sections.rend(); ++it )
+			( *it )->computeHash();
+
+		root = std::move( document );
+	}
+
+	KeyValues PersistentDocument::toKeyValues( const ParseOptions &options /*= ParseOptions()*/ ) const
+	{
+		KeyValues document = ( options.useArena ) ? KeyValues( std::make_unique< KeyValues::Arena >( options.arenaBlockSize ) ) : KeyValues();
+		document.cacheNumbers = options.cacheNumericValues;
+
+		if ( options.zeroCopy )
+			document.source = root;
+
+		// A section's children are all created before any of them is visited, so their order is kept
+		std::vector< std::pair< const PersistentNode*, KeyValues* > > pending = { { root.get(), &document } };
+
+		while ( !pending.empty() )
+		{
+			const auto [ from, to ] = pending.back();
+			pending.pop_back();
+
+			for ( const NodePtr &node : from->children )
+			{
+				if ( node->hasValue )
+				{
+					if ( options.zeroCopy )
+						to->createBorrowedKeyValue( node->key, node->value );
+					else
+						to->createKeyValue( node->key, node->value );
+				}
+				else
+					pending.emplace_back( node.get(), &( ( options.zeroCopy ) ? to->createBorrowedKey( node->key ) : to->createKey( node->key ) ) );
+			}
+		}
+
+		return document;
+	}
+
+	bool PersistentDocument::set( const KeyPath &path, const std::string_view &value )
+	{
+		return edit( path, true, [ &value ]( const std::string_view &key )
+		{
+			auto node = std::make_shared< PersistentNode >();
+			node->key = key;
+			node->value = value;
+			node->hasValue = true;
+			node->computeHash();
+
+			return node;
+		} );
+	}
+
+	bool PersistentDocument::set( const KeyPath &path, const PersistentDocument &section )
+	{
+		// Read before this document's root is replaced, 'section' may be this document
+		const NodePtr contents = std::atomic_load( &section.root );
+
+		return edit( path, true, [ &contents ]( const std::string_view &key )
+		{
+			auto node = std::make_shared< PersistentNode >();
+			node->key = key;
+			node->children = contents->children;
+			node->childIndex = contents->childIndex;
+			node->hash = contents->hash;
+
+			return node;
+		} );
+	}
+
+	bool PersistentDocument::remove( const KeyPath &path )
+	{
+		return edit( path, false, []( const std::string_view& ) { return std::shared_ptr< PersistentNode >(); } );
+	}
+
+	template< typename MakeNode >
+	bool PersistentDocument::edit( const KeyPath &path, bool create, MakeNode &&makeNode )
+	{
+		const std::vector< KeyPath::Segment > &segments = path.getSegments();
+
+		// Every section on the way down along with the position of the next node in it, npos where it has to be created
+		std::vector< std::pair< const PersistentNode*, size_t > > steps;
+		steps.reserve( segments.size() );
+
+		// The version the edit starts from, other threads may be copying it
+		const NodePtr current = std::atomic_load( &root );
+		const PersistentNode *node = current.get();
+		size_t missing = segments.size();
+
+		for ( size_t i = 0; i < segments.size(); ++i )
+		{
+			const KeyPath::Segment &segment = segments[ i ];
+			if ( segment.anyName || segment.index == KeyPath::Segment::cEveryIndex )
+				return false;
+
+			const std::string_view name = path.getName( segment );
+			const size_t position = node->find( name, segment.index );
+
+			if ( position != std::string::npos )
+			{
+				steps.emplace_back( node, position );
+				node = node->children[ position ].get();
+
+				continue;
+			}
+
+			// Only the next duplicate of a key can be created, and only in a section
+			if ( !create || node->hasValue || node->count( name ) != segment.index )
+				return false;
+
+			// Whatever follows goes in new sections, where every key is the first of its name
+			for ( size_t j = i + 1; j < segments.size(); ++j )
+			{
+				if ( segments[ j ].anyName || segments[ j ].index != 0 )
+					return false;
+			}
+
+			steps.emplace_back( node, std::string::npos );
+			missing = i;
+
+			break;
+		}
+
+		NodePtr replacement = makeNode( ( missing == segments.size() ) ? std::string_view( node->key ) : path.getName( segments.back() ) );
+
+		for ( size_t i = segments.size() - 1; i > missing; --i )
+		{
+			auto section = std::make_shared< PersistentNode >();
+			section->key = path.getName( segments[ i - 1 ] );
+			section->children.push_back( std::move( replacement ) );
+			section->computeHash();
+
+			replacement = std::move( section );
+		}
+
+		// Copied bottom up, each copy shares every child but the one on the path
+		for ( size_t i = steps.size(); i-- > 0; )
+		{
+			const auto [ parent, position ] = steps[ i ];
+			auto copy = std::make_shared< PersistentNode >( *parent );
+
+			// Replacing a child keeps its key, and so the index
+			if ( position == std::string::npos )
+				copy->appendChild( std::move( replacement ) );
+			else if ( !replacement )
+				copy->eraseChild( position );
+			else
+				copy->children[ position ] = std::move( replacement );
+
+			copy->computeHash();
+			replacement = std::move( copy );
+		}
+
+		// Published in one step, readers copying the document see either version whole
+		std::atomic_store( &root, std::move( replacement ) );
+		return true;
+	}
+}
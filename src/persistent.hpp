@@ -0,0 +1,41 @@
+#pragma once
+
+#include "keyvalues.hpp"
+
+#include <string_view>
+#include <string>
+#include <vector>
+#include <cstdint>
+
+namespace KV
+{
+	// Node of a PersistentDocument, never changed once a document holds it
+	struct PersistentNode
+	{
+		// Sections with more children than this are indexed, smaller ones are searched linearly
+		constexpr static const size_t cIndexThreshold = 16;
+
+		std::string key;
+		std::string value;
+		bool hasValue = false;
+
+		std::vector< PersistentView::NodePtr > children;
+		std::vector< uint32_t > childIndex; // Positions of the children sorted by key, and by position among equal keys
+
+		uint64_t hash = 0; // See KeyValues::getContentHash
+
+		// Call once the children are set
+		void buildIndex();
+
+		// Update the index in place, without sorting the children again
+		void appendChild( PersistentView::NodePtr child );
+		void eraseChild( size_t position );
+
+		// Call once the value or the children are set
+		void computeHash();
+
+		// Returns the position of the index-th child named 'name', std::string::npos if there's none
+		size_t find( const std::string_view &name, size_t index ) const;
+		size_t count( const std::string_view &name ) const;
+	};
+}
@@ -0,0 +1,475 @@
+#include "reload.hpp"
+
+#include <algorithm>
+#include <climits>
+
+#ifdef __linux__
+#include <sys/inotify.h>
+#include <sys/eventfd.h>
+#include <poll.h>
+#include <unistd.h>
+#endif
+
+namespace KV
+{
+	namespace
+	{
+		// Readers of every handle share one epoch. A reader records the epoch it entered in its thread's slot before loading
+		// a version, and a version replaced in epoch N can be freed once no slot holds an epoch below N. Every access is
+		// sequentially consistent, a reader's slot store has to be ordered before its load of the current version.
+		std::atomic< uint64_t > globalEpoch{ 1 };
+
+		struct ReaderSlot
+		{
+			std::atomic< uint64_t > epoch{ 0 }; // 0 while its thread isn't reading
+			std::atomic< bool > taken{ true };
+			ReaderSlot *next = nullptr;
+		};
+
+		// Slots are never freed, threads that exit leave theirs to the next thread that starts reading
+		std::atomic< ReaderSlot* > readerSlots{ nullptr };
+
+		ReaderSlot *AcquireSlot()
+		{
+			for ( ReaderSlot *slot = readerSlots.load(); slot; slot = slot->next )
+			{
+				bool taken = false;
+				if ( !slot->taken.load() && slot->taken.compare_exchange_strong( taken, true ) )
+					return slot;
+			}
+
+			ReaderSlot *slot = new ReaderSlot;
+			slot->next = readerSlots.load();
+			while ( !readerSlots.compare_exchange_weak( slot->next, slot ) ) {}
+
+			return slot;
+		}
+
+		struct ThreadReader
+		{
+			~ThreadReader()
+			{
+				if ( slot )
+					slot->taken.store( false );
+			}
+
+			ReaderSlot *slot = nullptr;
+			size_t depth = 0; // Guards held by the thread, only the outermost one records an epoch
+		};
+
+		thread_local ThreadReader threadReader;
+
+		void EnterRead()
+		{
+			ThreadReader &reader = threadReader;
+			if ( !reader.slot )
+				reader.slot = AcquireSlot();
+
+			if ( reader.depth++ == 0 )
+				reader.slot->epoch.store( globalEpoch.load() );
+		}
+
+		void LeaveRead()
+		{
+			ThreadReader &reader = threadReader;
+			if ( --reader.depth == 0 )
+				reader.slot->epoch.store( 0 );
+		}
+
+		// Readers entering from here on can't see what was replaced before, returns the epoch they enter in
+		uint64_t AdvanceEpoch()
+		{
+			return globalEpoch.fetch_add( 1 ) + 1;
+		}
+
+		// Published versions have to stay as they were parsed while readers hold them, and be readable from any thread
+		ParseOptions GetReloadOptions( ParseOptions options )
+		{
+			// Zero copy documents would view the mapping of a file that's about to be rewritten
+			options.zeroCopy = false;
+
+			// Errors in lazy sections would only be found after publishing, and parsing them on read races between readers
+			options.lazySections = false;
+
+			// Typed reads would store the numbers they parse in nodes that other threads are reading
+			options.cacheNumericValues = false;
+
+			// Hashed up front, getContentHash would otherwise store the hashes on first use
+			options.hashContents = true;
+
+			return options;
+		}
+
+		uint64_t OldestReader()
+		{
+			uint64_t oldest = UINT64_MAX;
+			for ( const ReaderSlot *slot = readerSlots.load(); slot; slot = slot->next )
+			{
+				const uint64_t epoch = slot->epoch.load();
+				if ( epoch != 0 )
+					oldest = std::min( oldest, epoch );
+			}
+
+			return oldest;
+		}
+	}
+
+	struct DocumentHandle::Version
+	{
+		KeyValues document;
+		uint64_t retiredEpoch = 0;
+	};
+
+	DocumentHandle::ReadGuard::~ReadGuard()
+	{
+		if ( document )
+			LeaveRead();
+	}
+
+	DocumentHandle::DocumentHandle() : DocumentHandle( KeyValues() )
+	{
+	}
+
+	DocumentHandle::DocumentHandle( KeyValues document ) :
+		current( new Version{ std::move( document ) } )
+	{
+	}
+
+	DocumentHandle::~DocumentHandle()
+	{
+		delete current.load();
+
+		for ( Version *previous : retired )
+			delete previous;
+	}
+
+	DocumentHandle::ReadGuard DocumentHandle::read() const
+	{
+		EnterRead();
+		return ReadGuard( &current.load()->document );
+	}
+
+	void DocumentHandle::publish( KeyValues document )
+	{
+		auto next = std::make_unique< Version >( Version{ std::move( document ) } );
+
+		std::lock_guard< std::mutex > lock( publishMutex );
+		retired.reserve( retired.size() + 1 );
+
+		Version *previous = current.exchange( next.release() );
+		previous->retiredEpoch = AdvanceEpoch();
+		retired.push_back( previous );
+		version.fetch_add( 1 );
+
+		reclaimLocked();
+	}
+
+	size_t DocumentHandle::reclaim()
+	{
+		std::lock_guard< std::mutex > lock( publishMutex );
+		return reclaimLocked();
+	}
+
+	size_t DocumentHandle::reclaimLocked()
+	{
+		if ( retired.empty() )
+			return 0;
+
+		const uint64_t oldest = OldestReader();
+		auto unused = std::partition( retired.begin(), retired.end(), [ oldest ]( const Version *previous ) { return ( previous->retiredEpoch > oldest ); } );
+
+		for ( auto it = unused; it != retired.end(); ++it )
+			delete *it;
+
+		retired.erase( unused, retired.end() );
+		return retired.size();
+	}
+
+	ReloadWatcher::ReloadWatcher( const ExpressionEngine &expressionEngine, const ParseOptions &options, std::chrono::milliseconds pollInterval ) :
+		expressionEngine( expressionEngine ),
+		options( GetReloadOptions( options ) ),
+		pollInterval( pollInterval )
+	{
+#ifdef __linux__
+		// Without inotify changes are only noticed by polling
+		inotifyDescriptor = inotify_init1( IN_NONBLOCK | IN_CLOEXEC );
+		if ( inotifyDescriptor != -1 )
+		{
+			wakeDescriptor = eventfd( 0, EFD_NONBLOCK | EFD_CLOEXEC );
+			if ( wakeDescriptor == -1 )
+			{
+				close( inotifyDescriptor );
+				inotifyDescriptor = -1;
+			}
+		}
+#endif
+
+		try
+		{
+			thread = std::thread( &ReloadWatcher::run, this );
+		}
+		catch ( ... )
+		{
+#ifdef __linux__
+			if ( inotifyDescriptor != -1 )
+			{
+				close( inotifyDescriptor );
+				close( wakeDescriptor );
+			}
+#endif
+			throw;
+		}
+	}
+
+	ReloadWatcher::~ReloadWatcher()
+	{
+		stop();
+		thread.join();
+
+#ifdef __linux__
+		if ( inotifyDescriptor != -1 )
+		{
+			close( inotifyDescriptor );
+			close( wakeDescriptor );
+		}
+#endif
+	}
+
+	const DocumentHandle &ReloadWatcher::watch( const std::string &path )
+	{
+		std::vector< ParseDiagnostic > diagnostics;
+		ReloadManager::ReloadCallback reloadCallback;
+		const DocumentHandle *handle;
+
+		{
+			std::lock_guard< std::mutex > lock( filesMutex );
+
+			for ( const std::unique_ptr< WatchedFile > &file : files )
+			{
+				if ( file->path == path )
+					return file->handle;
+			}
+
+			auto file = std::make_unique< WatchedFile >();
+			file->path = path;
+			file->name = std::filesystem::path( path ).filename().string();
+
+			// Watched before it's read so no change in between is missed
+			watchDirectory( *file );
+			file->stamp = StampFile( path );
+			reload( *file, diagnostics );
+
+			handle = &file->handle;
+			files.push_back( std::move( file ) );
+			reloadCallback = callback;
+		}
+
+		if ( reloadCallback )
+			reloadCallback( path, diagnostics );
+
+		return *handle;
+	}
+
+	void ReloadWatcher::setReloadCallback( ReloadManager::ReloadCallback reloadCallback )
+	{
+		std::lock_guard< std::mutex > lock( filesMutex );
+		callback = std::move( reloadCallback );
+	}
+
+	size_t ReloadWatcher::checkNow()
+	{
+		std::vector< std::pair< std::string, std::vector< ParseDiagnostic > > > reloaded;
+		ReloadManager::ReloadCallback reloadCallback;
+		size_t published = 0;
+
+		// Events for the changes reloaded here would otherwise have the background thread reload the files again
+		readEvents();
+
+		{
+			std::lock_guard< std::mutex > lock( filesMutex );
+
+			for ( const std::unique_ptr< WatchedFile > &file : files )
+			{
+				// Stamped before parsing, a change made during the parse is picked up by the next check
+				const FileStamp stamp = StampFile( file->path );
+				if ( stamp != file->stamp || file->changed )
+				{
+					file->stamp = stamp;
+					file->changed = false;
+
+					std::vector< ParseDiagnostic > diagnostics;
+					if ( reload( *file, diagnostics ) )
+						++published;
+
+					if ( callback )
+						reloaded.emplace_back( file->path, std::move( diagnostics ) );
+				}
+
+				file->handle.reclaim();
+			}
+
+			reloadCallback = callback;
+		}
+
+		// Called without the lock so the callback can watch other files
+		for ( const auto &[ path, diagnostics ] : reloaded )
+			reloadCallback( path, diagnostics );
+
+		return published;
+	}
+
+	FileStamp ReloadWatcher::StampFile( const std::string &path )
+	{
+		FileStamp stamp;
+		std::error_code error;
+
+		stamp.writeTime = std::filesystem::last_write_time( path, error );
+		if ( error )
+			return FileStamp();
+
+		stamp.size = std::filesystem::file_size( path, error );
+		if ( error )
+			return FileStamp();
+
+		stamp.exists = true;
+		return stamp;
+	}
+
+	bool ReloadWatcher::reload( WatchedFile &file, std::vector< ParseDiagnostic > &diagnostics )
+	{
+		ParseResult result = KeyValues::tryParseFromFile( file.path, expressionEngine, options );
+		diagnostics = std::move( result.diagnostics );
+
+		if ( !diagnostics.empty() )
+			return false;
+
+		file.handle.publish( std::move( result.document ) );
+		return true;
+	}
+
+	void ReloadWatcher::watchDirectory( WatchedFile &file )
+	{
+#ifdef __linux__
+		if ( inotifyDescriptor == -1 )
+			return;
+
+		// The directory is watched rather than the file, editors often save by replacing the file with a new one. Watching
+		// a directory again gives the same descriptor. Directories that can't be watched are left to polling.
+		std::string directory = std::filesystem::path( file.path ).parent_path().string();
+		if ( directory.empty() )
+			directory = ".";
+
+		file.watchDescriptor = inotify_add_watch( inotifyDescriptor, directory.c_str(), IN_CLOSE_WRITE | IN_MOVED_TO | IN_MOVED_FROM | IN_CREATE | IN_DELETE | IN_ATTRIB );
+#else
+		( void )file;
+#endif
+	}
+
+	void ReloadWatcher::run()
+	{
+		for ( ;; )
+		{
+			wait();
+
+			{
+				std::lock_guard< std::mutex > lock( waitMutex );
+				if ( stopping )
+					return;
+			}
+
+			checkNow();
+		}
+	}
+
+	void ReloadWatcher::wait()
+	{
+#ifdef __linux__
+		if ( inotifyDescriptor != -1 )
+		{
+			pollfd descriptors[ 2 ] = { { inotifyDescriptor, POLLIN, 0 }, { wakeDescriptor, POLLIN, 0 } };
+			const int timeout = static_cast< int >( std::min< std::chrono::milliseconds::rep >( pollInterval.count(), INT_MAX ) );
+
+			if ( poll( descriptors, 2, timeout ) > 0 && ( descriptors[ 0 ].revents & POLLIN ) )
+				readEvents();
+
+			return;
+		}
+#endif
+
+		std::unique_lock< std::mutex > lock( waitMutex );
+		waitCondition.wait_for( lock, pollInterval, [ this ] { return stopping; } );
+	}
+
+	void ReloadWatcher::readEvents()
+	{
+#ifdef __linux__
+		if ( inotifyDescriptor == -1 )
+			return;
+
+		alignas( inotify_event ) char buffer[ 4096 ];
+		ssize_t length;
+
+		// Held while reading too, so events read by one thread are marked before another can check the files
+		std::lock_guard< std::mutex > lock( filesMutex );
+
+		while ( ( length = read( inotifyDescriptor, buffer, sizeof( buffer ) ) ) > 0 )
+		{
+			for ( ssize_t offset = 0; offset < length; )
+			{
+				const inotify_event *event = reinterpret_cast< const inotify_event* >( buffer + offset );
+				offset += sizeof( inotify_event ) + event->len;
+
+				if ( event->len == 0 )
+					continue;
+
+				for ( const std::unique_ptr< WatchedFile > &file : files )
+				{
+					if ( file->watchDescriptor == event->wd && file->name == event->name )
+						file->changed = true;
+				}
+			}
+		}
+#endif
+	}
+
+	void ReloadWatcher::stop()
+	{
+		{
+			std::lock_guard< std::mutex > lock( waitMutex );
+			stopping = true;
+		}
+
+		waitCondition.notify_all();
+
+#ifdef __linux__
+		if ( wakeDescriptor != -1 )
+		{
+			const uint64_t one = 1;
+			const ssize_t written = write( wakeDescriptor, &one, sizeof( one ) );
+			( void )written;
+		}
+#endif
+	}
+
+	ReloadManager::ReloadManager( const ExpressionEngine &expressionEngine /*= ExpressionEngine( true )*/, const ParseOptions &options /*= ParseOptions()*/, std::chrono::milliseconds pollInterval /*= std::chrono::milliseconds( 1000 )*/ ) :
+		watcher( std::make_unique< ReloadWatcher >( expressionEngine, options, pollInterval ) )
+	{
+	}
+
+	ReloadManager::~ReloadManager() = default;
+
+	const DocumentHandle &ReloadManager::watch( const std::string &path )
+	{
+		return watcher->watch( path );
+	}
+
+	void ReloadManager::setReloadCallback( ReloadCallback callback )
+	{
+		watcher->setReloadCallback( std::move( callback ) );
+	}
+
+	size_t ReloadManager::checkNow()
+	{
+		return watcher->checkNow();
+	}
+}
@@ -0,0 +1,78 @@
+#pragma once
+
+#include "keyvalues.hpp"
+
+#include <string>
+#include <vector>
+#include <memory>
+#include <filesystem>
+#include <thread>
+#include <condition_variable>
+
+namespace KV
+{
+	// What a file looked like when it was last checked, it changed if this doesn't match anymore
+	struct FileStamp
+	{
+		bool exists = false;
+		std::filesystem::file_time_type writeTime;
+		uintmax_t size = 0;
+
+		bool operator==( const FileStamp &other ) const { return ( exists == other.exists && writeTime == other.writeTime && size == other.size ); }
+		bool operator!=( const FileStamp &other ) const { return !( *this == other ); }
+	};
+
+	// Background thread of a ReloadManager and the files it watches
+	class ReloadWatcher
+	{
+	public:
+		ReloadWatcher( const ExpressionEngine &expressionEngine, const ParseOptions &options, std::chrono::milliseconds pollInterval );
+		~ReloadWatcher();
+
+		const DocumentHandle &watch( const std::string &path );
+		void setReloadCallback( ReloadManager::ReloadCallback callback );
+		size_t checkNow();
+
+	private:
+		struct WatchedFile
+		{
+			std::string path;
+			std::string name; // Of the file within its directory
+			int watchDescriptor = -1; // Of the directory, -1 if it isn't watched through inotify
+			FileStamp stamp;
+			bool changed = false; // Set by an inotify event, for changes that keep the stamp
+
+			DocumentHandle handle;
+		};
+
+		static FileStamp StampFile( const std::string &path );
+
+		// Parses the file and publishes it if there were no errors, the diagnostics are left in 'diagnostics'
+		bool reload( WatchedFile &file, std::vector< ParseDiagnostic > &diagnostics );
+
+		void watchDirectory( WatchedFile &file );
+
+		void run();
+		void wait(); // Until something in a watched directory changed, the poll interval passed or the watcher stops
+		void readEvents();
+		void stop();
+
+		const ExpressionEngine expressionEngine;
+		const ParseOptions options;
+		const std::chrono::milliseconds pollInterval;
+
+		// Held while checking, so files are reloaded by one thread at a time
+		std::mutex filesMutex;
+		std::vector< std::unique_ptr< WatchedFile > > files; // Never removed, handles stay valid
+		ReloadManager::ReloadCallback callback;
+
+		std::mutex waitMutex;
+		std::condition_variable waitCondition;
+		bool stopping = false;
+
+		int inotifyDescriptor = -1; // -1 if inotify isn't used
+		int wakeDescriptor = -1;
+
+		std::thread thread;
+	};
+}
@@ -0,0 +1,368 @@
+#include "scanner.hpp"
+
+#include <algorithm>
+#include <cstring>
+
+#if defined( __SSE2__ ) || defined( _M_X64 ) || ( defined( _M_IX86_FP ) && _M_IX86_FP >= 2 )
+#define KV_SCANNER_SSE2
+#include <emmintrin.h>
+#endif
+
+// AVX2 is picked at runtime on GCC/Clang, MSVC only uses it when building with /arch:AVX2
+#if defined( __GNUC__ ) && ( defined( __x86_64__ ) || defined( __i386__ ) )
+#define KV_SCANNER_AVX2
+#define KV_SCANNER_AVX2_TARGET __attribute__(( target( "avx2" ) ))
+#include <immintrin.h>
+#elif defined( _MSC_VER ) && defined( __AVX2__ )
+#define KV_SCANNER_AVX2
+#define KV_SCANNER_AVX2_TARGET
+#include <immintrin.h>
+#endif
+
+#ifdef _MSC_VER
+#include <intrin.h>
+#endif
+
+namespace KV
+{
+	namespace
+	{
+		enum CharClass : uint8_t
+		{
+			CLASS_WHITESPACE = 1 << 0,
+			CLASS_STRUCTURAL = 1 << 1
+		};
+
+		constexpr std::array< uint8_t, 256 > buildClassTable()
+		{
+			std::array< uint8_t, 256 > table = {};
+
+			table[ static_cast< uint8_t >( ' ' ) ] = CLASS_WHITESPACE;
+			table[ static_cast< uint8_t >( '\t' ) ] = CLASS_WHITESPACE;
+			table[ static_cast< uint8_t >( '\r' ) ] = CLASS_WHITESPACE;
+			table[ static_cast< uint8_t >( '\n' ) ] = CLASS_WHITESPACE | CLASS_STRUCTURAL;
+
+			for ( const char c : { '"', '{', '}', '[', ']', '/' } )
+				table[ static_cast< uint8_t >( c ) ] = CLASS_STRUCTURAL;
+
+			return table;
+		}
+
+		constexpr const std::array< uint8_t, 256 > cClassTable = buildClassTable();
+
+		inline size_t countTrailingZeros( uint64_t mask )
+		{
+#ifdef _MSC_VER
+			unsigned long index;
+			_BitScanForward64( &index, mask );
+			return index;
+#else
+			return static_cast< size_t >( __builtin_ctzll( mask ) );
+#endif
+		}
+
+		using ClassifyFunc = void( * )( const char *block, uint64_t &whiteSpace, uint64_t &structural );
+
+		[[maybe_unused]] void classifyScalar( const char *block, uint64_t &whiteSpace, uint64_t &structural )
+		{
+			whiteSpace = 0;
+			structural = 0;
+
+			for ( size_t i = 0; i < 64; ++i )
+			{
+				const uint8_t charClass = cClassTable[ static_cast< uint8_t >( block[ i ] ) ];
+				whiteSpace |= static_cast< uint64_t >( charClass & CLASS_WHITESPACE ) << i;
+				structural |= static_cast< uint64_t >( ( charClass & CLASS_STRUCTURAL ) >> 1 ) << i;
+			}
+		}
+
+#ifdef KV_SCANNER_SSE2
+		void classifySSE2( const char *block, uint64_t &whiteSpace, uint64_t &structural )
+		{
+			const __m128i space = _mm_set1_epi8( ' ' );
+			const __m128i tab = _mm_set1_epi8( '\t' );
+			const __m128i carriageReturn = _mm_set1_epi8( '\r' );
+			const __m128i newLine = _mm_set1_epi8( '\n' );
+			const __m128i quote = _mm_set1_epi8( '"' );
+			const __m128i openBrace = _mm_set1_epi8( '{' );
+			const __m128i closeBrace = _mm_set1_epi8( '}' );
+			const __m128i openBracket = _mm_set1_epi8( '[' );
+			const __m128i closeBracket = _mm_set1_epi8( ']' );
+			const __m128i slash = _mm_set1_epi8( '/' );
+
+			whiteSpace = 0;
+			structural = 0;
+
+			for ( size_t i = 0; i < 64; i += 16 )
+			{
+				const __m128i chunk = _mm_loadu_si128( reinterpret_cast< const __m128i* >( block + i ) );
+				const __m128i isNewLine = _mm_cmpeq_epi8( chunk, newLine );
+
+				__m128i isWhiteSpace = _mm_or_si128( _mm_cmpeq_epi8( chunk, space ), _mm_cmpeq_epi8( chunk, tab ) );
+				isWhiteSpace = _mm_or_si128( isWhiteSpace, _mm_or_si128( _mm_cmpeq_epi8( chunk, carriageReturn ), isNewLine ) );
+
+				__m128i isStructural = _mm_or_si128( _mm_cmpeq_epi8( chunk, quote ), _mm_cmpeq_epi8( chunk, slash ) );
+				isStructural = _mm_or_si128( isStructural, _mm_or_si128( _mm_cmpeq_epi8( chunk, openBrace ), _mm_cmpeq_epi8( chunk, closeBrace ) ) );
+				isStructural = _mm_or_si128( isStructural, _mm_or_si128( _mm_cmpeq_epi8( chunk, openBracket ), _mm_cmpeq_epi8( chunk, closeBracket ) ) );
+				isStructural = _mm_or_si128( isStructural, isNewLine );
+
+				whiteSpace |= static_cast< uint64_t >( static_cast< uint16_t >( _mm_movemask_epi8( isWhiteSpace ) ) ) << i;
+				structural |= static_cast< uint64_t >( static_cast< uint16_t >( _mm_movemask_epi8( isStructural ) ) ) << i;
+			}
+		}
+#endif
+
+#ifdef KV_SCANNER_AVX2
+		KV_SCANNER_AVX2_TARGET void classifyAVX2( const char *block, uint64_t &whiteSpace, uint64_t &structural )
+		{
+			const __m256i space = _mm256_set1_epi8( ' ' );
+			const __m256i tab = _mm256_set1_epi8( '\t' );
+			const __m256i carriageReturn = _mm256_set1_epi8( '\r' );
+			const __m256i newLine = _mm256_set1_epi8( '\n' );
+			const __m256i quote = _mm256_set1_epi8( '"' );
+			const __m256i openBrace = _mm256_set1_epi8( '{' );
+			const __m256i closeBrace = _mm256_set1_epi8( '}' );
+			const __m256i openBracket = _mm256_set1_epi8( '[' );
+			const __m256i closeBracket = _mm256_set1_epi8( ']' );
+			const __m256i slash = _mm256_set1_epi8( '/' );
+
+			whiteSpace = 0;
+			structural = 0;
+
+			for ( size_t i = 0; i < 64; i += 32 )
+			{
+				const __m256i chunk = _mm256_loadu_si256( reinterpret_cast< const __m256i* >( block + i ) );
+				const __m256i isNewLine = _mm256_cmpeq_epi8( chunk, newLine );
+
+				__m256i isWhiteSpace = _mm256_or_si256( _mm256_cmpeq_epi8( chunk, space ), _mm256_cmpeq_epi8( chunk, tab ) );
+				isWhiteSpace = _mm256_or_si256( isWhiteSpace, _mm256_or_si256( _mm256_cmpeq_epi8( chunk, carriageReturn ), isNewLine ) );
+
+				__m256i isStructural = _mm256_or_si256( _mm256_cmpeq_epi8( chunk, quote ), _mm256_cmpeq_epi8( chunk, slash ) );
+				isStructural = _mm256_or_si256( isStructural, _mm256_or_si256( _mm256_cmpeq_epi8( chunk, openBrace ), _mm256_cmpeq_epi8( chunk, closeBrace ) ) );
+				isStructural = _mm256_or_si256( isStructural, _mm256_or_si256( _mm256_cmpeq_epi8( chunk, openBracket ), _mm256_cmpeq_epi8( chunk, closeBracket ) ) );
+				isStructural = _mm256_or_si256( isStructural, isNewLine );
+
+				whiteSpace |= static_cast< uint64_t >( static_cast< uint32_t >( _mm256_movemask_epi8( isWhiteSpace ) ) ) << i;
+				structural |= static_cast< uint64_t >( static_cast< uint32_t >( _mm256_movemask_epi8( isStructural ) ) ) << i;
+			}
+		}
+#endif
+
+		ClassifyFunc selectClassifier()
+		{
+#if defined( KV_SCANNER_AVX2 ) && defined( __GNUC__ )
+			if ( __builtin_cpu_supports( "avx2" ) )
+				return &classifyAVX2;
+#elif defined( KV_SCANNER_AVX2 )
+			return &classifyAVX2;
+#endif
+
+#ifdef KV_SCANNER_SSE2
+			return &classifySSE2;
+#else
+			return &classifyScalar;
+#endif
+		}
+
+		const ClassifyFunc classify = selectClassifier();
+
+		inline size_t popCount( uint32_t mask )
+		{
+#ifdef _MSC_VER
+			return __popcnt( mask );
+#else
+			return static_cast< size_t >( __builtin_popcount( mask ) );
+#endif
+		}
+
+		// Calls 'onBlock' with a bitmask of the newlines in every 16 byte block, then 'onByte' for every byte left over
+		template < typename BlockFunc, typename ByteFunc >
+		void scanNewLines( const std::string_view &buffer, BlockFunc onBlock, ByteFunc onByte )
+		{
+			size_t i = 0;
+
+#ifdef KV_SCANNER_SSE2
+			const __m128i newLine = _mm_set1_epi8( '\n' );
+
+			for ( ; i + 16 <= buffer.size(); i += 16 )
+			{
+				const __m128i chunk = _mm_loadu_si128( reinterpret_cast< const __m128i* >( buffer.data() + i ) );
+				onBlock( i, static_cast< uint32_t >( _mm_movemask_epi8( _mm_cmpeq_epi8( chunk, newLine ) ) ) );
+			}
+#endif
+
+			for ( ; i < buffer.size(); ++i )
+			{
+				if ( buffer[ i ] == '\n' )
+					onByte( i );
+			}
+		}
+	}
+
+	size_t StructuralIndex::skipWhiteSpace( size_t index )
+	{
+		return findNext( index, Mask::NotWhiteSpace );
+	}
+
+	size_t StructuralIndex::findStructural( size_t index )
+	{
+		return findNext( index, Mask::Structural );
+	}
+
+	size_t StructuralIndex::findTokenEnd( size_t index )
+	{
+		return findNext( index, Mask::TokenEnd );
+	}
+
+	size_t StructuralIndex::findChar( size_t index, char c )
+	{
+		for ( index = findStructural( index ); index != std::string::npos; index = findStructural( index + 1 ) )
+		{
+			if ( buffer[ index ] == c )
+				return index;
+		}
+
+		return std::string::npos;
+	}
+
+	size_t StructuralIndex::skipLineComment( size_t index )
+	{
+		const size_t end = findChar( index, '\n' );
+		return ( end == std::string::npos ) ? std::string::npos : end + 1;
+	}
+
+	size_t StructuralIndex::skipMultiLineComment( size_t index )
+	{
+		// Skip the opening "/*" so "/*/" isn't taken as a whole comment
+		for ( size_t i = findChar( index + 2, '/' ); i != std::string::npos; i = findChar( i + 1, '/' ) )
+		{
+			if ( buffer[ i - 1 ] == '*' && i - 1 >= index + 2 )
+				return i + 1;
+		}
+
+		return std::string::npos;
+	}
+
+	size_t StructuralIndex::findNext( size_t index, Mask mask )
+	{
+		while ( index < buffer.size() )
+		{
+			const size_t block = index / cBlockSize;
+
+			if ( block < windowStart || block >= windowEnd )
+				loadWindow( block );
+
+			const size_t local = block - windowStart;
+			uint64_t bits = 0;
+
+			switch ( mask )
+			{
+				case Mask::NotWhiteSpace:
+					bits = ~whiteSpace[ local ];
+					break;
+				case Mask::Structural:
+					bits = structural[ local ];
+					break;
+				case Mask::TokenEnd:
+					bits = whiteSpace[ local ] | structural[ local ];
+					break;
+			}
+
+			bits &= ~uint64_t( 0 ) << ( index % cBlockSize );
+
+			if ( bits != 0 )
+			{
+				const size_t found = block * cBlockSize + countTrailingZeros( bits );
+				return ( found < buffer.size() ) ? found : std::string::npos;
+			}
+
+			index = ( block + 1 ) * cBlockSize;
+		}
+
+		return std::string::npos;
+	}
+
+	void StructuralIndex::loadWindow( size_t block )
+	{
+		const size_t blockCount = ( buffer.size() + cBlockSize - 1 ) / cBlockSize;
+
+		windowStart = block;
+		windowEnd = std::min( block + cWindowBlocks, blockCount );
+
+		for ( size_t i = windowStart; i < windowEnd; ++i )
+		{
+			const size_t offset = i * cBlockSize;
+			const char *data = buffer.data() + offset;
+
+			// The last block is padded with bytes that are neither whitespace nor structural
+			if ( buffer.size() - offset < cBlockSize )
+			{
+				char padded[ cBlockSize ] = {};
+				std::memcpy( padded, data, buffer.size() - offset );
+				classify( padded, whiteSpace[ i - windowStart ], structural[ i - windowStart ] );
+			}
+			else
+				classify( data, whiteSpace[ i - windowStart ], structural[ i - windowStart ] );
+		}
+	}
+
+	size_t LineIndex::getLine( size_t offset ) const
+	{
+		build();
+
+		// Errors at EOF are reported at the end of the buffer
+		offset = std::min( offset, buffer.size() );
+		return static_cast< size_t >( std::upper_bound( lineStarts.begin(), lineStarts.end(), offset ) - lineStarts.begin() );
+	}
+
+	size_t LineIndex::getColumn( size_t offset ) const
+	{
+		constexpr auto UTF8_MB_CONTINUE = 2;
+
+		offset = std::min( offset, buffer.size() );
+
+		size_t column = 0;
+		for ( size_t i = lineStarts[ getLine( offset ) - 1 ]; i < offset; ++i )
+		{
+			const unsigned char c = static_cast< unsigned char >( buffer[ i ] );
+			if ( ( c >> 6 ) != UTF8_MB_CONTINUE && c != '\r' )
+				++column;
+		}
+
+		return column;
+	}
+
+	std::string_view LineIndex::getLineText( size_t line ) const
+	{
+		build();
+
+		if ( line == 0 || line > lineStarts.size() )
+			return std::string_view();
+
+		const size_t start = lineStarts[ line - 1 ];
+		const size_t end = ( line < lineStarts.size() ) ? lineStarts[ line ] - 1 : buffer.size();
+
+		return buffer.substr( start, end - start );
+	}
+
+	void LineIndex::build() const
+	{
+		if ( !lineStarts.empty() )
+			return;
+
+		// Count first so the index is allocated once, even for files with millions of lines
+		size_t lineCount = 1;
+		scanNewLines( buffer, [ &lineCount ]( size_t, uint32_t mask ) { lineCount += popCount( mask ); }, [ &lineCount ]( size_t ) { ++lineCount; } );
+
+		lineStarts.reserve( lineCount );
+		lineStarts.push_back( 0 );
+
+		scanNewLines( buffer,
+			[ this ]( size_t offset, uint32_t mask )
+			{
+				for ( ; mask != 0; mask &= mask - 1 )
+					lineStarts.push_back( offset + countTrailingZeros( mask ) + 1 );
+			},
+			[ this ]( size_t offset ) { lineStarts.push_back( offset + 1 ); } );
+	}
+}
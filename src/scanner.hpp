@@ -0,0 +1,81 @@
+#pragma once
+
+#include <string_view>
+#include <string>
+#include <array>
+#include <cstdint>
+#include <vector>
+
+namespace KV
+{
+	// Stage 1 of the parser. The buffer is classified 64 bytes at a time into a bitmask of
+	// whitespace and a bitmask of structural characters ( " { } [ ] / and newlines ), using
+	// SSE2/AVX2 where available. The tokenizer then jumps straight to the next byte that
+	// can matter instead of testing every byte. Masks are computed a window at a time, so
+	// the index costs the same small amount of memory no matter how large the buffer is.
+	class StructuralIndex
+	{
+	public:
+		explicit StructuralIndex( const std::string_view &buffer ) : buffer( buffer ) {}
+
+		// All of these return the first matching position at or after 'index', std::string::npos if there is none
+		size_t skipWhiteSpace( size_t index );
+		size_t findStructural( size_t index );
+		size_t findTokenEnd( size_t index ); // Whitespace or structural
+		size_t findChar( size_t index, char c ); // 'c' has to be a structural character
+
+		// Skips comments starting at 'index', returns the position after the comment ends
+		size_t skipLineComment( size_t index );
+		size_t skipMultiLineComment( size_t index );
+
+		char peekChar( size_t index ) const { return ( index < buffer.size() ) ? buffer[ index ] : '\0'; }
+
+		const std::string_view &getBuffer() const { return buffer; }
+
+	private:
+		constexpr static const size_t cBlockSize = 64;
+		constexpr static const size_t cWindowBlocks = 64;
+
+		enum class Mask
+		{
+			NotWhiteSpace,
+			Structural,
+			TokenEnd
+		};
+
+		size_t findNext( size_t index, Mask mask );
+		void loadWindow( size_t block );
+
+		std::string_view buffer;
+
+		size_t windowStart = std::string::npos; // First block in the window
+		size_t windowEnd = 0;
+
+		std::array< uint64_t, cWindowBlocks > whiteSpace;
+		std::array< uint64_t, cWindowBlocks > structural;
+	};
+
+	// Maps byte offsets to lines and columns. The offsets lines start at are found with a SIMD scan the
+	// first time they're needed, so parses without errors never pay for it, and every lookup after that
+	// is a binary search. Columns count UTF-8 characters, not bytes, and ignore carriage returns.
+	class LineIndex
+	{
+	public:
+		explicit LineIndex( const std::string_view &buffer ) : buffer( buffer ) {}
+
+		size_t getLine( size_t offset ) const; // 1 based
+		size_t getColumn( size_t offset ) const; // 0 based
+
+		// Text of a line without its line break, empty if the line doesn't exist
+		std::string_view getLineText( size_t line ) const;
+
+		const std::string_view &getBuffer() const { return buffer; }
+
+	private:
+		void build() const;
+
+		std::string_view buffer;
+
+		mutable std::vector< size_t > lineStarts; // Empty until built
+	};
+}
@@ -0,0 +1,628 @@
+#include "serializer.hpp"
+
+#include <cstring>
+#include <algorithm>
+#include <thread>
+#include <atomic>
+#include <system_error>
+
+#ifdef _WIN32
+#define WIN32_LEAN_AND_MEAN
+#define NOMINMAX
+#include <Windows.h>
+#include <io.h>
+#else
+#include <fcntl.h>
+#include <unistd.h>
+#include <cerrno>
+#endif
+
+namespace KV
+{
+	namespace
+	{
+		constexpr const char cTabs[] = "\t\t\t\t\t\t\t\t\t\t\t\t\t\t\t\t";
+
+		// Strings can be written without quotes in compact mode unless the parser would end them early, or read them as
+		// something else than a string. Control characters are quoted too, to be safe.
+		bool NeedsQuotes( const std::string_view &str )
+		{
+			if ( str.empty() )
+				return true;
+
+			for ( const char c : str )
+			{
+				switch ( c )
+				{
+					case '"':
+					case '{':
+					case '}':
+					case '[':
+					case ']':
+					case '/':
+						return true;
+					default:
+					{
+						if ( static_cast< unsigned char >( c ) <= ' ' )
+							return true;
+					}
+				}
+			}
+
+			return false;
+		}
+
+		// Calls 'work' with every index below 'count' on up to 'threadCount' threads, the calling thread included
+		template< typename Work >
+		void RunInParallel( size_t threadCount, size_t count, const Work &work )
+		{
+			std::atomic< size_t > next{ 0 };
+
+			auto run = [ & ]()
+			{
+				for ( size_t i = next++; i < count; i = next++ )
+					work( i );
+			};
+
+			std::vector< std::thread > workers;
+			for ( size_t i = 1; i < std::min( threadCount, count ); ++i )
+			{
+				// Carry on with the threads we got if the system won't give us more
+				try
+				{
+					workers.emplace_back( run );
+				}
+				catch ( const std::system_error & )
+				{
+					break;
+				}
+			}
+
+			run();
+
+			for ( std::thread &worker : workers )
+				worker.join();
+		}
+
+		// File written at explicit offsets, so several threads can write to it at once
+		class PositionalFile
+		{
+		public:
+			explicit PositionalFile( const std::string &path );
+			~PositionalFile() { close(); }
+
+			PositionalFile( const PositionalFile& ) = delete;
+			PositionalFile &operator=( const PositionalFile& ) = delete;
+
+			bool isOpen() const;
+			bool writeAt( const char *data, size_t size, uint64_t offset );
+			bool close(); // Returns false if the file couldn't be closed, or wasn't open
+
+		private:
+#ifdef _WIN32
+			HANDLE file = INVALID_HANDLE_VALUE;
+#else
+			int fd = -1;
+#endif
+		};
+
+#ifdef _WIN32
+		PositionalFile::PositionalFile( const std::string &path ) :
+			file( CreateFileA( path.c_str(), GENERIC_WRITE, 0, nullptr, CREATE_ALWAYS, FILE_ATTRIBUTE_NORMAL, nullptr ) )
+		{
+		}
+
+		bool PositionalFile::isOpen() const
+		{
+			return ( file != INVALID_HANDLE_VALUE );
+		}
+
+		bool PositionalFile::writeAt( const char *data, size_t size, uint64_t offset )
+		{
+			while ( size > 0 )
+			{
+				OVERLAPPED overlapped = {};
+				overlapped.Offset = static_cast< DWORD >( offset );
+				overlapped.OffsetHigh = static_cast< DWORD >( offset >> 32 );
+
+				DWORD written;
+				if ( !WriteFile( file, data, static_cast< DWORD >( std::min< size_t >( size, 1u << 30 ) ), &written, &overlapped ) )
+					return false;
+
+				data += written;
+				size -= written;
+				offset += written;
+			}
+
+			return true;
+		}
+
+		bool PositionalFile::close()
+		{
+			if ( file == INVALID_HANDLE_VALUE )
+				return false;
+
+			const bool closed = ( CloseHandle( file ) != 0 );
+			file = INVALID_HANDLE_VALUE;
+
+			return closed;
+		}
+#else
+		PositionalFile::PositionalFile( const std::string &path ) :
+			fd( ::open( path.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0666 ) )
+		{
+		}
+
+		bool PositionalFile::isOpen() const
+		{
+			return ( fd >= 0 );
+		}
+
+		bool PositionalFile::writeAt( const char *data, size_t size, uint64_t offset )
+		{
+			while ( size > 0 )
+			{
+				const ssize_t written = ::pwrite( fd, data, size, static_cast< off_t >( offset ) );
+				if ( written < 0 )
+				{
+					if ( errno == EINTR )
+						continue;
+
+					return false;
+				}
+
+				data += written;
+				size -= static_cast< size_t >( written );
+				offset += static_cast< uint64_t >( written );
+			}
+
+			return true;
+		}
+
+		bool PositionalFile::close()
+		{
+			if ( fd < 0 )
+				return false;
+
+			const bool closed = ( ::close( fd ) == 0 );
+			fd = -1;
+
+			return closed;
+		}
+#endif
+
+		// Hands a run's text to the file, starting at the run's offset
+		class PositionalSink : public OutputSink
+		{
+		public:
+			PositionalSink( PositionalFile &file, uint64_t offset ) : file( file ), offset( offset ) {}
+
+			bool write( const char *data, size_t size ) override
+			{
+				if ( !file.writeAt( data, size, offset ) )
+					return false;
+
+				offset += size;
+				return true;
+			}
+
+		private:
+			PositionalFile &file;
+			uint64_t offset;
+		};
+	}
+
+	bool FileSink::write( const char *data, size_t size )
+	{
+		return ( std::fwrite( data, 1, size, file ) == size );
+	}
+
+	bool DescriptorSink::write( const char *data, size_t size )
+	{
+		while ( size > 0 )
+		{
+#ifdef _WIN32
+			const int written = _write( fd, data, static_cast< unsigned int >( std::min< size_t >( size, 1u << 30 ) ) );
+			if ( written < 0 )
+				return false;
+#else
+			const ssize_t written = ::write( fd, data, size );
+			if ( written < 0 )
+			{
+				if ( errno == EINTR )
+					continue;
+
+				return false;
+			}
+#endif
+
+			data += written;
+			size -= static_cast< size_t >( written );
+		}
+
+		return true;
+	}
+
+	void BufferOutput::write( const char *data, size_t size )
+	{
+		std::memcpy( cursor, data, size );
+		cursor += size;
+	}
+
+	void SinkOutput::write( const char *data, size_t size )
+	{
+		if ( size > buffer.size() - used )
+		{
+			flush();
+
+			if ( size >= buffer.size() )
+			{
+				if ( !failed && !sink.write( data, size ) )
+					failed = true;
+
+				return;
+			}
+		}
+
+		std::memcpy( buffer.data() + used, data, size );
+		used += size;
+	}
+
+	bool SinkOutput::finish()
+	{
+		flush();
+		return !failed;
+	}
+
+	void SinkOutput::flush()
+	{
+		if ( used > 0 && !failed && !sink.write( buffer.data(), used ) )
+			failed = true;
+
+		used = 0;
+	}
+
+	template< typename Output >
+	void Serializer< Output >::write( const KeyValues &kv )
+	{
+		if ( !kv.isSection() )
+		{
+			writeKeyValue( kv );
+			endTopLevel( kv );
+
+			return;
+		}
+
+		beginSection( kv );
+		sections.emplace_back( kv.begin(), kv.end() );
+
+		while ( !sections.empty() )
+		{
+			Position &position = sections.back();
+
+			if ( !( position.first != position.second ) )
+			{
+				sections.pop_back();
+				endSection( ( sections.empty() ) ? kv : *sections.back().first );
+
+				if ( !sections.empty() )
+					++sections.back().first;
+
+				continue;
+			}
+
+			const KeyValues &child = *position.first;
+			if ( child.isSection() )
+			{
+				beginSection( child );
+				sections.emplace_back( child.begin(), child.end() );
+
+				continue;
+			}
+
+			writeKeyValue( child );
+			++position.first;
+		}
+
+		endTopLevel( kv );
+	}
+
+	template< typename Output >
+	void Serializer< Output >::open( const KeyValues &section )
+	{
+		beginSection( section );
+	}
+
+	template< typename Output >
+	void Serializer< Output >::close( const KeyValues &section )
+	{
+		endSection( section );
+		endTopLevel( section );
+	}
+
+	template< typename Output >
+	void Serializer< Output >::continueAfter( const KeyValues &kv )
+	{
+		KeyValues::NumberBuffer buffer;
+		separate = ( compact && !kv.isSection() && kv.getDepth() > 0 && !NeedsQuotes( kv.getValueText( buffer ) ) );
+	}
+
+	template< typename Output >
+	void Serializer< Output >::endTopLevel( const KeyValues &kv )
+	{
+		if ( compact && kv.getDepth() == 0 )
+		{
+			output.put( '\n' );
+			separate = false;
+		}
+	}
+
+	template< typename Output >
+	void Serializer< Output >::writeString( const std::string_view &str )
+	{
+		if ( compact && !NeedsQuotes( str ) )
+		{
+			if ( separate )
+				output.put( ' ' );
+
+			output.write( str.data(), str.size() );
+			separate = true;
+
+			return;
+		}
+
+		output.put( '"' );
+		output.write( str.data(), str.size() );
+		output.put( '"' );
+
+		separate = false;
+	}
+
+	template< typename Output >
+	void Serializer< Output >::writeIndent( size_t depth )
+	{
+		if ( compact )
+			return;
+
+		for ( ; depth > sizeof( cTabs ) - 1; depth -= sizeof( cTabs ) - 1 )
+			output.write( cTabs, sizeof( cTabs ) - 1 );
+
+		output.write( cTabs, depth );
+	}
+
+	template< typename Output >
+	void Serializer< Output >::writeKeyValue( const KeyValues &kv )
+	{
+		KeyValues::NumberBuffer buffer;
+
+		writeIndent( kv.getDepth() );
+		writeString( kv.key.view() );
+
+		if ( !compact )
+			output.put( ' ' );
+
+		writeString( kv.getValueText( buffer ) );
+
+		if ( !compact )
+			output.put( '\n' );
+	}
+
+	template< typename Output >
+	void Serializer< Output >::beginSection( const KeyValues &section )
+	{
+		writeIndent( section.getDepth() );
+		writeString( section.key.view() );
+
+		if ( !compact )
+		{
+			output.put( '\n' );
+			writeIndent( section.getDepth() );
+			output.write( "{\n", 2 );
+		}
+		else
+			output.put( '{' );
+
+		separate = false;
+	}
+
+	template< typename Output >
+	void Serializer< Output >::endSection( const KeyValues &section )
+	{
+		writeIndent( section.getDepth() );
+		output.put( '}' );
+
+		// Top level sections are followed by an empty line
+		if ( !compact )
+			output.write( "\n\n", ( section.getDepth() == 0 ) ? 2 : 1 );
+
+		separate = false;
+	}
+
+	ParallelSerializer::ParallelSerializer( const KeyValues &root, const SaveOptions &options, size_t threadCount ) :
+		options( options ),
+		threadCount( threadCount )
+	{
+		// Threads can't parse lazy sections, they'd all be writing to the document
+		root.expandAll();
+
+		// Pieces are shared out between threads a batch at a time, more of them than threads evens out their sizes
+		const size_t targetPieces = threadCount * 16;
+		constexpr const size_t cMaxSplitDepth = 4;
+
+		for ( const KeyValues &kv : root )
+			pieces.push_back( Piece{ &kv, Piece::Kind::Node } );
+
+		// Every section among the pieces is split into its children, one level at a time
+		std::vector< Piece > split;
+		for ( size_t depth = 0; depth < cMaxSplitDepth && pieces.size() < targetPieces; ++depth )
+		{
+			split.clear();
+
+			for ( const Piece &piece : pieces )
+			{
+				if ( piece.kind != Piece::Kind::Node || !piece.kv->isSection() || piece.kv->isEmpty() )
+				{
+					split.push_back( piece );
+					continue;
+				}
+
+				split.push_back( Piece{ piece.kv, Piece::Kind::Open } );
+
+				for ( const KeyValues &kv : *piece.kv )
+					split.push_back( Piece{ &kv, Piece::Kind::Node } );
+
+				split.push_back( Piece{ piece.kv, Piece::Kind::Close } );
+			}
+
+			if ( split.size() == pieces.size() )
+				break;
+
+			pieces.swap( split );
+		}
+
+		if ( threadCount > 1 && pieces.size() > 1 )
+			measureStart();
+	}
+
+	void ParallelSerializer::saveToBuffer( std::string &out )
+	{
+		measure();
+		out.resize( offsets.back() );
+
+		const std::vector< size_t > runs = cutRuns();
+
+		RunInParallel( threadCount, runs.size(), [ & ]( size_t run )
+		{
+			const size_t first = ( run == 0 ) ? 0 : runs[ run - 1 ];
+
+			BufferOutput output( out.data() + offsets[ first ] );
+			writeRun( output, first, runs[ run ] );
+		} );
+	}
+
+	bool ParallelSerializer::saveToFile( const std::string &path )
+	{
+		PositionalFile file( path );
+		if ( !file.isOpen() )
+			return false;
+
+		measure();
+
+		const std::vector< size_t > runs = cutRuns();
+		std::atomic< bool > failed{ false };
+
+		// Each run goes through its own bounded buffer, written at the run's offset
+		RunInParallel( threadCount, runs.size(), [ & ]( size_t run )
+		{
+			if ( failed )
+				return;
+
+			const size_t first = ( run == 0 ) ? 0 : runs[ run - 1 ];
+
+			PositionalSink sink( file, offsets[ first ] );
+			SinkOutput output( sink );
+			writeRun( output, first, runs[ run ] );
+
+			if ( !output.finish() )
+				failed = true;
+		} );
+
+		return ( file.close() && !failed );
+	}
+
+	void ParallelSerializer::measureStart()
+	{
+		offsets.assign( pieces.size() + 1, 0 );
+
+		CountingOutput output;
+		Serializer< CountingOutput > serializer( output, options );
+
+		while ( measured < pieces.size() && output.getCount() < cMinRunSize * 2 )
+		{
+			writePiece( serializer, pieces[ measured ] );
+			offsets[ ++measured ] = output.getCount();
+		}
+
+		large = ( output.getCount() >= cMinRunSize * 2 );
+	}
+
+	void ParallelSerializer::measure()
+	{
+		const size_t remaining = pieces.size() - measured;
+		const size_t batchSize = std::max< size_t >( 1, remaining / ( threadCount * 16 ) );
+		const size_t batchCount = ( remaining + batchSize - 1 ) / batchSize;
+
+		// Sizes first, each one stored after its piece's offset, then summed up into offsets
+		RunInParallel( threadCount, batchCount, [ & ]( size_t batch )
+		{
+			const size_t first = measured + batch * batchSize;
+			const size_t last = std::min( first + batchSize, pieces.size() );
+
+			CountingOutput output;
+			Serializer< CountingOutput > serializer( output, options );
+
+			if ( first > 0 )
+				serializer.continueAfter( *pieces[ first - 1 ].kv );
+
+			for ( size_t i = first; i < last; ++i )
+			{
+				const size_t start = output.getCount();
+				writePiece( serializer, pieces[ i ] );
+				offsets[ i + 1 ] = output.getCount() - start;
+			}
+		} );
+
+		for ( size_t i = measured + 1; i < offsets.size(); ++i )
+			offsets[ i ] += offsets[ i - 1 ];
+	}
+
+	std::vector< size_t > ParallelSerializer::cutRuns() const
+	{
+		const size_t runSize = std::max( cMinRunSize, offsets.back() / ( threadCount * 4 ) );
+		std::vector< size_t > runs;
+
+		for ( size_t i = 1, start = 0; i <= pieces.size(); ++i )
+		{
+			if ( i == pieces.size() || offsets[ i ] - offsets[ start ] >= runSize )
+			{
+				runs.push_back( i );
+				start = i;
+			}
+		}
+
+		return runs;
+	}
+
+	template< typename Output >
+	void ParallelSerializer::writeRun( Output &output, size_t first, size_t last ) const
+	{
+		Serializer< Output > serializer( output, options );
+
+		if ( first > 0 )
+			serializer.continueAfter( *pieces[ first - 1 ].kv );
+
+		for ( size_t i = first; i < last; ++i )
+			writePiece( serializer, pieces[ i ] );
+	}
+
+	template< typename Output >
+	void ParallelSerializer::writePiece( Serializer< Output > &serializer, const Piece &piece )
+	{
+		switch ( piece.kind )
+		{
+			case Piece::Kind::Node:
+				serializer.write( *piece.kv );
+				break;
+			case Piece::Kind::Open:
+				serializer.open( *piece.kv );
+				break;
+			case Piece::Kind::Close:
+				serializer.close( *piece.kv );
+				break;
+		}
+	}
+
+	template class Serializer< CountingOutput >;
+	template class Serializer< BufferOutput >;
+	template class Serializer< SinkOutput >;
+}
@@ -0,0 +1,161 @@
+#pragma once
+
+#include "keyvalues.hpp"
+
+#include <string_view>
+#include <vector>
+#include <array>
+#include <utility>
+#include <string>
+
+namespace KV
+{
+	// Outputs of the Serializer. Each one takes single characters through put() and runs of them through write().
+
+	// Only counts the bytes, so a buffer can be sized before writing into it
+	class CountingOutput
+	{
+	public:
+		void put( char ) { ++count; }
+		void write( const char *, size_t size ) { count += size; }
+
+		size_t getCount() const { return count; }
+
+	private:
+		size_t count = 0;
+	};
+
+	// Writes straight into memory sized by a CountingOutput pass beforehand, there are no bounds checks
+	class BufferOutput
+	{
+	public:
+		explicit BufferOutput( char *buffer ) : cursor( buffer ) {}
+
+		void put( char c ) { *cursor++ = c; }
+		void write( const char *data, size_t size );
+
+		const char *getCursor() const { return cursor; }
+
+	private:
+		char *cursor;
+	};
+
+	// Stages writes in a fixed size buffer, handing it to the sink whenever it fills up. Writes larger than
+	// the buffer skip it. Once the sink fails everything else is dropped.
+	class SinkOutput
+	{
+	public:
+		explicit SinkOutput( OutputSink &sink ) : sink( sink ) {}
+
+		void put( char c )
+		{
+			if ( used == buffer.size() )
+				flush();
+
+			buffer[ used++ ] = c;
+		}
+
+		void write( const char *data, size_t size );
+
+		// Hands what's left to the sink, returns false if any write failed
+		bool finish();
+
+	private:
+		void flush();
+
+		static constexpr size_t cBufferSize = 16 * 1024;
+
+		OutputSink &sink;
+		bool failed = false;
+		size_t used = 0;
+		std::array< char, cBufferSize > buffer;
+	};
+
+	// Writes a document as text. Whatever is written has to follow on from what was written before it, in
+	// document order, either by this serializer or by one that continueAfter picks up from.
+	template< typename Output >
+	class Serializer
+	{
+	public:
+		Serializer( Output &output, const SaveOptions &options ) : output( output ), compact( options.compact ) {}
+
+		// Writes 'kv' and everything below it
+		void write( const KeyValues &kv );
+
+		// Write only the start or the end of a section, its children are written in between
+		void open( const KeyValues &section );
+		void close( const KeyValues &section );
+
+		// Carries on as if 'kv' was just written, or the section 'kv' just opened or closed
+		void continueAfter( const KeyValues &kv );
+
+	private:
+		// Sections are walked with an explicit stack like the parser does, rather than through recursion
+		using Position = std::pair< KeyValues::const_iterator, KeyValues::const_iterator >;
+
+		void writeString( const std::string_view &str );
+		void writeIndent( size_t depth );
+		void writeKeyValue( const KeyValues &kv );
+		void beginSection( const KeyValues &section );
+		void endSection( const KeyValues &section );
+		void endTopLevel( const KeyValues &kv ); // Compact only, top level nodes end with a line break
+
+		Output &output;
+		bool compact;
+		bool separate = false; // Compact only, the last string was written bare and a bare string after it needs a space
+		std::vector< Position > sections;
+	};
+
+	// Serializes a document on several threads, writing the same text as a Serializer would. The document is
+	// cut into pieces: top level nodes, or when there are too few of them the children of sections along with
+	// the start and end of the section. Pieces are measured in parallel first, then runs of them are written
+	// in parallel straight to where they belong in the output.
+	class ParallelSerializer
+	{
+	public:
+		ParallelSerializer( const KeyValues &root, const SaveOptions &options, size_t threadCount );
+
+		// Whether there's enough to share out, the serial path is used otherwise
+		bool canSplit() const { return ( threadCount > 1 && pieces.size() > 1 && large ); }
+
+		void saveToBuffer( std::string &out );
+		bool saveToFile( const std::string &path ); // With positional writes, returns false if the file couldn't be written
+
+	private:
+		struct Piece
+		{
+			enum class Kind : uint8_t
+			{
+				Node, // The node and everything below it
+				Open,
+				Close
+			};
+
+			const KeyValues *kv;
+			Kind kind;
+		};
+
+		// Measures pieces on this thread until there's enough output for two runs, sets 'large' if there is
+		void measureStart();
+		void measure(); // The rest of the pieces, in parallel
+
+		// Smaller runs cost more in thread handoffs than they win back
+		static constexpr const size_t cMinRunSize = 64 * 1024;
+
+		// Cuts the pieces into runs of roughly equal size, returns the end of every run
+		std::vector< size_t > cutRuns() const;
+
+		template< typename Output >
+		void writeRun( Output &output, size_t first, size_t last ) const;
+
+		template< typename Output >
+		static void writePiece( Serializer< Output > &serializer, const Piece &piece );
+
+		SaveOptions options;
+		size_t threadCount;
+		std::vector< Piece > pieces;
+		std::vector< size_t > offsets; // Of every piece in the output, followed by the output's size
+		size_t measured = 0; // Pieces measured by measureStart
+		bool large = false;
+	};
+}
@@ -0,0 +1,521 @@
+#include "snapshot.hpp"
+#include "mappedfile.hpp"
+
+#include <cstring>
+#include <algorithm>
+#include <vector>
+#include <unordered_map>
+#include <stdexcept>
+#include <system_error>
+#include <filesystem>
+#include <thread>
+#include <cstdio>
+
+namespace KV
+{
+	namespace
+	{
+		// Sections with more children than this get an index, the same threshold ChildContainer uses
+		constexpr const size_t cIndexThreshold = 16;
+
+		constexpr size_t AlignUp( size_t offset )
+		{
+			return ( offset + 7 ) & ~size_t( 7 );
+		}
+
+		const SnapshotHeader &GetHeader( const char *base )
+		{
+			return *reinterpret_cast< const SnapshotHeader* >( base );
+		}
+
+		const SnapshotNode *GetNodes( const char *base )
+		{
+			return reinterpret_cast< const SnapshotNode* >( base + GetHeader( base ).nodesOffset );
+		}
+
+		const uint32_t *GetIndex( const char *base )
+		{
+			return reinterpret_cast< const uint32_t* >( base + GetHeader( base ).indexOffset );
+		}
+
+		// Whether [ offset, offset + size ) lies within 'limit' bytes
+		bool InBounds( uint64_t offset, uint64_t size, uint64_t limit )
+		{
+			return ( offset <= limit && size <= limit - offset );
+		}
+	}
+
+	uint64_t HashBytes( const std::string_view &data, uint64_t seed /*= 0*/ )
+	{
+		constexpr const uint64_t m = 0xc6a4a7935bd1e995ull;
+		constexpr const int r = 47;
+
+		const unsigned char *bytes = reinterpret_cast< const unsigned char* >( data.data() );
+		const size_t size = data.size();
+		uint64_t h = seed ^ ( size * m );
+
+		auto load = [ bytes ]( size_t offset, size_t count )
+		{
+			uint64_t word = 0;
+			for ( size_t i = 0; i < count; ++i )
+				word |= static_cast< uint64_t >( bytes[ offset + i ] ) << ( i * 8 );
+
+			return word;
+		};
+
+		size_t offset = 0;
+		for ( ; size - offset >= 8; offset += 8 )
+		{
+			uint64_t k = load( offset, 8 );
+
+			k *= m;
+			k ^= k >> r;
+			k *= m;
+
+			h ^= k;
+			h *= m;
+		}
+
+		if ( offset < size )
+		{
+			h ^= load( offset, size - offset );
+			h *= m;
+		}
+
+		h ^= h >> r;
+		h *= m;
+		h ^= h >> r;
+
+		return h;
+	}
+
+	uint64_t HashValue( const std::string_view &value )
+	{
+		// Seeded apart from sections, so an empty value and an empty section differ
+		return HashBytes( value, ~cSectionHash );
+	}
+
+	uint64_t HashChild( uint64_t sectionHash, const std::string_view &key, uint64_t childHash )
+	{
+		char bytes[ 8 ];
+		for ( size_t i = 0; i < sizeof( bytes ); ++i )
+			bytes[ i ] = static_cast< char >( childHash >> ( i * 8 ) );
+
+		return HashBytes( std::string_view( bytes, sizeof( bytes ) ), HashBytes( key, sectionHash ) );
+	}
+
+	bool SnapshotWriter::write( const KeyValues &root, std::string &out )
+	{
+		// Breadth first, so every node's children end up next to each other
+		std::vector< const KeyValues* > order = { &root };
+		std::vector< uint32_t > depths = { 0 };
+
+		for ( size_t i = 0; i < order.size(); ++i )
+		{
+			for ( const KeyValues &kv : *order[ i ] )
+			{
+				order.push_back( &kv );
+				depths.push_back( depths[ i ] + 1 );
+			}
+
+			if ( order.size() >= SnapshotNode::cNoIndex )
+				return false;
+		}
+
+		std::vector< SnapshotNode > nodes( order.size() );
+		std::vector< uint32_t > index;
+		std::string strings;
+
+		// Keys in particular repeat a lot, every distinct string is only stored once
+		std::unordered_map< std::string_view, uint64_t > pooled;
+
+		auto pool = [ & ]( const std::string_view &str, bool stable )
+		{
+			if ( stable )
+			{
+				if ( auto it = pooled.find( str ); it != pooled.end() )
+					return it->second;
+			}
+
+			const uint64_t offset = strings.size();
+			strings.append( str );
+			strings.push_back( '\0' );
+
+			if ( stable )
+				pooled.emplace( str, offset );
+
+			return offset;
+		};
+
+		for ( size_t i = 0, nextChild = 1; i < order.size(); ++i )
+		{
+			const KeyValues &kv = *order[ i ];
+			SnapshotNode &node = nodes[ i ];
+
+			node.key = pool( kv.key.view(), true );
+			node.keyLength = static_cast< uint32_t >( kv.key.view().size() );
+			node.value = 0;
+			node.valueLength = 0;
+			node.flags = 0;
+			node.firstIndex = SnapshotNode::cNoIndex;
+
+			if ( kv.hasValue )
+			{
+				// Numbers are written out as text, which only lives in 'buffer' so it can't be looked up later
+				KeyValues::NumberBuffer buffer;
+				const std::string_view value = kv.getValueText( buffer );
+
+				node.value = pool( value, !kv.valueIsNumber );
+				node.valueLength = static_cast< uint32_t >( value.size() );
+				node.flags |= SnapshotNode::cHasValue;
+			}
+
+			node.firstChild = static_cast< uint32_t >( nextChild );
+			node.childCount = static_cast< uint32_t >( kv.keyvalues.size() );
+			nextChild += node.childCount;
+
+			if ( node.childCount > cIndexThreshold )
+			{
+				node.firstIndex = static_cast< uint32_t >( index.size() );
+
+				for ( uint32_t child = node.firstChild; child < node.firstChild + node.childCount; ++child )
+					index.push_back( child );
+
+				std::stable_sort( index.begin() + node.firstIndex, index.end(), [ &order ]( uint32_t a, uint32_t b )
+				{
+					return ( order[ a ]->key.view() < order[ b ]->key.view() );
+				} );
+			}
+		}
+
+		SnapshotHeader header = {};
+		header.magic = SnapshotHeader::cMagic;
+		header.version = SnapshotHeader::cVersion;
+		header.byteOrder = SnapshotHeader::cByteOrder;
+		header.nodeCount = nodes.size();
+		header.indexCount = index.size();
+		header.nodesOffset = AlignUp( sizeof( SnapshotHeader ) );
+		header.indexOffset = AlignUp( header.nodesOffset + nodes.size() * sizeof( SnapshotNode ) );
+		header.stringsOffset = header.indexOffset + index.size() * sizeof( uint32_t );
+		header.stringsSize = strings.size();
+
+		// Counted like the parser counts nesting, values don't add to it
+		for ( size_t i = 0; i < order.size(); ++i )
+		{
+			if ( !order[ i ]->hasValue )
+				header.maxDepth = std::max( header.maxDepth, depths[ i ] );
+		}
+
+		out.assign( header.stringsOffset + strings.size(), '\0' );
+		std::memcpy( &out[ 0 ], &header, sizeof( header ) );
+		std::memcpy( &out[ header.nodesOffset ], nodes.data(), nodes.size() * sizeof( SnapshotNode ) );
+		if ( !index.empty() )
+			std::memcpy( &out[ header.indexOffset ], index.data(), index.size() * sizeof( uint32_t ) );
+
+		if ( !strings.empty() )
+			std::memcpy( &out[ header.stringsOffset ], strings.data(), strings.size() );
+
+		return true;
+	}
+
+	bool ValidateSnapshot( const std::string_view &data )
+	{
+		if ( data.size() < sizeof( SnapshotHeader ) || reinterpret_cast< uintptr_t >( data.data() ) % 8 != 0 )
+			return false;
+
+		const SnapshotHeader &header = GetHeader( data.data() );
+
+		if ( header.magic != SnapshotHeader::cMagic || header.version != SnapshotHeader::cVersion || header.byteOrder != SnapshotHeader::cByteOrder )
+			return false;
+
+		if ( header.nodeCount == 0 || header.nodeCount >= SnapshotNode::cNoIndex || header.indexCount >= SnapshotNode::cNoIndex )
+			return false;
+
+		if ( header.nodesOffset % 8 != 0 || !InBounds( header.nodesOffset, header.nodeCount * sizeof( SnapshotNode ), data.size() ) ||
+			header.indexOffset % 4 != 0 || !InBounds( header.indexOffset, header.indexCount * sizeof( uint32_t ), data.size() ) ||
+			!InBounds( header.stringsOffset, header.stringsSize, data.size() ) )
+			return false;
+
+		const SnapshotNode *nodes = GetNodes( data.data() );
+		const uint32_t *index = GetIndex( data.data() );
+		uint64_t nextChild = 1;
+
+		for ( uint64_t i = 0; i < header.nodeCount; ++i )
+		{
+			const SnapshotNode &node = nodes[ i ];
+
+			if ( !InBounds( node.key, node.keyLength, header.stringsSize ) || !InBounds( node.value, node.valueLength, header.stringsSize ) )
+				return false;
+
+			// Children have to be laid out breadth first, which makes every node but the root the child of exactly one node
+			// that comes before it
+			if ( node.childCount > 0 && ( node.firstChild <= i || node.firstChild != nextChild || !InBounds( node.firstChild, node.childCount, header.nodeCount ) ) )
+				return false;
+
+			nextChild += node.childCount;
+
+			if ( node.firstIndex != SnapshotNode::cNoIndex )
+			{
+				if ( !InBounds( node.firstIndex, node.childCount, header.indexCount ) )
+					return false;
+
+				for ( uint32_t j = 0; j < node.childCount; ++j )
+				{
+					const uint32_t child = index[ node.firstIndex + j ];
+					if ( child < node.firstChild || child - node.firstChild >= node.childCount )
+						return false;
+				}
+			}
+		}
+
+		return ( nextChild == header.nodeCount );
+	}
+
+	SnapshotView::const_iterator SnapshotView::const_iterator::operator++()
+	{
+		++node;
+		return *this;
+	}
+
+	bool SnapshotView::isSection() const
+	{
+		return ( node && !( node->flags & SnapshotNode::cHasValue ) );
+	}
+
+	size_t SnapshotView::getChildCount() const
+	{
+		return ( node ) ? node->childCount : 0;
+	}
+
+	std::string_view SnapshotView::getKey() const
+	{
+		return ( node ) ? getString( node->key, node->keyLength ) : std::string_view();
+	}
+
+	std::string_view SnapshotView::getValue( const std::string_view &defaultVal /*= std::string_view()*/ ) const
+	{
+		if ( !node || !( node->flags & SnapshotNode::cHasValue ) )
+			return defaultVal;
+
+		return getString( node->value, node->valueLength );
+	}
+
+	SnapshotView SnapshotView::get( const std::string_view &name, size_t index /*= 0*/ ) const
+	{
+		if ( !node )
+			return SnapshotView();
+
+		const SnapshotNode *children = GetNodes( base ) + node->firstChild;
+
+		if ( node->firstIndex == SnapshotNode::cNoIndex )
+		{
+			for ( uint32_t i = 0; i < node->childCount; ++i )
+			{
+				if ( getString( children[ i ].key, children[ i ].keyLength ) == name && index-- == 0 )
+					return SnapshotView( base, &children[ i ] );
+			}
+
+			return SnapshotView();
+		}
+
+		const SnapshotNode *nodes = GetNodes( base );
+		const uint32_t *first = GetIndex( base ) + node->firstIndex;
+		const uint32_t *last = first + node->childCount;
+
+		const uint32_t *found = std::lower_bound( first, last, name, [ this, nodes ]( uint32_t child, const std::string_view &key )
+		{
+			return ( getString( nodes[ child ].key, nodes[ child ].keyLength ) < key );
+		} );
+
+		if ( index >= static_cast< size_t >( last - found ) )
+			return SnapshotView();
+
+		found += index;
+		if ( getString( nodes[ *found ].key, nodes[ *found ].keyLength ) != name )
+			return SnapshotView();
+
+		return SnapshotView( base, &nodes[ *found ] );
+	}
+
+	size_t SnapshotView::getCount( const std::string_view &name ) const
+	{
+		size_t count = 0;
+		for ( const SnapshotView child : *this )
+		{
+			if ( child.getKey() == name )
+				++count;
+		}
+
+		return count;
+	}
+
+	std::string_view SnapshotView::getKeyValue( const std::string_view &keyName, const std::string_view &defaultVal /*= std::string_view()*/ ) const
+	{
+		return get( keyName ).getValue( defaultVal );
+	}
+
+	SnapshotView::const_iterator SnapshotView::begin() const
+	{
+		return ( node ) ? const_iterator( base, GetNodes( base ) + node->firstChild ) : const_iterator( nullptr, nullptr );
+	}
+
+	SnapshotView::const_iterator SnapshotView::end() const
+	{
+		return ( node ) ? const_iterator( base, GetNodes( base ) + node->firstChild + node->childCount ) : const_iterator( nullptr, nullptr );
+	}
+
+	std::string_view SnapshotView::getString( uint64_t offset, uint32_t length ) const
+	{
+		return std::string_view( base + GetHeader( base ).stringsOffset + offset, length );
+	}
+
+	Snapshot::Snapshot( std::shared_ptr< const void > owner, const std::string_view &data ) :
+		owner( std::move( owner ) ),
+		data( data )
+	{
+		if ( !ValidateSnapshot( data ) )
+			throw std::runtime_error( "Not a valid KeyValues snapshot" );
+	}
+
+	Snapshot Snapshot::fromFile( const std::string &path )
+	{
+		auto file = std::make_shared< const MappedFile >( path );
+		const std::string_view view = file->view();
+
+		return Snapshot( std::move( file ), view );
+	}
+
+	Snapshot Snapshot::fromBuffer( const std::string_view &buffer )
+	{
+		// Copied into 8 byte aligned storage, the nodes are read in place
+		auto storage = std::make_shared< std::vector< uint64_t > >( ( buffer.size() + 7 ) / 8 );
+		if ( !buffer.empty() )
+			std::memcpy( storage->data(), buffer.data(), buffer.size() );
+
+		const std::string_view view( reinterpret_cast< const char* >( storage->data() ), buffer.size() );
+		return Snapshot( std::move( storage ), view );
+	}
+
+	SnapshotView Snapshot::getRoot() const
+	{
+		return SnapshotView( data.data(), GetNodes( data.data() ) );
+	}
+
+	size_t Snapshot::getNodeCount() const
+	{
+		return static_cast< size_t >( GetHeader( data.data() ).nodeCount );
+	}
+
+	KeyValues Snapshot::toKeyValues( const ParseOptions &options /*= ParseOptions()*/ ) const
+	{
+		KeyValues root = ( options.useArena ) ? KeyValues( std::make_unique< KeyValues::Arena >( std::max( options.arenaBlockSize, data.size() ) ) ) : KeyValues();
+		root.cacheNumbers = options.cacheNumericValues;
+
+		if ( options.zeroCopy )
+			root.source = owner;
+
+		const char *base = data.data();
+		const SnapshotNode *nodes = GetNodes( base );
+		const size_t nodeCount = getNodeCount();
+
+		// Nodes come breadth first, so every parent is created before its children
+		std::vector< KeyValues* > created( nodeCount, nullptr );
+		created[ 0 ] = &root;
+
+		for ( size_t i = 0; i < nodeCount; ++i )
+		{
+			const SnapshotNode &node = nodes[ i ];
+			KeyValues &parent = *created[ i ];
+
+			for ( uint32_t child = node.firstChild; child < node.firstChild + node.childCount; ++child )
+			{
+				const SnapshotView view( base, &nodes[ child ] );
+
+				if ( view.isSection() )
+					created[ child ] = &( ( options.zeroCopy ) ? parent.createBorrowedKey( view.getKey() ) : parent.createKey( view.getKey() ) );
+				else
+					created[ child ] = &( ( options.zeroCopy ) ? parent.createBorrowedKeyValue( view.getKey(), view.getValue() ) : parent.createKeyValue( view.getKey(), view.getValue() ) );
+			}
+		}
+
+		return root;
+	}
+
+	SnapshotCache::SnapshotCache( const std::string &directory, const std::string &sourcePath, const std::string_view &source, uint64_t conditionsHash ) :
+		directory( directory ),
+		sourceSize( source.size() ),
+		sourceHash( HashBytes( source ) ),
+		conditionsHash( conditionsHash )
+	{
+		char name[ 32 ];
+		std::snprintf( name, sizeof( name ), "%016llx.kvsnap", static_cast< unsigned long long >( HashBytes( sourcePath ) ) );
+
+		cachePath = ( std::filesystem::path( directory ) / name ).string();
+	}
+
+	std::optional< KeyValues > SnapshotCache::load( const ParseOptions &options ) const
+	{
+		std::shared_ptr< const MappedFile > file;
+
+		try
+		{
+			file = std::make_shared< const MappedFile >( cachePath );
+		}
+		catch ( const std::system_error & )
+		{
+			return std::nullopt;
+		}
+
+		const std::string_view data = file->view();
+		if ( !ValidateSnapshot( data ) )
+			return std::nullopt;
+
+		const SnapshotHeader &header = GetHeader( data.data() );
+
+		if ( header.sourceSize != sourceSize || header.sourceHash != sourceHash || header.conditionsHash != conditionsHash )
+			return std::nullopt;
+
+		// The parse would have failed, leave it to report why
+		if ( sourceSize > options.maxInputSize || header.maxDepth > options.maxDepth || header.nodeCount - 1 > options.maxNodes )
+			return std::nullopt;
+
+		return Snapshot( file, data ).toKeyValues( options );
+	}
+
+	void SnapshotCache::store( const KeyValues &document ) const
+	{
+		std::string snapshot;
+		if ( !SnapshotWriter::write( document, snapshot ) )
+			return;
+
+		SnapshotHeader header;
+		std::memcpy( &header, snapshot.data(), sizeof( header ) );
+
+		header.sourceSize = sourceSize;
+		header.sourceHash = sourceHash;
+		header.conditionsHash = conditionsHash;
+
+		std::memcpy( &snapshot[ 0 ], &header, sizeof( header ) );
+
+		// Written next to its final name and moved over it, so readers never see half a snapshot
+		std::error_code error;
+		std::filesystem::create_directories( directory, error );
+
+		const std::string tempPath = cachePath + "." + std::to_string( std::hash< std::thread::id >()( std::this_thread::get_id() ) ) + ".tmp";
+
+		FILE *file = std::fopen( tempPath.c_str(), "wb" );
+		if ( !file )
+			return;
+
+		const bool written = ( std::fwrite( snapshot.data(), 1, snapshot.size(), file ) == snapshot.size() );
+		if ( std::fclose( file ) != 0 || !written )
+		{
+			std::filesystem::remove( tempPath, error );
+			return;
+		}
+
+		std::filesystem::rename( tempPath, cachePath, error );
+		if ( error )
+			std::filesystem::remove( tempPath, error );
+	}
+}
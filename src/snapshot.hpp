@@ -0,0 +1,97 @@
+#pragma once
+
+#include "keyvalues.hpp"
+
+#include <string_view>
+#include <string>
+#include <cstdint>
+#include <optional>
+
+namespace KV
+{
+	// Layout of a snapshot, every offset is in bytes from its start:
+	//   SnapshotHeader
+	//   SnapshotNode[ nodeCount ], breadth first so the children of every node are next to each other, the root first
+	//   uint32_t[ indexCount ], the children of large sections sorted by key, and by position among equal keys
+	//   String pool, every string null terminated
+	// Numbers are stored in the byte order of the machine that wrote the snapshot, byteOrder tells which one it was.
+	struct SnapshotHeader
+	{
+		static constexpr uint32_t cMagic = 0x534e564b; // "KVNS"
+		static constexpr uint32_t cVersion = 1;
+		static constexpr uint32_t cByteOrder = 0x01020304;
+
+		uint32_t magic;
+		uint32_t version;
+		uint32_t byteOrder;
+		uint32_t maxDepth; // Nesting of sections
+		uint64_t nodeCount;
+		uint64_t indexCount;
+		uint64_t nodesOffset;
+		uint64_t indexOffset;
+		uint64_t stringsOffset;
+		uint64_t stringsSize;
+
+		// Set when the snapshot caches a parsed file, see ParseOptions::snapshotCacheDirectory
+		uint64_t sourceSize;
+		uint64_t sourceHash;
+		uint64_t conditionsHash;
+	};
+
+	struct SnapshotNode
+	{
+		static constexpr uint32_t cNoIndex = UINT32_MAX;
+		static constexpr uint32_t cHasValue = 1 << 0;
+
+		uint64_t key; // Offsets into the string pool
+		uint64_t value;
+		uint32_t keyLength;
+		uint32_t valueLength;
+		uint32_t firstChild;
+		uint32_t childCount;
+		uint32_t firstIndex; // Into the child index, cNoIndex for sections small enough to be searched linearly
+		uint32_t flags;
+	};
+
+	// 64 bit MurmurHash2, stable across platforms and runs so it can be stored
+	uint64_t HashBytes( const std::string_view &data, uint64_t seed = 0 );
+
+	// Content hashes of nodes, see KeyValues::getContentHash. A section's hash starts out as cSectionHash and takes in the
+	// key and hash of each of its children in turn.
+	constexpr const uint64_t cSectionHash = 0x9e3779b97f4a7c15ull;
+
+	uint64_t HashValue( const std::string_view &value );
+	uint64_t HashChild( uint64_t sectionHash, const std::string_view &key, uint64_t childHash );
+
+	// Flattens a document into a snapshot
+	class SnapshotWriter
+	{
+	public:
+		// Returns false if the document has too many nodes for the format
+		static bool write( const KeyValues &root, std::string &out );
+	};
+
+	// Returns false unless 'data' is a snapshot whose every offset is in bounds, so it can be read without further checks
+	bool ValidateSnapshot( const std::string_view &data );
+
+	// Snapshots of parsed files, stored in a directory as one file per source path. A snapshot is only used if it
+	// was made from a file with the same contents, parsed with the same conditions.
+	class SnapshotCache
+	{
+	public:
+		SnapshotCache( const std::string &directory, const std::string &sourcePath, const std::string_view &source, uint64_t conditionsHash );
+
+		// Returns nothing if there's no usable snapshot, or it holds more than 'options' allows
+		std::optional< KeyValues > load( const ParseOptions &options ) const;
+
+		// Failing to write the snapshot isn't an error, the next parse just misses the cache again
+		void store( const KeyValues &document ) const;
+
+	private:
+		std::string directory;
+		std::string cachePath;
+		uint64_t sourceSize;
+		uint64_t sourceHash;
+		uint64_t conditionsHash;
+	};
+}